@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "arena.h"
+
+// prefer the node, but fall back to others when it is full
+#define MPOL_PREFERRED_NODE (1)
+
+/**
+ * Sits in front of every block. Blocks which did not fit in a region come
+ * from malloc, header and all.
+ */
+struct block_header {
+    uint32_t size;
+    uint32_t allocated;
+    uint64_t padding;
+};
+
+// HELPER FUNCTIONS
+
+static struct block_header* header_of(void* block) {
+    return (struct block_header*) block - 1;
+}
+
+static void* map_huge(size_t bytes) {
+#ifdef MAP_HUGETLB
+    void* region = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    return region == MAP_FAILED ? NULL : region;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * Maps twice the region and trims it down to a huge page boundary, so the
+ * kernel may back it with a transparent huge page.
+ */
+static void* map_aligned(size_t bytes) {
+    uint8_t* mapped = mmap(NULL, bytes * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        return NULL;
+    }
+
+    uint8_t* region = (uint8_t*) (((uintptr_t) mapped + bytes - 1) & ~(uintptr_t) (bytes - 1));
+    if (region > mapped) {
+        munmap(mapped, region - mapped);
+    }
+
+    munmap(region + bytes, mapped + bytes * 2 - (region + bytes));
+
+#ifdef MADV_HUGEPAGE
+    madvise(region, bytes, MADV_HUGEPAGE);
+#endif
+    return region;
+}
+
+/**
+ * Starts carving blocks out of a new region, placed on the arena's node
+ * before any of it is touched. Returns 1 if the system has no memory left
+ * to map.
+ */
+static int add_region(struct arena* arena) {
+    void* region = map_huge(ARENA_REGION_BYTES);
+    arena->huge_regions += region != NULL;
+    region = region ? region : map_aligned(ARENA_REGION_BYTES);
+    if (region == NULL) {
+        return 1;
+    }
+
+    if (arena->node >= 0) {
+        unsigned long mask = 1UL << arena->node;
+        syscall(SYS_mbind, region, ARENA_REGION_BYTES, MPOL_PREFERRED_NODE, &mask, sizeof(mask) * 8, 0);
+    }
+
+    arena->regions = realloc(arena->regions, (arena->num_regions + 1) * sizeof(void*));
+    arena->regions[arena->num_regions++] = region;
+    arena->cursor = region;
+    arena->end = arena->cursor + ARENA_REGION_BYTES;
+    return 0;
+}
+
+static void* allocate_outside(size_t size) {
+    struct block_header* header = malloc(sizeof(struct block_header) + size);
+    header->size = size;
+    header->allocated = 1;
+    return header + 1;
+}
+
+// ARENA
+
+/**
+ * An arena whose regions are placed on the given NUMA node, or left where
+ * they are first touched for a node of -1.
+ */
+struct arena* arena_create(int node) {
+    struct arena* arena = calloc(1, sizeof(struct arena));
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->node = node < (int) sizeof(unsigned long) * 8 ? node : -1;
+    return arena;
+}
+
+/**
+ * Unmaps every region, so every block of the arena must be freed or no
+ * longer used by then. Blocks which came from malloc must have been freed.
+ */
+void arena_destroy(struct arena* arena) {
+    for (uint32_t i = 0; i < arena->num_regions; i++) {
+        munmap(arena->regions[i], ARENA_REGION_BYTES);
+    }
+
+    pthread_mutex_destroy(&arena->lock);
+    free(arena->regions);
+    free(arena);
+}
+
+/**
+ * Number of NUMA nodes the system has online, 1 where it cannot be read.
+ */
+int arena_nodes() {
+    FILE* online = fopen("/sys/devices/system/node/online", "r");
+    if (online == NULL) {
+        return 1;
+    }
+
+    // a list of ranges such as 0-3,5, of which the last holds the highest
+    int low = 0, high = 0, nodes = 1;
+    while (fscanf(online, "%d", &low) == 1) {
+        // a single node has no high end, leaving high at low
+        high = low;
+        fscanf(online, "-%d", &high);
+        nodes = high + 1;
+        if (fgetc(online) != ',') {
+            break;
+        }
+    }
+
+    fclose(online);
+    return nodes;
+}
+
+// BLOCKS
+
+/**
+ * A block of size bytes from the arena, or from malloc for a NULL arena.
+ */
+void* arena_alloc(struct arena* arena, size_t size) {
+    if (arena == NULL) {
+        return malloc(size);
+    }
+
+    size_t rounded = (size + ARENA_GRAIN - 1) / ARENA_GRAIN * ARENA_GRAIN;
+    rounded = rounded ? rounded : ARENA_GRAIN;
+    if (rounded > ARENA_LARGE_BYTES) {
+        return allocate_outside(size);
+    }
+
+    uint32_t class = rounded / ARENA_GRAIN - 1;
+    pthread_mutex_lock(&arena->lock);
+
+    void* block = arena->free_lists[class];
+    if (block) {
+        arena->free_lists[class] = *(void**) block;
+        pthread_mutex_unlock(&arena->lock);
+        return block;
+    }
+
+    size_t needed = sizeof(struct block_header) + rounded;
+    if (arena->end - arena->cursor < needed && add_region(arena)) {
+        pthread_mutex_unlock(&arena->lock);
+        return allocate_outside(size);
+    }
+
+    struct block_header* header = (struct block_header*) arena->cursor;
+    header->size = rounded;
+    header->allocated = 0;
+    arena->cursor += needed;
+    pthread_mutex_unlock(&arena->lock);
+    return header + 1;
+}
+
+/**
+ * Hands a block back to the arena it came from, or to free for a NULL
+ * arena.
+ */
+void arena_free(struct arena* arena, void* block) {
+    if (arena == NULL || block == NULL) {
+        free(block);
+        return;
+    }
+
+    struct block_header* header = header_of(block);
+    if (header->allocated) {
+        free(header);
+        return;
+    }
+
+    uint32_t class = header->size / ARENA_GRAIN - 1;
+    pthread_mutex_lock(&arena->lock);
+    *(void**) block = arena->free_lists[class];
+    arena->free_lists[class] = block;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+size_t arena_usable_size(struct arena* arena, void* block) {
+    return arena ? header_of(block)->size : malloc_usable_size(block);
+}
@@ -0,0 +1,57 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// memory is taken from the system a huge page at a time
+#define ARENA_REGION_BYTES (2UL << 20)
+
+// blocks are rounded up to a multiple of this, and larger blocks than
+// ARENA_LARGE_BYTES come from malloc instead
+#define ARENA_GRAIN (16)
+#define ARENA_LARGE_BYTES (64 * 1024)
+#define ARENA_CLASSES (ARENA_LARGE_BYTES / ARENA_GRAIN)
+
+/**
+ * Fixed size blocks carved out of huge page regions, so nodes allocated
+ * together share TLB entries. Each block is preceded by its size, and freed
+ * blocks are kept on a list per size for the next block of that size.
+ * Regions are only returned to the system when the arena is destroyed.
+ */
+struct arena {
+    pthread_mutex_t lock;
+
+    // NUMA node regions are placed on, or -1 for wherever they are touched
+    int node;
+
+    uint8_t* cursor;
+    uint8_t* end;
+    void** regions;
+    uint32_t num_regions;
+
+    // regions mapped as huge pages up front, the others are only advised
+    // to become transparent huge pages
+    uint32_t huge_regions;
+
+    void* free_lists[ARENA_CLASSES];
+};
+
+// ARENA
+
+struct arena* arena_create(int node);
+
+void arena_destroy(struct arena* arena);
+
+int arena_nodes();
+
+// BLOCKS
+
+void* arena_alloc(struct arena* arena, size_t size);
+
+void arena_free(struct arena* arena, void* block);
+
+size_t arena_usable_size(struct arena* arena, void* block);
+
+#endif
@@ -0,0 +1,328 @@
+#include <unistd.h>
+
+#include "bench.h"
+
+/**
+ * Runs each workload against every combination of mode, branching and
+ * processor count given on the command line, and prints the throughput and
+ * latency percentiles of each run as a single JSON document.
+ *
+ *   bin/bench [-n ops] [-b 4,16,64] [-p 1,4] [-m btree,bplus,bepsilon]
+ */
+
+#define MAX_SWEEP (16)
+#define VALUE_SIZE (64)
+
+struct bench {
+    void* store;
+    enum store_mode mode;
+    uint16_t branching;
+    uint8_t processors;
+
+    uint64_t ops;
+    uint64_t* latencies;
+    uint64_t count;
+    size_t value_size;
+    double seconds;
+};
+
+static uint32_t ENCRYPT_KEY[4] = { 0x01234567, 0x89abcdef, 0xfedcba98, 0x76543210 };
+
+// HELPER FUNCTIONS
+
+/**
+ * A random permutation of 0 to count - 1.
+ */
+static uint64_t* shuffled(uint64_t count) {
+    uint64_t* order = malloc(count * sizeof(uint64_t));
+    for (uint64_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+
+    for (uint64_t i = count; i > 1; i--) {
+        uint64_t j = rand() % i;
+        uint64_t swap = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = swap;
+    }
+
+    return order;
+}
+
+static void fill(struct bench* bench, uint64_t* order, uint64_t count, size_t size) {
+    uint8_t* value = calloc(1, size + 1);
+    for (uint64_t i = 0; i < count; i++) {
+        bkey_t key = key_from_int(order ? order[i] : i);
+        btree_insert(key, value, size, ENCRYPT_KEY, i, bench->store);
+    }
+
+    free(value);
+}
+
+static void record(struct bench* bench, uint64_t start) {
+    bench->latencies[bench->count++] = now_ns() - start;
+}
+
+// WORKLOADS
+
+static void insert_sequential(struct bench* bench) {
+    uint8_t value[VALUE_SIZE] = { 0 };
+
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < bench->ops; i++) {
+        uint64_t start = now_ns();
+        btree_insert(key_from_int(i), value, VALUE_SIZE, ENCRYPT_KEY, i, bench->store);
+        record(bench, start);
+    }
+
+    bench->seconds = (now_ns() - begin) / 1e9;
+}
+
+static void insert_random(struct bench* bench) {
+    uint8_t value[VALUE_SIZE] = { 0 };
+    uint64_t* order = shuffled(bench->ops);
+
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < bench->ops; i++) {
+        uint64_t start = now_ns();
+        btree_insert(key_from_int(order[i]), value, VALUE_SIZE, ENCRYPT_KEY, i, bench->store);
+        record(bench, start);
+    }
+
+    bench->seconds = (now_ns() - begin) / 1e9;
+    free(order);
+}
+
+static void retrieve(struct bench* bench) {
+    uint64_t* order = shuffled(bench->ops);
+    fill(bench, order, bench->ops, VALUE_SIZE);
+
+    struct info found;
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < bench->ops; i++) {
+        uint64_t start = now_ns();
+        btree_retrieve(key_from_int(rand() % bench->ops), &found, bench->store);
+        record(bench, start);
+    }
+
+    bench->seconds = (now_ns() - begin) / 1e9;
+    free(order);
+}
+
+/**
+ * Decrypts random records of value_size bytes. Fewer records are used for
+ * larger values so every size takes a similar amount of time.
+ */
+static void decrypt(struct bench* bench) {
+    uint64_t records = bench->ops / (1 + bench->value_size / 256);
+    records = (records > 16) ? records : 16;
+    fill(bench, NULL, records, bench->value_size);
+
+    // fill inserts zeroed values
+    uint8_t* output = calloc(1, bench->value_size + 8);
+    check_decrypt(bench->store, key_from_int(0), output, bench->value_size);
+
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < records; i++) {
+        uint64_t start = now_ns();
+        btree_decrypt(key_from_int(rand() % records), output, bench->store);
+        record(bench, start);
+    }
+
+    bench->seconds = (now_ns() - begin) / 1e9;
+    free(output);
+}
+
+static void delete(struct bench* bench) {
+    uint64_t* order = shuffled(bench->ops);
+    fill(bench, NULL, bench->ops, VALUE_SIZE);
+
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < bench->ops; i++) {
+        uint64_t start = now_ns();
+        btree_delete(key_from_int(order[i]), bench->store);
+        record(bench, start);
+    }
+
+    bench->seconds = (now_ns() - begin) / 1e9;
+    free(order);
+}
+
+/**
+ * Reads a random key for the given percentage of operations, and otherwise
+ * writes it, deleting the key if present or inserting it if not, so the
+ * store stays at around half of the key space.
+ */
+static void mixed(struct bench* bench, int read_percent) {
+    uint64_t space = bench->ops;
+    uint8_t* present = calloc(space, 1);
+    uint8_t value[VALUE_SIZE] = { 0 };
+
+    for (uint64_t i = 0; i < space; i += 2) {
+        btree_insert(key_from_int(i), value, VALUE_SIZE, ENCRYPT_KEY, i, bench->store);
+        present[i] = 1;
+    }
+
+    struct info found;
+    uint64_t begin = now_ns();
+    for (uint64_t i = 0; i < bench->ops; i++) {
+        uint64_t target = rand() % space;
+        int read = rand() % 100 < read_percent;
+
+        uint64_t start = now_ns();
+        if (read) {
+            btree_retrieve(key_from_int(target), &found, bench->store);
+        } else if (present[target]) {
+            btree_delete(key_from_int(target), bench->store);
+        } else {
+            btree_insert(key_from_int(target), value, VALUE_SIZE, ENCRYPT_KEY, i, bench->store);
+        }
+
+        record(bench, start);
+        present[target] ^= !read;
+    }
+
+    bench->seconds = (now_ns() - begin) / 1e9;
+    free(present);
+}
+
+static void mixed_50(struct bench* bench) {
+    mixed(bench, 50);
+}
+
+static void mixed_95(struct bench* bench) {
+    mixed(bench, 95);
+}
+
+static void export(struct bench* bench) {
+    fill(bench, NULL, bench->ops, VALUE_SIZE);
+
+    uint64_t begin = now_ns();
+    for (int i = 0; i < 10; i++) {
+        struct node* list = NULL;
+
+        uint64_t start = now_ns();
+        uint64_t count = btree_export(bench->store, &list);
+        record(bench, start);
+
+        for (uint64_t j = 0; j < count; j++) {
+            free(list[j].keys);
+        }
+
+        free(list);
+    }
+
+    bench->seconds = (now_ns() - begin) / 1e9;
+}
+
+static struct {
+    char name[24];
+    void (*function)(struct bench* bench);
+    size_t value_size;
+} WORKLOADS[] = {
+    { "insert_sequential", &insert_sequential, VALUE_SIZE },
+    { "insert_random",     &insert_random,     VALUE_SIZE },
+    { "retrieve",          &retrieve,          VALUE_SIZE },
+    { "decrypt",           &decrypt,           8          },
+    { "decrypt",           &decrypt,           256        },
+    { "decrypt",           &decrypt,           4096       },
+    { "decrypt",           &decrypt,           65536      },
+    { "delete",            &delete,            VALUE_SIZE },
+    { "mixed_50_50",       &mixed_50,          VALUE_SIZE },
+    { "mixed_95_5",        &mixed_95,          VALUE_SIZE },
+    { "export",            &export,            VALUE_SIZE },
+};
+
+// DRIVER
+
+static int parse_list(char* text, int values[MAX_SWEEP]) {
+    int count = 0;
+    for (char* token = strtok(text, ","); token && count < MAX_SWEEP; token = strtok(NULL, ",")) {
+        values[count++] = atoi(token);
+    }
+
+    return count;
+}
+
+static int parse_modes(char* text, int values[MAX_SWEEP]) {
+    int count = 0;
+    for (char* token = strtok(text, ","); token && count < MAX_SWEEP; token = strtok(NULL, ",")) {
+        int mode = parse_mode(token);
+        if (mode >= 0) {
+            values[count++] = mode;
+        }
+    }
+
+    return count;
+}
+
+static void report(struct bench* bench, const char* name, int first) {
+    qsort(bench->latencies, bench->count, sizeof(uint64_t), compare_u64);
+
+    printf("%s    {\"workload\": \"%s\", \"mode\": \"%s\", \"branching\": %u, \"processors\": %u, ",
+        first ? "" : ",\n", name, MODE_NAMES[bench->mode], bench->branching, bench->processors);
+    printf("\"value_size\": %zu, \"ops\": %" PRIu64 ", \"seconds\": %.6f, \"ops_per_sec\": %.1f, ",
+        bench->value_size, bench->count, bench->seconds, bench->count / (bench->seconds > 0 ? bench->seconds : 1e-9));
+    printf("\"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64 "}",
+        percentile(bench->latencies, bench->count, 0.5),
+        percentile(bench->latencies, bench->count, 0.99),
+        percentile(bench->latencies, bench->count, 0.999));
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    int branchings[MAX_SWEEP] = { 4, 16, 64 }, num_branchings = 3;
+    int processors[MAX_SWEEP] = { 1 }, num_processors = 1;
+    int modes[MAX_SWEEP] = { STORE_BTREE, STORE_BPLUS, STORE_BEPSILON }, num_modes = 3;
+    uint64_t ops = 10000;
+    int option;
+
+    while ((option = getopt(argc, argv, "n:b:p:m:")) != -1) {
+        switch (option) {
+            case 'n': ops = strtoull(optarg, NULL, 10); break;
+            case 'b': num_branchings = parse_list(optarg, branchings); break;
+            case 'p': num_processors = parse_list(optarg, processors); break;
+            case 'm': num_modes = parse_modes(optarg, modes); break;
+            default:
+                fprintf(stderr, "usage: %s [-n ops] [-b 4,16,64] [-p 1,4] [-m btree,bplus,bepsilon]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    printf("{\n  \"key_width\": %d,\n  \"ops\": %" PRIu64 ",\n  \"results\": [\n", BTREE_KEY_WIDTH, ops);
+
+    // at most one latency per operation, plus the records loaded beforehand
+    uint64_t* latencies = malloc(ops * sizeof(uint64_t) + 16 * sizeof(uint64_t));
+    int first = 1;
+
+    for (int m = 0; m < num_modes; m++) {
+        for (int b = 0; b < num_branchings; b++) {
+            for (int p = 0; p < num_processors; p++) {
+                for (int w = 0; w < sizeof(WORKLOADS)/sizeof(WORKLOADS[0]); w++) {
+                    struct store_options options = { .mode = modes[m] };
+                    struct bench bench = {
+                        .store = init_store_with(branchings[b], processors[p], &options),
+                        .mode = modes[m],
+                        .branching = branchings[b],
+                        .processors = processors[p],
+                        .ops = ops,
+                        .latencies = latencies,
+                        .count = 0,
+                        .value_size = WORKLOADS[w].value_size,
+                        .seconds = 0
+                    };
+
+                    srand(w + 1);
+                    WORKLOADS[w].function(&bench);
+                    report(&bench, WORKLOADS[w].name, first);
+                    close_store(bench.store);
+                    first = 0;
+                }
+            }
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    free(latencies);
+    return 0;
+}
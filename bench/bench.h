@@ -0,0 +1,64 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../btreestore.h"
+
+static const char* MODE_NAMES[] = { "btree", "bplus", "bepsilon", "topdown", "bwtree" };
+
+static inline uint64_t now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+/**
+ * Index of a mode in MODE_NAMES, or -1 if there is no such mode.
+ */
+static inline int parse_mode(const char* name) {
+    for (int mode = 0; mode < sizeof(MODE_NAMES)/sizeof(MODE_NAMES[0]); mode++) {
+        if (strcmp(name, MODE_NAMES[mode]) == 0) {
+            return mode;
+        }
+    }
+
+    return -1;
+}
+
+static inline int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * The latency at quantile q of latencies already sorted in ascending order.
+ */
+static inline uint64_t percentile(uint64_t* latencies, uint64_t count, double q) {
+    if (count == 0) {
+        return 0;
+    }
+
+    return latencies[(uint64_t) (q * (count - 1))];
+}
+
+/**
+ * Decrypts key and exits unless it holds the size bytes of value, so runs of
+ * a build which stopped round tripping values are never reported.
+ */
+static inline void check_decrypt(void* store, bkey_t key, const uint8_t* value, size_t size) {
+    uint8_t* output = malloc(size + 8);
+    if (btree_decrypt(key, output, store) != 0 || memcmp(output, value, size) != 0) {
+        fprintf(stderr, "decrypted value does not match the value inserted\n");
+        exit(1);
+    }
+
+    free(output);
+}
+
+#endif
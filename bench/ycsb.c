@@ -0,0 +1,432 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/**
+ * Replays the YCSB core workloads against the public store API from any
+ * number of threads, after loading the records from the same threads.
+ *
+ *   A  50% read, 50% update          D  95% read, 5% insert, latest keys
+ *   B  95% read, 5% update           E  95% scan, 5% insert
+ *   C  100% read                     F  50% read, 50% read-modify-write
+ *
+ * Reads decrypt the whole value, updates replace it through btree_update,
+ * which leaves the key in place in the index. Keys are drawn uniformly, from
+ * a scrambled Zipfian distribution spreading the popular keys across the key
+ * space, or from a Zipfian distribution over the most recently inserted keys.
+ *
+ *   bin/ycsb [-w A-F] [-d uniform|zipfian|latest] [-r records] [-n ops]
+ *            [-t threads] [-v value size] [-b branching] [-m mode] [-z theta]
+ *            [-T trace.json] [-P hash partitions] [-H] [-N]
+ *
+ * -H allocates tree nodes from huge page arenas, and -N also places each
+ * partition's arena on a NUMA node of its own.
+ */
+
+#define MAX_SCAN (100)
+
+enum operation {
+    OP_READ,
+    OP_UPDATE,
+    OP_INSERT,
+    OP_SCAN,
+    OP_MODIFY,
+    NUM_OPERATIONS
+};
+
+static const char* OPERATION_NAMES[] = { "read", "update", "insert", "scan", "read_modify_write" };
+
+enum distribution {
+    DIST_UNIFORM,
+    DIST_ZIPFIAN,
+    DIST_LATEST
+};
+
+static const char* DISTRIBUTION_NAMES[] = { "uniform", "zipfian", "latest" };
+
+static struct {
+    char name;
+    int percent[NUM_OPERATIONS];
+    enum distribution distribution;
+} WORKLOADS[] = {
+    { 'A', { 50,  50, 0,  0,  0  }, DIST_ZIPFIAN },
+    { 'B', { 95,  5,  0,  0,  0  }, DIST_ZIPFIAN },
+    { 'C', { 100, 0,  0,  0,  0  }, DIST_ZIPFIAN },
+    { 'D', { 95,  0,  5,  0,  0  }, DIST_LATEST  },
+    { 'E', { 0,   0,  5,  95, 0  }, DIST_ZIPFIAN },
+    { 'F', { 50,  0,  0,  0,  50 }, DIST_ZIPFIAN },
+};
+
+static uint32_t ENCRYPT_KEY[4] = { 0x01234567, 0x89abcdef, 0xfedcba98, 0x76543210 };
+
+/**
+ * Constants of the Zipfian generator from Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases", as used by YCSB.
+ */
+struct zipfian {
+    uint64_t items;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+struct driver {
+    void* store;
+    int workload;
+    enum distribution distribution;
+    struct zipfian zipfian;
+
+    uint64_t records;
+    uint64_t ops;
+    size_t value_size;
+    int threads;
+
+    // one past the newest key, records are keys 0 to next_key - 1
+    _Atomic uint64_t next_key;
+};
+
+struct worker {
+    pthread_t thread;
+    struct driver* driver;
+    int id;
+    uint64_t state;
+
+    uint64_t* latencies[NUM_OPERATIONS];
+    uint64_t counts[NUM_OPERATIONS];
+    uint64_t misses;
+};
+
+// HELPER FUNCTIONS
+
+static uint64_t next_random(struct worker* worker) {
+    // xorshift64*
+    worker->state ^= worker->state >> 12;
+    worker->state ^= worker->state << 25;
+    worker->state ^= worker->state >> 27;
+    return worker->state * 0x2545f4914f6cdd1dULL;
+}
+
+static double next_double(struct worker* worker) {
+    return (next_random(worker) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t fnv_hash(uint64_t value) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 8; i++) {
+        hash ^= (value >> (8 * i)) & 0xff;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static void zipfian_init(struct zipfian* zipfian, uint64_t items, double theta) {
+    double zeta2 = 1 + pow(0.5, theta);
+
+    zipfian->items = items;
+    zipfian->theta = theta;
+    zipfian->zetan = 0;
+    for (uint64_t i = 1; i <= items; i++) {
+        zipfian->zetan += 1 / pow(i, theta);
+    }
+
+    zipfian->alpha = 1 / (1 - theta);
+    zipfian->eta = (1 - pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zipfian->zetan);
+}
+
+/**
+ * A rank from 0 to items - 1, with rank 0 the most popular.
+ */
+static uint64_t zipfian_next(struct zipfian* zipfian, struct worker* worker) {
+    double u = next_double(worker);
+    double uz = u * zipfian->zetan;
+
+    if (uz < 1) {
+        return 0;
+    } else if (uz < 1 + pow(0.5, zipfian->theta)) {
+        return 1;
+    }
+
+    uint64_t rank = zipfian->items * pow(zipfian->eta * u - zipfian->eta + 1, zipfian->alpha);
+    return (rank < zipfian->items) ? rank : zipfian->items - 1;
+}
+
+/**
+ * Picks an existing key to operate on. The Zipfian generator is sized for
+ * the records loaded up front, which keeps the hottest keys stable as more
+ * are inserted.
+ */
+static uint64_t choose_key(struct worker* worker) {
+    struct driver* driver = worker->driver;
+    uint64_t newest = atomic_load(&driver->next_key);
+
+    switch (driver->distribution) {
+        case DIST_UNIFORM:
+            return next_random(worker) % newest;
+        case DIST_ZIPFIAN:
+            return fnv_hash(zipfian_next(&driver->zipfian, worker)) % newest;
+        default: {
+            uint64_t rank = zipfian_next(&driver->zipfian, worker);
+            return (rank < newest) ? newest - 1 - rank : 0;
+        }
+    }
+}
+
+static enum operation choose_operation(struct worker* worker) {
+    int* percent = WORKLOADS[worker->driver->workload].percent;
+    int roll = next_random(worker) % 100;
+
+    for (int op = 0; op < NUM_OPERATIONS; op++) {
+        if (roll < percent[op]) {
+            return op;
+        }
+
+        roll -= percent[op];
+    }
+
+    return OP_READ;
+}
+
+static int count_visit(bkey_t key, struct info* info, void* context) {
+    return 0;
+}
+
+// OPERATIONS
+
+/**
+ * Performs one operation, returning 1 if the key it needed was missing,
+ * which happens when another thread is midway through inserting it.
+ */
+static int perform(struct worker* worker, enum operation op, uint8_t* value, uint8_t* output) {
+    struct driver* driver = worker->driver;
+    void* store = driver->store;
+
+    if (op == OP_INSERT) {
+        uint64_t key = atomic_fetch_add(&driver->next_key, 1);
+        return btree_insert(key_from_int(key), value, driver->value_size, ENCRYPT_KEY, key, store) != 0;
+    }
+
+    uint64_t key = choose_key(worker);
+    switch (op) {
+        case OP_READ:
+            return btree_decrypt(key_from_int(key), output, store) != 0;
+        case OP_UPDATE:
+            return btree_update(key_from_int(key), value, driver->value_size, ENCRYPT_KEY, key, store) != 0;
+        case OP_SCAN: {
+            uint64_t length = 1 + next_random(worker) % MAX_SCAN;
+            btree_range(key_from_int(key), key_from_int(key + length - 1), count_visit, NULL, store);
+            return 0;
+        }
+        default: {
+            struct info found;
+            if (btree_retrieve(key_from_int(key), &found, store) != 0) {
+                return 1;
+            }
+
+            btree_decrypt(key_from_int(key), output, store);
+            return btree_update(key_from_int(key), value, driver->value_size, ENCRYPT_KEY, key, store) != 0;
+        }
+    }
+}
+
+static void* load(void* argument) {
+    struct worker* worker = argument;
+    struct driver* driver = worker->driver;
+    uint8_t* value = calloc(1, driver->value_size + 1);
+
+    for (uint64_t key = worker->id; key < driver->records; key += driver->threads) {
+        btree_insert(key_from_int(key), value, driver->value_size, ENCRYPT_KEY, key, driver->store);
+    }
+
+    free(value);
+    return NULL;
+}
+
+static void* run(void* argument) {
+    struct worker* worker = argument;
+    struct driver* driver = worker->driver;
+    uint8_t* value = malloc(driver->value_size + 1);
+    uint8_t* output = malloc(driver->value_size + 8);
+
+    for (size_t i = 0; i < driver->value_size; i++) {
+        value[i] = next_random(worker);
+    }
+
+    for (uint64_t i = 0; i < driver->ops; i++) {
+        enum operation op = choose_operation(worker);
+
+        uint64_t start = now_ns();
+        worker->misses += perform(worker, op, value, output);
+        worker->latencies[op][worker->counts[op]++] = now_ns() - start;
+    }
+
+    free(value);
+    free(output);
+    return NULL;
+}
+
+// DRIVER
+
+static void report(struct driver* driver, struct worker* workers, double seconds, int branching, int mode, int partitions) {
+    uint64_t total = 0, misses = 0;
+    for (int t = 0; t < driver->threads; t++) {
+        misses += workers[t].misses;
+    }
+
+    printf("{\n  \"workload\": \"%c\", \"distribution\": \"%s\", \"mode\": \"%s\", \"branching\": %d, \"partitions\": %d,\n",
+        WORKLOADS[driver->workload].name, DISTRIBUTION_NAMES[driver->distribution], MODE_NAMES[mode], branching, partitions);
+    printf("  \"threads\": %d, \"records\": %" PRIu64 ", \"value_size\": %zu, \"theta\": %.3f,\n",
+        driver->threads, driver->records, driver->value_size, driver->zipfian.theta);
+    printf("  \"operations\": [");
+
+    int first = 1;
+    for (int op = 0; op < NUM_OPERATIONS; op++) {
+        uint64_t count = 0;
+        for (int t = 0; t < driver->threads; t++) {
+            count += workers[t].counts[op];
+        }
+
+        if (count == 0) {
+            continue;
+        }
+
+        // pool the latencies of every thread for this operation
+        uint64_t* latencies = malloc(count * sizeof(uint64_t));
+        uint64_t filled = 0;
+        for (int t = 0; t < driver->threads; t++) {
+            memcpy(latencies + filled, workers[t].latencies[op], workers[t].counts[op] * sizeof(uint64_t));
+            filled += workers[t].counts[op];
+        }
+
+        qsort(latencies, count, sizeof(uint64_t), compare_u64);
+        printf("%s\n    {\"operation\": \"%s\", \"ops\": %" PRIu64 ", ", first ? "" : ",", OPERATION_NAMES[op], count);
+        printf("\"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64 "}",
+            percentile(latencies, count, 0.5), percentile(latencies, count, 0.99), percentile(latencies, count, 0.999));
+
+        free(latencies);
+        total += count;
+        first = 0;
+    }
+
+    printf("\n  ],\n");
+    printf("  \"ops\": %" PRIu64 ", \"misses\": %" PRIu64 ", \"seconds\": %.6f, \"ops_per_sec\": %.1f\n}\n",
+        total, misses, seconds, total / (seconds > 0 ? seconds : 1e-9));
+}
+
+int main(int argc, char** argv) {
+    struct driver driver = {
+        .workload = 0,
+        .distribution = -1,
+        .records = 10000,
+        .ops = 10000,
+        .value_size = 100,
+        .threads = 1
+    };
+
+    int branching = 16, mode = STORE_BTREE, partitions = 0, huge_pages = 0, numa = 0;
+    double theta = 0.99;
+    char* trace_path = NULL;
+    int option;
+
+    while ((option = getopt(argc, argv, "w:d:r:n:t:v:b:m:z:T:P:HN")) != -1) {
+        switch (option) {
+            case 'w': driver.workload = (optarg[0] & ~0x20) - 'A'; break;
+            case 'r': driver.records = strtoull(optarg, NULL, 10); break;
+            case 'n': driver.ops = strtoull(optarg, NULL, 10); break;
+            case 't': driver.threads = atoi(optarg); break;
+            case 'v': driver.value_size = strtoull(optarg, NULL, 10); break;
+            case 'b': branching = atoi(optarg); break;
+            case 'm': mode = parse_mode(optarg); break;
+            case 'z': theta = atof(optarg); break;
+            case 'T': trace_path = optarg; break;
+            case 'P': partitions = atoi(optarg); break;
+            case 'H': huge_pages = 1; break;
+            case 'N': huge_pages = numa = 1; break;
+            case 'd':
+                for (int d = 0; d < sizeof(DISTRIBUTION_NAMES)/sizeof(DISTRIBUTION_NAMES[0]); d++) {
+                    if (strcmp(optarg, DISTRIBUTION_NAMES[d]) == 0) {
+                        driver.distribution = d;
+                    }
+                }
+
+                break;
+            default:
+                mode = -1;
+        }
+    }
+
+    int workloads = sizeof(WORKLOADS)/sizeof(WORKLOADS[0]);
+    if (driver.workload < 0 || driver.workload >= workloads || mode < 0 || driver.threads < 1 || driver.records < 2) {
+        fprintf(stderr, "usage: %s [-w A-F] [-d uniform|zipfian|latest] [-r records] [-n ops]\n", argv[0]);
+        fprintf(stderr, "          [-t threads] [-v value size] [-b branching] [-m mode] [-z theta]\n");
+        fprintf(stderr, "          [-T trace.json] [-P hash partitions] [-H] [-N]\n");
+        return 1;
+    }
+
+    if ((int) driver.distribution < 0) {
+        driver.distribution = WORKLOADS[driver.workload].distribution;
+    }
+
+    // the trace keeps the last 65536 calls of each thread
+    struct store_options options = {
+        .mode = mode, .trace_events = trace_path ? 65536 : 0, .partitions = partitions,
+        .huge_pages = huge_pages, .numa = numa
+    };
+    driver.store = init_store_with(branching, driver.threads, &options);
+    driver.next_key = driver.records;
+    zipfian_init(&driver.zipfian, driver.records, theta);
+
+    // ops are per thread, and a thread may spend all of them on one operation
+    struct worker* workers = calloc(driver.threads, sizeof(struct worker));
+    for (int t = 0; t < driver.threads; t++) {
+        workers[t].driver = &driver;
+        workers[t].id = t;
+        workers[t].state = 0x9e3779b97f4a7c15ULL * (t + 1);
+        for (int op = 0; op < NUM_OPERATIONS; op++) {
+            workers[t].latencies[op] = malloc(driver.ops * sizeof(uint64_t));
+        }
+    }
+
+    for (int t = 0; t < driver.threads; t++) {
+        pthread_create(&workers[t].thread, NULL, load, &workers[t]);
+    }
+
+    for (int t = 0; t < driver.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+
+    // load inserts zeroed values
+    uint8_t* zeroed = calloc(1, driver.value_size + 1);
+    check_decrypt(driver.store, key_from_int(0), zeroed, driver.value_size);
+    free(zeroed);
+
+    uint64_t begin = now_ns();
+    for (int t = 0; t < driver.threads; t++) {
+        pthread_create(&workers[t].thread, NULL, run, &workers[t]);
+    }
+
+    for (int t = 0; t < driver.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+
+    double seconds = (now_ns() - begin) / 1e9;
+    report(&driver, workers, seconds, branching, mode, partitions);
+
+    if (trace_path && btree_trace_dump(driver.store, trace_path) != 0) {
+        fprintf(stderr, "could not write %s\n", trace_path);
+    }
+
+    for (int t = 0; t < driver.threads; t++) {
+        for (int op = 0; op < NUM_OPERATIONS; op++) {
+            free(workers[t].latencies[op]);
+        }
+    }
+
+    free(workers);
+    close_store(driver.store);
+    return 0;
+}
@@ -0,0 +1,694 @@
+#include "betree.h"
+#include "payload.h"
+#include "stats.h"
+#include "trace.h"
+#include "epoch.h"
+
+// HELPER FUNCTIONS
+
+/**
+ * Index of the first key in the node which is no less than key.
+ */
+static int lower_bound(struct benode* node, bkey_t key) {
+    int l = 0, r = node->num_keys;
+    while (l < r) {
+        int m = (l + r) / 2;
+        if (key_less(node->keys[m], key)) {
+            l = m + 1;
+        } else {
+            r = m;
+        }
+    }
+
+    return l;
+}
+
+/**
+ * Index of the first key in the node which is greater than key, and so the
+ * index of the link whose subtree would contain key.
+ */
+static int upper_bound(struct benode* node, bkey_t key) {
+    int l = 0, r = node->num_keys;
+    while (l < r) {
+        int m = (l + r) / 2;
+        if (!key_less(key, node->keys[m])) {
+            l = m + 1;
+        } else {
+            r = m;
+        }
+    }
+
+    return l;
+}
+
+/**
+ * Index of the first buffered message whose key is no less than key.
+ */
+static int message_bound(struct benode* node, bkey_t key) {
+    int l = 0, r = node->num_messages;
+    while (l < r) {
+        int m = (l + r) / 2;
+        if (key_less(node->buffer[m].key, key)) {
+            l = m + 1;
+        } else {
+            r = m;
+        }
+    }
+
+    return l;
+}
+
+static void reserve_keys(struct benode* node, uint32_t count) {
+    if (count <= node->key_capacity) {
+        return;
+    }
+
+    node->key_capacity = (count > node->key_capacity * 2) ? count : node->key_capacity * 2;
+    node->keys = realloc(node->keys, node->key_capacity * sizeof(bkey_t));
+    if (node->leaf) {
+        node->infos = realloc(node->infos, node->key_capacity * sizeof(struct info));
+    } else {
+        node->links = realloc(node->links, (node->key_capacity + 1) * sizeof(struct benode*));
+    }
+}
+
+static void reserve_messages(struct benode* node, uint32_t count) {
+    if (count <= node->buffer_capacity) {
+        return;
+    }
+
+    node->buffer_capacity = (count > node->buffer_capacity * 2) ? count : node->buffer_capacity * 2;
+    node->buffer = realloc(node->buffer, node->buffer_capacity * sizeof(struct message));
+}
+
+static void free_benode(struct benode* node) {
+    free(node->keys);
+    free(node->links);
+    free(node->infos);
+    free(node->buffer);
+    free(node);
+}
+
+// MANAGING KEYS AND LINKS
+
+/**
+ * Inserts a separator at the given index along with the link to its right.
+ */
+static void inner_insert(struct benode* node, int index, bkey_t key, struct benode* link) {
+    reserve_keys(node, node->num_keys + 1);
+
+    int moved = node->num_keys - index;
+    memmove(node->keys + index + 1, node->keys + index, moved * sizeof(bkey_t));
+    memmove(node->links + index + 2, node->links + index + 1, moved * sizeof(struct benode*));
+
+    node->keys[index] = key;
+    node->links[index + 1] = link;
+    node->num_keys += 1;
+}
+
+/**
+ * Drops the link at the given slot along with a separator next to it, so the
+ * key range it covered falls to a neighbour.
+ */
+static void remove_link(struct benode* node, int slot) {
+    int separator = (slot > 0) ? slot - 1 : 0;
+    int moved = node->num_keys - separator - 1;
+    memmove(node->keys + separator, node->keys + separator + 1, moved * sizeof(bkey_t));
+    memmove(node->links + slot, node->links + slot + 1, (node->num_keys - slot) * sizeof(struct benode*));
+    node->num_keys -= 1;
+}
+
+// APPLYING MESSAGES
+
+/**
+ * Applies messages, oldest first, to the records of a leaf. A put replaces
+ * any record under the same key, a delete removes it if there is one.
+ */
+static void apply_messages(struct betree* index, struct benode* leaf, struct message* messages, uint32_t count) {
+    reserve_keys(leaf, leaf->num_keys + count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct message* message = &messages[i];
+        int position = lower_bound(leaf, message->key);
+        int present = position < leaf->num_keys && key_equal(leaf->keys[position], message->key);
+
+        if (present) {
+            epoch_retire(index->epochs, &leaf->infos[position]);
+        }
+
+        if (message->type == MESSAGE_PUT && present) {
+            leaf->infos[position] = message->info;
+        } else if (message->type == MESSAGE_PUT) {
+            int moved = leaf->num_keys - position;
+            memmove(leaf->keys + position + 1, leaf->keys + position, moved * sizeof(bkey_t));
+            memmove(leaf->infos + position + 1, leaf->infos + position, moved * sizeof(struct info));
+            leaf->keys[position] = message->key;
+            leaf->infos[position] = message->info;
+            leaf->num_keys += 1;
+        } else if (present) {
+            int moved = leaf->num_keys - position - 1;
+            memmove(leaf->keys + position, leaf->keys + position + 1, moved * sizeof(bkey_t));
+            memmove(leaf->infos + position, leaf->infos + position + 1, moved * sizeof(struct info));
+            leaf->num_keys -= 1;
+        }
+    }
+}
+
+/**
+ * Merges messages coming from the parent into a node's buffer. They are
+ * newer than anything already buffered, so on a shared key the incoming
+ * message wins and a put it overrides releases its value.
+ */
+static void merge_messages(struct betree* index, struct benode* node, struct message* messages, uint32_t count) {
+    reserve_messages(node, node->num_messages + count);
+
+    // merge from the back so the buffer can be filled in place
+    int i = node->num_messages - 1, j = count - 1;
+    int write = node->num_messages + count - 1;
+    while (j >= 0) {
+        if (i >= 0 && key_equal(node->buffer[i].key, messages[j].key)) {
+            if (node->buffer[i].type == MESSAGE_PUT) {
+                epoch_retire(index->epochs, &node->buffer[i].info);
+            }
+
+            i -= 1;
+            node->buffer[write--] = messages[j--];
+        } else if (i >= 0 && key_less(messages[j].key, node->buffer[i].key)) {
+            node->buffer[write--] = node->buffer[i--];
+        } else {
+            node->buffer[write--] = messages[j--];
+        }
+    }
+
+    // overridden messages leave a gap at the front
+    int gap = write - i;
+    if (gap > 0) {
+        memmove(node->buffer + i + 1, node->buffer + write + 1, (node->num_messages + count - write - 1) * sizeof(struct message));
+    }
+
+    node->num_messages += count - gap;
+}
+
+// SPLITTING
+
+/**
+ * Splits an overfull child into as many siblings as it takes to bring each
+ * within capacity, since a single flush can grow a node by more than one
+ * key. Pieces are peeled off the end so the separators go in at one slot.
+ */
+static void split_child(struct betree* index, struct benode* node, int slot) {
+    struct benode* child = node->links[slot];
+    uint32_t capacity = child->leaf ? index->leaf_keys : index->inner_keys;
+    if (child->num_keys <= capacity) {
+        return;
+    }
+
+    if (child->leaf) {
+        uint32_t total = child->num_keys;
+        uint32_t pieces = (total + capacity - 1) / capacity;
+
+        for (uint32_t j = pieces - 1; j >= 1; j--) {
+            uint32_t start = total * j / pieces;
+            struct benode* piece = new_benode(1);
+
+            reserve_keys(piece, child->num_keys - start);
+            piece->num_keys = child->num_keys - start;
+            memcpy(piece->keys, child->keys + start, piece->num_keys * sizeof(bkey_t));
+            memcpy(piece->infos, child->infos + start, piece->num_keys * sizeof(struct info));
+            child->num_keys = start;
+
+            bkey_t separator = key_separator(child->keys[start - 1], piece->keys[0]);
+            inner_insert(node, slot, separator, piece);
+            STATS_ADD(index->stats, splits, 1);
+            TRACE_COUNT(splits);
+            STATS_ADD(index->stats, allocations, 1);
+        }
+    } else {
+        uint32_t total = child->num_keys + 1;
+        uint32_t pieces = (total + capacity) / (capacity + 1);
+
+        for (uint32_t j = pieces - 1; j >= 1; j--) {
+            uint32_t start = total * j / pieces;
+            bkey_t separator = child->keys[start - 1];
+            struct benode* piece = new_benode(0);
+
+            reserve_keys(piece, child->num_keys - start);
+            piece->num_keys = child->num_keys - start;
+            memcpy(piece->keys, child->keys + start, piece->num_keys * sizeof(bkey_t));
+            memcpy(piece->links, child->links + start, (piece->num_keys + 1) * sizeof(struct benode*));
+            child->num_keys = start - 1;
+
+            // pending messages follow the keys they belong to
+            uint32_t first = message_bound(child, separator);
+            reserve_messages(piece, child->num_messages - first);
+            piece->num_messages = child->num_messages - first;
+            memcpy(piece->buffer, child->buffer + first, piece->num_messages * sizeof(struct message));
+            child->num_messages = first;
+
+            inner_insert(node, slot, separator, piece);
+            STATS_ADD(index->stats, splits, 1);
+            TRACE_COUNT(splits);
+            STATS_ADD(index->stats, allocations, 1);
+        }
+    }
+}
+
+// FLUSHING
+
+/**
+ * Moves buffered messages down until no more than limit remain, each time
+ * sending the whole batch bound for the child with the most of them. Leaves
+ * absorb their batch at once and split as many ways as needed, which the
+ * caller carries on upwards. Deletes never merge nodes, a leaf only leaves
+ * the tree once it is empty.
+ */
+static void flush(struct betree* index, struct benode* node, uint32_t limit) {
+    while (node->num_messages > limit) {
+        // find the longest run of messages bound for one child
+        int best = 0, best_from = 0, best_count = 0;
+        int from = 0;
+        while (from < node->num_messages) {
+            int slot = upper_bound(node, node->buffer[from].key);
+            int to = (slot < node->num_keys) ? message_bound(node, node->keys[slot]) : node->num_messages;
+
+            if (to - from > best_count) {
+                best = slot;
+                best_from = from;
+                best_count = to - from;
+            }
+
+            from = to;
+        }
+
+        struct benode* child = node->links[best];
+        if (child->leaf) {
+            apply_messages(index, child, node->buffer + best_from, best_count);
+        } else {
+            merge_messages(index, child, node->buffer + best_from, best_count);
+        }
+
+        int moved = node->num_messages - best_from - best_count;
+        memmove(node->buffer + best_from, node->buffer + best_from + best_count, moved * sizeof(struct message));
+        node->num_messages -= best_count;
+
+        if (!child->leaf) {
+            flush(index, child, index->buffer_size);
+        }
+
+        if (child->leaf && child->num_keys == 0 && node->num_keys > 0) {
+            remove_link(node, best);
+            free_benode(child);
+            STATS_ADD(index->stats, merges, 1);
+            TRACE_COUNT(merges);
+        } else {
+            split_child(index, node, best);
+        }
+    }
+}
+
+/**
+ * Gives the tree a new root for as long as the current one is overfull, and
+ * hands over to the only link of an internal root with nothing buffered.
+ */
+static void settle_root(struct betree* index) {
+    struct benode* root = index->root;
+    uint32_t capacity = root->leaf ? index->leaf_keys : index->inner_keys;
+
+    while (root->num_keys > capacity) {
+        struct benode* above = new_benode(0);
+        above->links[0] = root;
+        split_child(index, above, 0);
+
+        index->root = root = above;
+        capacity = index->inner_keys;
+        STATS_ADD(index->stats, root_grows, 1);
+        STATS_ADD(index->stats, allocations, 1);
+    }
+
+    while (!root->leaf && root->num_keys == 0 && root->num_messages == 0) {
+        index->root = root->links[0];
+        free_benode(root);
+        root = index->root;
+        STATS_ADD(index->stats, root_shrinks, 1);
+    }
+}
+
+/**
+ * Adds a message at the root, where it is either applied directly if the
+ * tree is a single leaf, or buffered until the root next flushes.
+ */
+static void send(struct betree* index, struct message* message) {
+    struct benode* root = index->root;
+
+    if (root->leaf) {
+        apply_messages(index, root, message, 1);
+    } else {
+        merge_messages(index, root, message, 1);
+        flush(index, root, index->buffer_size);
+    }
+
+    settle_root(index);
+}
+
+/**
+ * Pushes every buffered message below the node down to the leaves, so that
+ * ordered reads only need to look at leaves.
+ */
+static void flush_all(struct betree* index, struct benode* node) {
+    if (node->leaf) {
+        return;
+    }
+
+    flush(index, node, 0);
+    for (int i = 0; i < node->num_keys + 1; i++) {
+        struct benode* child = node->links[i];
+        flush_all(index, child);
+
+        // pieces split off here are already drained and are skipped over
+        split_child(index, node, i);
+    }
+}
+
+// INDEX
+
+/**
+ * The newest message for a key sits closest to the root, so the first one
+ * met on the way down decides whether the key is present.
+ */
+static struct info* betree_lookup(struct btree* tree, bkey_t key, struct info* copy) {
+    struct betree* index = tree->index;
+    struct benode* node = index->root;
+    int depth = 0;
+
+    while (!node->leaf) {
+        int position = message_bound(node, key);
+        if (position < node->num_messages && key_equal(node->buffer[position].key, key)) {
+            struct message* message = &node->buffer[position];
+            trace_reached(depth);
+            return (message->type == MESSAGE_PUT) ? &message->info : NULL;
+        }
+
+        node = node->links[upper_bound(node, key)];
+        depth += 1;
+    }
+
+    trace_reached(depth);
+    int position = lower_bound(node, key);
+    if (position < node->num_keys && key_equal(node->keys[position], key)) {
+        return &node->infos[position];
+    } else {
+        return NULL;
+    }
+}
+
+static int betree_insert(struct btree* tree, bkey_t key, struct info* info) {
+    if (betree_lookup(tree, key, NULL)) {
+        return 1;
+    }
+
+    struct message message = { .key = key, .type = MESSAGE_PUT, .info = *info };
+    send(tree->index, &message);
+    return 0;
+}
+
+static int betree_remove(struct btree* tree, bkey_t key) {
+    if (betree_lookup(tree, key, NULL) == NULL) {
+        return 1;
+    }
+
+    struct message message = { .key = key, .type = MESSAGE_DELETE };
+    send(tree->index, &message);
+    return 0;
+}
+
+static int range_benode(struct benode* node, bkey_t low, bkey_t high, range_visit visit, void* context, uint64_t* count) {
+    if (node->leaf) {
+        for (int i = lower_bound(node, low); i < node->num_keys; i++) {
+            if (key_less(high, node->keys[i])) {
+                return 1;
+            }
+
+            *count += 1;
+            if (visit(node->keys[i], &node->infos[i], context)) {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    int last = upper_bound(node, high);
+    for (int i = upper_bound(node, low); i <= last; i++) {
+        if (range_benode(node->links[i], low, high, visit, context, count)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t betree_range(struct btree* tree, bkey_t low, bkey_t high, range_visit visit, void* context) {
+    struct betree* index = tree->index;
+    uint64_t count = 0;
+
+    flush_all(index, index->root);
+    settle_root(index);
+
+    range_benode(index->root, low, high, visit, context, &count);
+    return count;
+}
+
+static void rekey_benode(struct benode* node, struct rekey* rekey) {
+    if (node->leaf) {
+        for (int i = 0; i < node->num_keys; i++) {
+            rekey_info(rekey, node->keys[i], &node->infos[i]);
+        }
+    } else {
+        for (int i = 0; i < node->num_keys + 1; i++) {
+            rekey_benode(node->links[i], rekey);
+        }
+    }
+}
+
+/**
+ * Flushes first, as ranges do, so every live record is in a leaf and no
+ * buffered put for a deleted key is rekeyed.
+ */
+static int betree_rekey(struct btree* tree, struct rekey* rekey) {
+    struct betree* index = tree->index;
+
+    flush_all(index, index->root);
+    settle_root(index);
+
+    rekey_benode(index->root, rekey);
+    return 0;
+}
+
+static int benode_fault(struct btree_fault* fault, enum verify_fault kind, struct benode* node, uint32_t depth, int slot, bkey_t* key) {
+    fault->kind = kind;
+    fault->node = node;
+    fault->depth = depth;
+    fault->slot = slot;
+    if (key) {
+        fault->key = *key;
+    }
+
+    return 1;
+}
+
+/**
+ * Keys under a node lie from low up to but not including high, and so do
+ * the messages buffered in it, which are reported by their index in the
+ * buffer. Leaves shrink with deletes and only leave the tree once empty,
+ * so nodes are only held to their capacity.
+ */
+static int verify_benode(struct betree* index, struct benode* node, uint32_t depth, uint32_t leaf_depth, bkey_t* low, bkey_t* high, struct btree_fault* fault) {
+    uint32_t capacity = node->leaf ? index->leaf_keys : index->inner_keys;
+    if (node->num_keys > capacity) {
+        return benode_fault(fault, VERIFY_FILL, node, depth, -1, NULL);
+    }
+
+    if (node->leaf && depth != leaf_depth) {
+        return benode_fault(fault, VERIFY_DEPTH, node, depth, -1, NULL);
+    }
+
+    for (int i = 0; i < node->num_keys; i++) {
+        bkey_t* key = &node->keys[i];
+        if (i > 0 && !key_less(node->keys[i-1], *key)) {
+            return benode_fault(fault, VERIFY_ORDER, node, depth, i, key);
+        }
+
+        if ((low && key_less(*key, *low)) || (high && !key_less(*key, *high))) {
+            return benode_fault(fault, VERIFY_BOUNDS, node, depth, i, key);
+        }
+
+        if (node->leaf && !payload_intact(*key, &node->infos[i])) {
+            return benode_fault(fault, VERIFY_MAC, node, depth, i, key);
+        }
+    }
+
+    for (int i = 0; i < node->num_messages; i++) {
+        struct message* message = &node->buffer[i];
+        if (i > 0 && !key_less(node->buffer[i-1].key, message->key)) {
+            return benode_fault(fault, VERIFY_ORDER, node, depth, i, &message->key);
+        }
+
+        if ((low && key_less(message->key, *low)) || (high && !key_less(message->key, *high))) {
+            return benode_fault(fault, VERIFY_BOUNDS, node, depth, i, &message->key);
+        }
+
+        if (message->type == MESSAGE_PUT && !payload_intact(message->key, &message->info)) {
+            return benode_fault(fault, VERIFY_MAC, node, depth, i, &message->key);
+        }
+    }
+
+    for (int i = 0; !node->leaf && i < node->num_keys + 1; i++) {
+        if (node->links[i] == NULL) {
+            return benode_fault(fault, VERIFY_LINK, node, depth, i, NULL);
+        }
+
+        bkey_t* below = (i > 0) ? &node->keys[i-1] : low;
+        bkey_t* above = (i < node->num_keys) ? &node->keys[i] : high;
+        if (verify_benode(index, node->links[i], depth + 1, leaf_depth, below, above, fault)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int betree_verify(struct btree* tree, struct btree_fault* fault) {
+    struct betree* index = tree->index;
+    uint32_t leaf_depth = 0;
+    for (struct benode* node = index->root; !node->leaf && node->links[0]; node = node->links[0]) {
+        leaf_depth += 1;
+    }
+
+    return verify_benode(index, index->root, 0, leaf_depth, NULL, NULL, fault);
+}
+
+static uint64_t betree_listing(struct btree* tree, struct node* list) {
+    struct betree* index = tree->index;
+
+    flush_all(index, index->root);
+    settle_root(index);
+
+    return listing_benodes(index->root, list);
+}
+
+static void free_subtree(struct benode* node) {
+    if (node->leaf) {
+        for (int i = 0; i < node->num_keys; i++) {
+            free_info(&node->infos[i]);
+        }
+    } else {
+        for (int i = 0; i < node->num_messages; i++) {
+            if (node->buffer[i].type == MESSAGE_PUT) {
+                free_info(&node->buffer[i].info);
+            }
+        }
+
+        for (int i = 0; i < node->num_keys + 1; i++) {
+            free_subtree(node->links[i]);
+        }
+    }
+
+    free_benode(node);
+}
+
+static void shape_benode(struct betree* index, struct benode* node, int depth, struct shape_walk* walk) {
+    struct btree_shape* shape = walk->shape;
+    uint32_t capacity = node->leaf ? index->leaf_keys : index->inner_keys;
+
+    shape_node(walk, depth, node->num_keys, capacity, node->leaf);
+    shape_memory(walk, &shape->node_bytes, node, sizeof(struct benode));
+    shape_memory(walk, &shape->key_bytes, node->keys, sizeof(bkey_t) * node->key_capacity);
+
+    if (node->leaf) {
+        shape_memory(walk, &shape->key_bytes, node->infos, sizeof(struct info) * node->key_capacity);
+        for (int i = 0; i < node->num_keys; i++) {
+            shape_payload(walk, &node->infos[i]);
+        }
+    } else {
+        shape_memory(walk, &shape->link_bytes, node->links, sizeof(struct benode*) * (node->key_capacity + 1));
+        shape_memory(walk, &shape->buffer_bytes, node->buffer, sizeof(struct message) * node->buffer_capacity);
+        for (int i = 0; i < node->num_messages; i++) {
+            shape_payload(walk, &node->buffer[i].info);
+        }
+
+        for (int i = 0; i < node->num_keys + 1; i++) {
+            shape_benode(index, node->links[i], depth + 1, walk);
+        }
+    }
+}
+
+static void betree_shape(struct btree* tree, struct shape_walk* walk) {
+    struct betree* index = tree->index;
+    shape_benode(index, index->root, 0, walk);
+}
+
+static void betree_destroy(struct btree* tree) {
+    struct betree* index = tree->index;
+    free_subtree(index->root);
+    free(index);
+}
+
+const struct index_ops BEPSILON_OPS = {
+    .lookup = betree_lookup,
+    .insert = betree_insert,
+    .remove = betree_remove,
+    .range = betree_range,
+    .listing = betree_listing,
+    .destroy = betree_destroy,
+    .shape = betree_shape,
+    .rekey = betree_rekey,
+    .verify = betree_verify
+};
+
+/**
+ * Nodes hold branching - 1 keys like the nodes of the plain tree, and each
+ * internal node buffers up to BEPSILON_BUFFER messages per link before it
+ * flushes.
+ */
+void betree_init(struct btree* tree) {
+    struct betree* index = malloc(sizeof(struct betree));
+
+    index->leaf_keys = tree->branching - 1;
+    index->inner_keys = tree->branching - 1;
+    index->buffer_size = tree->branching * BEPSILON_BUFFER;
+    index->stats = tree->stats;
+    index->epochs = tree->epochs;
+    index->root = new_benode(1);
+    tree->index = index;
+}
+
+// UTILITY
+
+struct benode* new_benode(int leaf) {
+    struct benode* node = calloc(1, sizeof(struct benode));
+    node->leaf = leaf;
+
+    reserve_keys(node, 4);
+    if (!leaf) {
+        reserve_messages(node, 4);
+    }
+
+    return node;
+}
+
+uint64_t listing_benodes(struct benode* node, struct node* insert) {
+    if (insert) {
+        insert->num_keys = node->num_keys;
+        insert->keys = malloc(node->num_keys * sizeof(bkey_t));
+        memcpy(insert->keys, node->keys, node->num_keys * sizeof(bkey_t));
+    }
+
+    uint64_t index = 1;
+    if (!node->leaf) {
+        for (int i = 0; i < node->num_keys + 1; i++) {
+            index += listing_benodes(node->links[i], insert ? insert + index : NULL);
+        }
+    }
+
+    return index;
+}
@@ -0,0 +1,66 @@
+#ifndef BETREE_H
+#define BETREE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "btreestore.h"
+#include "btree.h"
+
+// messages an internal node may buffer, per link, before flushing
+#define BEPSILON_BUFFER (4)
+
+enum message_type {
+    MESSAGE_PUT = 0,
+    MESSAGE_DELETE = 1
+};
+
+struct message {
+    bkey_t key;
+    enum message_type type;
+    struct info info;
+};
+
+/**
+ * Internal nodes hold separators, links and a buffer of pending messages
+ * sorted by key, leaves hold the records. Arrays grow as needed, as a node
+ * may briefly go over capacity while its buffer is being flushed.
+ */
+struct benode {
+    uint32_t num_keys;
+    uint32_t num_messages;
+    int leaf;
+
+    bkey_t* keys;
+    struct benode** links;
+    struct info* infos;
+    struct message* buffer;
+
+    uint32_t key_capacity;
+    uint32_t buffer_capacity;
+};
+
+struct betree {
+    struct benode* root;
+    uint32_t leaf_keys;
+    uint32_t inner_keys;
+    uint32_t buffer_size;
+    struct btree_stats* stats;
+    struct epochs* epochs;
+};
+
+// INDEX
+
+extern const struct index_ops BEPSILON_OPS;
+
+void betree_init(struct btree* tree);
+
+// UTILITY
+
+struct benode* new_benode(int leaf);
+
+uint64_t listing_benodes(struct benode* node, struct node* insert);
+
+#endif
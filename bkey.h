@@ -0,0 +1,223 @@
+#ifndef BKEY_H
+#define BKEY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+/**
+ * The key type is chosen at compile time by BTREE_KEY_WIDTH, which is 32 or
+ * 64 for unsigned integer keys, or 0 for binary string keys holding up to
+ * BTREE_KEY_MAX bytes. Integer keys compare with plain operators so the
+ * default build is unchanged, string keys compare lexicographically with the
+ * shorter of two equal prefixes ordered first.
+ */
+#ifndef BTREE_KEY_WIDTH
+#define BTREE_KEY_WIDTH 32
+#endif
+
+#if BTREE_KEY_WIDTH == 32
+
+typedef uint32_t bkey_t;
+
+#elif BTREE_KEY_WIDTH == 64
+
+typedef uint64_t bkey_t;
+
+#elif BTREE_KEY_WIDTH == 0
+
+#ifndef BTREE_KEY_MAX
+#define BTREE_KEY_MAX (23)
+#endif
+
+typedef struct {
+    uint8_t len;
+    uint8_t bytes[BTREE_KEY_MAX];
+} bkey_t;
+
+#else
+#error "BTREE_KEY_WIDTH must be 32, 64 or 0"
+#endif
+
+#if BTREE_KEY_WIDTH != 0
+
+static inline int key_equal(bkey_t a, bkey_t b) {
+    return a == b;
+}
+
+static inline int key_less(bkey_t a, bkey_t b) {
+    return a < b;
+}
+
+static inline void print_key(FILE* stream, bkey_t key) {
+    fprintf(stream, "%" PRIu64, (uint64_t) key);
+}
+
+/**
+ * A separator for two adjacent keys a < b, which is greater than a and no
+ * greater than b.
+ */
+static inline bkey_t key_separator(bkey_t a, bkey_t b) {
+    return b;
+}
+
+/**
+ * Where the key falls in the key space, scaled to 64 bits so that it orders
+ * the same way as the key.
+ */
+static inline uint64_t key_position(bkey_t key) {
+    return (uint64_t) key << (64 - BTREE_KEY_WIDTH);
+}
+
+/**
+ * Spreads keys evenly over 64 bits, with the finaliser of splitmix64.
+ */
+static inline uint64_t key_hash(bkey_t key) {
+    uint64_t hash = (uint64_t) key;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * The key for an integer, so callers name keys the same way in every build.
+ */
+static inline bkey_t key_from_int(uint64_t value) {
+    return (bkey_t) value;
+}
+
+static inline uint64_t key_to_int(bkey_t key) {
+    return (uint64_t) key;
+}
+
+#else
+
+static inline int key_compare(bkey_t a, bkey_t b) {
+    int shared = (a.len < b.len) ? a.len : b.len;
+    int result = memcmp(a.bytes, b.bytes, shared);
+    return (result != 0) ? result : (int) a.len - (int) b.len;
+}
+
+static inline int key_equal(bkey_t a, bkey_t b) {
+    return a.len == b.len && memcmp(a.bytes, b.bytes, a.len) == 0;
+}
+
+static inline int key_less(bkey_t a, bkey_t b) {
+    return key_compare(a, b) < 0;
+}
+
+static inline void print_key(FILE* stream, bkey_t key) {
+    for (int i = 0; i < key.len; i++) {
+        if (key.bytes[i] >= 0x20 && key.bytes[i] < 0x7f) {
+            fputc(key.bytes[i], stream);
+        } else {
+            fprintf(stream, "\\x%02x", key.bytes[i]);
+        }
+    }
+}
+
+/**
+ * Length of the prefix shared by two keys.
+ */
+static inline int key_shared(bkey_t a, bkey_t b) {
+    int shared = (a.len < b.len) ? a.len : b.len;
+    for (int i = 0; i < shared; i++) {
+        if (a.bytes[i] != b.bytes[i]) {
+            return i;
+        }
+    }
+
+    return shared;
+}
+
+/**
+ * The 8 bytes of a key following its first skip bytes as a big-endian
+ * integer, zero filled past the end of the key, so that heads taken after a
+ * shared prefix order the same way as the keys they came from.
+ */
+static inline uint64_t key_head(bkey_t key, int skip) {
+    uint64_t head = 0;
+    for (int i = skip; i < skip + 8; i++) {
+        head = (head << 8) | (i < key.len ? key.bytes[i] : 0);
+    }
+
+    return head;
+}
+
+/**
+ * The shortest prefix of b which is still greater than a, for adjacent keys
+ * a < b, so separators only hold as many bytes as it takes to tell the
+ * neighbouring keys apart.
+ */
+static inline bkey_t key_separator(bkey_t a, bkey_t b) {
+    int len = key_shared(a, b) + 1;
+    if (len < b.len) {
+        memset(b.bytes + len, 0, b.len - len);
+        b.len = len;
+    }
+
+    return b;
+}
+
+static inline uint64_t key_position(bkey_t key) {
+    return key_head(key, 0);
+}
+
+/**
+ * FNV-1a over the key bytes, finished as integer keys are.
+ */
+static inline uint64_t key_hash(bkey_t key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < key.len; i++) {
+        hash = (hash ^ key.bytes[i]) * 0x100000001b3ULL;
+    }
+
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * Builds a key from up to BTREE_KEY_MAX bytes. Returns 1, leaving the key
+ * empty, for anything longer, as a cut down key would collide with every
+ * other key sharing its first BTREE_KEY_MAX bytes. Composite keys are formed
+ * by concatenating big-endian fields so that their byte order matches their
+ * numeric order.
+ */
+static inline int key_from_bytes(bkey_t* key, const void* bytes, size_t len) {
+    memset(key, 0, sizeof(bkey_t));
+    if (len > BTREE_KEY_MAX) {
+        return 1;
+    }
+
+    key->len = len;
+    memcpy(key->bytes, bytes, len);
+    return 0;
+}
+
+/**
+ * The key for an integer, as its 8 big-endian bytes so keys order the same
+ * way as the integers they came from.
+ */
+static inline bkey_t key_from_int(uint64_t value) {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = value >> (56 - 8 * i);
+    }
+
+    bkey_t key;
+    key_from_bytes(&key, bytes, 8);
+    return key;
+}
+
+/**
+ * The integer a key was made from by key_from_int.
+ */
+static inline uint64_t key_to_int(bkey_t key) {
+    return key_head(key, 0);
+}
+
+#endif
+
+#endif
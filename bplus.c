@@ -0,0 +1,637 @@
+#include "bplus.h"
+#include "payload.h"
+#include "stats.h"
+#include "trace.h"
+#include "epoch.h"
+#include "arena.h"
+
+struct bpath {
+    struct bpnode* nodes[BPLUS_MAX_HEIGHT];
+    int slots[BPLUS_MAX_HEIGHT];
+    int depth;
+};
+
+// HELPER FUNCTIONS
+
+/**
+ * Index of the first key in the node which is no less than key.
+ */
+static int lower_bound(struct bpnode* node, bkey_t key) {
+    int l = 0, r = node->num_keys;
+    while (l < r) {
+        int m = (l + r) / 2;
+        if (key_less(node->keys[m], key)) {
+            l = m + 1;
+        } else {
+            r = m;
+        }
+    }
+
+    return l;
+}
+
+/**
+ * Index of the first key in the node which is greater than key, and so the
+ * index of the link whose subtree would contain key.
+ */
+static int upper_bound(struct bpnode* node, bkey_t key) {
+    int l = 0, r = node->num_keys;
+    while (l < r) {
+        int m = (l + r) / 2;
+        if (!key_less(key, node->keys[m])) {
+            l = m + 1;
+        } else {
+            r = m;
+        }
+    }
+
+    return l;
+}
+
+static uint32_t min_keys(struct bplus* index, struct bpnode* node) {
+    return (node->leaf ? index->leaf_keys : index->inner_keys) / 2;
+}
+
+/**
+ * Walks down to the leaf which would contain key, recording the nodes and
+ * links followed on the way if path is given.
+ */
+static struct bpnode* descend(struct bplus* index, bkey_t key, struct bpath* path) {
+    struct bpnode* node = index->root;
+    int depth = 0;
+
+    while (!node->leaf) {
+        int slot = upper_bound(node, key);
+        if (path) {
+            path->nodes[depth] = node;
+            path->slots[depth] = slot;
+        }
+
+        depth += 1;
+        node = node->links[slot];
+    }
+
+    if (path) {
+        path->depth = depth;
+    }
+
+    trace_reached(depth);
+    return node;
+}
+
+static void free_bpnode(struct bplus* index, struct bpnode* node) {
+    arena_free(index->arena, node->keys);
+    arena_free(index->arena, node->links);
+    arena_free(index->arena, node->infos);
+    arena_free(index->arena, node);
+}
+
+// MANAGING KEYS AND LINKS
+
+static void leaf_insert(struct bpnode* leaf, int index, bkey_t key, struct info* info) {
+    int moved = leaf->num_keys - index;
+    memmove(leaf->keys + index + 1, leaf->keys + index, moved * sizeof(bkey_t));
+    memmove(leaf->infos + index + 1, leaf->infos + index, moved * sizeof(struct info));
+
+    leaf->keys[index] = key;
+    leaf->infos[index] = *info;
+    leaf->num_keys += 1;
+}
+
+static void leaf_take(struct bpnode* leaf, int index) {
+    int moved = leaf->num_keys - index - 1;
+    memmove(leaf->keys + index, leaf->keys + index + 1, moved * sizeof(bkey_t));
+    memmove(leaf->infos + index, leaf->infos + index + 1, moved * sizeof(struct info));
+    leaf->num_keys -= 1;
+}
+
+/**
+ * Inserts a separator at the given index along with the link to its right.
+ */
+static void inner_insert(struct bpnode* node, int index, bkey_t key, struct bpnode* link) {
+    int moved = node->num_keys - index;
+    memmove(node->keys + index + 1, node->keys + index, moved * sizeof(bkey_t));
+    memmove(node->links + index + 2, node->links + index + 1, moved * sizeof(struct bpnode*));
+
+    node->keys[index] = key;
+    node->links[index + 1] = link;
+    node->num_keys += 1;
+}
+
+/**
+ * Removes the separator at the given index along with the link to its right.
+ */
+static void inner_take(struct bpnode* node, int index) {
+    int moved = node->num_keys - index - 1;
+    memmove(node->keys + index, node->keys + index + 1, moved * sizeof(bkey_t));
+    memmove(node->links + index + 1, node->links + index + 2, moved * sizeof(struct bpnode*));
+    node->num_keys -= 1;
+}
+
+// TREE INSERTION
+
+/**
+ * Moves the upper half of an overfull leaf into a new right sibling, and
+ * stores the shortest separator which tells the two apart.
+ */
+static struct bpnode* split_leaf(struct bplus* index, struct bpnode* leaf, bkey_t* separator) {
+    struct bpnode* split = new_bpnode(index, 1);
+    int keep = leaf->num_keys / 2;
+
+    split->num_keys = leaf->num_keys - keep;
+    memcpy(split->keys, leaf->keys + keep, split->num_keys * sizeof(bkey_t));
+    memcpy(split->infos, leaf->infos + keep, split->num_keys * sizeof(struct info));
+    leaf->num_keys = keep;
+
+    // chain the new leaf in after the old one
+    split->prev = leaf;
+    split->next = leaf->next;
+    if (leaf->next) {
+        leaf->next->prev = split;
+    }
+
+    leaf->next = split;
+
+    *separator = key_separator(leaf->keys[keep - 1], split->keys[0]);
+    return split;
+}
+
+/**
+ * Moves the separators and links above the median of an overfull internal
+ * node into a new right sibling, storing the median to be promoted.
+ */
+static struct bpnode* split_inner(struct bplus* index, struct bpnode* node, bkey_t* separator) {
+    struct bpnode* split = new_bpnode(index, 0);
+    int median = node->num_keys / 2;
+
+    *separator = node->keys[median];
+    split->num_keys = node->num_keys - (median + 1);
+    memcpy(split->keys, node->keys + median + 1, split->num_keys * sizeof(bkey_t));
+    memcpy(split->links, node->links + median + 1, (split->num_keys + 1) * sizeof(struct bpnode*));
+    node->num_keys = median;
+
+    return split;
+}
+
+// TREE DELETION
+
+static void borrow_left(struct bpnode* parent, int slot, struct bpnode* left, struct bpnode* node) {
+    if (node->leaf) {
+        left->num_keys -= 1;
+        leaf_insert(node, 0, left->keys[left->num_keys], &left->infos[left->num_keys]);
+        parent->keys[slot - 1] = key_separator(left->keys[left->num_keys - 1], node->keys[0]);
+    } else {
+        // rotate through the parent separator
+        memmove(node->keys + 1, node->keys, node->num_keys * sizeof(bkey_t));
+        memmove(node->links + 1, node->links, (node->num_keys + 1) * sizeof(struct bpnode*));
+        node->keys[0] = parent->keys[slot - 1];
+        node->links[0] = left->links[left->num_keys];
+        node->num_keys += 1;
+
+        parent->keys[slot - 1] = left->keys[left->num_keys - 1];
+        left->num_keys -= 1;
+    }
+}
+
+static void borrow_right(struct bpnode* parent, int slot, struct bpnode* node, struct bpnode* right) {
+    if (node->leaf) {
+        leaf_insert(node, node->num_keys, right->keys[0], &right->infos[0]);
+        leaf_take(right, 0);
+        parent->keys[slot] = key_separator(node->keys[node->num_keys - 1], right->keys[0]);
+    } else {
+        // rotate through the parent separator
+        node->keys[node->num_keys] = parent->keys[slot];
+        node->links[node->num_keys + 1] = right->links[0];
+        node->num_keys += 1;
+
+        parent->keys[slot] = right->keys[0];
+        memmove(right->keys, right->keys + 1, (right->num_keys - 1) * sizeof(bkey_t));
+        memmove(right->links, right->links + 1, right->num_keys * sizeof(struct bpnode*));
+        right->num_keys -= 1;
+    }
+}
+
+/**
+ * Merges right into left, which are separated by the parent key at the given
+ * index, and frees right.
+ */
+static void join(struct bplus* index, struct bpnode* parent, int separator, struct bpnode* left, struct bpnode* right) {
+    if (left->leaf) {
+        memcpy(left->keys + left->num_keys, right->keys, right->num_keys * sizeof(bkey_t));
+        memcpy(left->infos + left->num_keys, right->infos, right->num_keys * sizeof(struct info));
+        left->num_keys += right->num_keys;
+
+        left->next = right->next;
+        if (right->next) {
+            right->next->prev = left;
+        }
+    } else {
+        left->keys[left->num_keys] = parent->keys[separator];
+        memcpy(left->keys + left->num_keys + 1, right->keys, right->num_keys * sizeof(bkey_t));
+        memcpy(left->links + left->num_keys + 1, right->links, (right->num_keys + 1) * sizeof(struct bpnode*));
+        left->num_keys += right->num_keys + 1;
+    }
+
+    inner_take(parent, separator);
+    free_bpnode(index, right);
+}
+
+/**
+ * Restores the minimum fill of the nodes along the path, starting from the
+ * given node which has just lost a key, by borrowing from or joining with a
+ * sibling under the same parent.
+ */
+static void rebalance(struct bplus* index, struct bpnode* node, struct bpath* path) {
+    while (path->depth > 0) {
+        uint32_t minimum = min_keys(index, node);
+        if (node->num_keys >= minimum) {
+            return;
+        }
+
+        path->depth -= 1;
+        struct bpnode* parent = path->nodes[path->depth];
+        int slot = path->slots[path->depth];
+
+        struct bpnode* left = (slot > 0) ? parent->links[slot - 1] : NULL;
+        struct bpnode* right = (slot < parent->num_keys) ? parent->links[slot + 1] : NULL;
+
+        if (left && left->num_keys > minimum) {
+            borrow_left(parent, slot, left, node);
+            STATS_ADD(index->stats, borrows, 1);
+            return;
+        } else if (right && right->num_keys > minimum) {
+            borrow_right(parent, slot, node, right);
+            STATS_ADD(index->stats, borrows, 1);
+            return;
+        } else if (left) {
+            join(index, parent, slot - 1, left, node);
+        } else {
+            join(index, parent, slot, node, right);
+        }
+
+        STATS_ADD(index->stats, merges, 1);
+        TRACE_COUNT(merges);
+
+        node = parent;
+    }
+
+    // an internal root left with a single link hands over to it
+    struct bpnode* root = index->root;
+    if (!root->leaf && root->num_keys == 0) {
+        index->root = root->links[0];
+        free_bpnode(index, root);
+        STATS_ADD(index->stats, root_shrinks, 1);
+    }
+}
+
+// INDEX
+
+static struct info* bplus_lookup(struct btree* tree, bkey_t key, struct info* copy) {
+    struct bpnode* leaf = descend(tree->index, key, NULL);
+    int index = lower_bound(leaf, key);
+
+    if (index < leaf->num_keys && key_equal(leaf->keys[index], key)) {
+        return &leaf->infos[index];
+    } else {
+        return NULL;
+    }
+}
+
+static int bplus_insert(struct btree* tree, bkey_t key, struct info* info) {
+    struct bplus* index = tree->index;
+    struct bpath path;
+
+    struct bpnode* leaf = descend(index, key, &path);
+    int position = lower_bound(leaf, key);
+    if (position < leaf->num_keys && key_equal(leaf->keys[position], key)) {
+        return 1;
+    }
+
+    leaf_insert(leaf, position, key, info);
+    if (leaf->num_keys <= index->leaf_keys) {
+        return 0;
+    }
+
+    // carry splits back up the recorded path
+    bkey_t separator;
+    struct bpnode* split = split_leaf(index, leaf, &separator);
+    STATS_ADD(index->stats, splits, 1);
+    TRACE_COUNT(splits);
+    while (path.depth > 0) {
+        path.depth -= 1;
+        struct bpnode* parent = path.nodes[path.depth];
+        inner_insert(parent, path.slots[path.depth], separator, split);
+
+        if (parent->num_keys <= index->inner_keys) {
+            return 0;
+        }
+
+        split = split_inner(index, parent, &separator);
+        STATS_ADD(index->stats, splits, 1);
+        TRACE_COUNT(splits);
+    }
+
+    struct bpnode* root = new_bpnode(index, 0);
+    root->num_keys = 1;
+    root->keys[0] = separator;
+    root->links[0] = index->root;
+    root->links[1] = split;
+    index->root = root;
+    STATS_ADD(index->stats, root_grows, 1);
+    return 0;
+}
+
+static int bplus_remove(struct btree* tree, bkey_t key) {
+    struct bplus* index = tree->index;
+    struct bpath path;
+
+    struct bpnode* leaf = descend(index, key, &path);
+    int position = lower_bound(leaf, key);
+    if (position == leaf->num_keys || !key_equal(leaf->keys[position], key)) {
+        return 1;
+    }
+
+    epoch_retire(tree->epochs, &leaf->infos[position]);
+    leaf_take(leaf, position);
+    rebalance(index, leaf, &path);
+    return 0;
+}
+
+static uint64_t bplus_range(struct btree* tree, bkey_t low, bkey_t high, range_visit visit, void* context) {
+    struct bpnode* leaf = descend(tree->index, low, NULL);
+    int position = lower_bound(leaf, low);
+    uint64_t count = 0;
+
+    while (leaf) {
+        for (; position < leaf->num_keys; position++) {
+            if (key_less(high, leaf->keys[position])) {
+                return count;
+            }
+
+            count += 1;
+            if (visit(leaf->keys[position], &leaf->infos[position], context)) {
+                return count;
+            }
+        }
+
+        leaf = leaf->next;
+        position = 0;
+    }
+
+    return count;
+}
+
+/**
+ * Rekeys the records along the chain of leaves.
+ */
+static int bplus_rekey(struct btree* tree, struct rekey* rekey) {
+    struct bplus* index = tree->index;
+    struct bpnode* leaf = index->root;
+    while (!leaf->leaf) {
+        leaf = leaf->links[0];
+    }
+
+    for (; leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->num_keys; i++) {
+            rekey_info(rekey, leaf->keys[i], &leaf->infos[i]);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * The leaf depth every leaf must be at, and the last leaf checked, which
+ * the next one must be chained to.
+ */
+struct bpverify {
+    struct bplus* index;
+    uint32_t leaf_depth;
+    struct bpnode* previous;
+};
+
+static int bpnode_fault(struct btree_fault* fault, enum verify_fault kind, struct bpnode* node, uint32_t depth, int slot) {
+    fault->kind = kind;
+    fault->node = node;
+    fault->depth = depth;
+    fault->slot = slot;
+    if (slot >= 0 && slot < node->num_keys) {
+        fault->key = node->keys[slot];
+    }
+
+    return 1;
+}
+
+/**
+ * Keys under link i of a node lie from separator i - 1 up to but not
+ * including separator i, so low is inclusive and high is not.
+ */
+static int verify_bpnode(struct bpverify* verify, struct bpnode* node, uint32_t depth, bkey_t* low, bkey_t* high, struct btree_fault* fault) {
+    struct bplus* index = verify->index;
+    uint32_t capacity = node->leaf ? index->leaf_keys : index->inner_keys;
+    if (node->num_keys > capacity || (node != index->root && node->num_keys < min_keys(index, node))) {
+        return bpnode_fault(fault, VERIFY_FILL, node, depth, -1);
+    }
+
+    if (node->leaf && depth != verify->leaf_depth) {
+        return bpnode_fault(fault, VERIFY_DEPTH, node, depth, -1);
+    }
+
+    for (int i = 0; i < node->num_keys; i++) {
+        if (i > 0 && !key_less(node->keys[i-1], node->keys[i])) {
+            return bpnode_fault(fault, VERIFY_ORDER, node, depth, i);
+        }
+
+        if ((low && key_less(node->keys[i], *low)) || (high && !key_less(node->keys[i], *high))) {
+            return bpnode_fault(fault, VERIFY_BOUNDS, node, depth, i);
+        }
+
+        if (node->leaf && !payload_intact(node->keys[i], &node->infos[i])) {
+            return bpnode_fault(fault, VERIFY_MAC, node, depth, i);
+        }
+    }
+
+    if (node->leaf) {
+        if (node->prev != verify->previous || (verify->previous && verify->previous->next != node)) {
+            return bpnode_fault(fault, VERIFY_LINK, node, depth, -1);
+        }
+
+        verify->previous = node;
+        return 0;
+    }
+
+    for (int i = 0; i < node->num_keys + 1; i++) {
+        if (node->links[i] == NULL) {
+            return bpnode_fault(fault, VERIFY_LINK, node, depth, i);
+        }
+
+        bkey_t* below = (i > 0) ? &node->keys[i-1] : low;
+        bkey_t* above = (i < node->num_keys) ? &node->keys[i] : high;
+        if (verify_bpnode(verify, node->links[i], depth + 1, below, above, fault)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int bplus_verify(struct btree* tree, struct btree_fault* fault) {
+    struct bpverify verify = { tree->index, 0, NULL };
+    for (struct bpnode* node = verify.index->root; !node->leaf && node->links[0]; node = node->links[0]) {
+        verify.leaf_depth += 1;
+    }
+
+    if (verify_bpnode(&verify, verify.index->root, 0, NULL, NULL, fault)) {
+        return 1;
+    }
+
+    // nothing follows the last leaf
+    if (verify.previous->next != NULL) {
+        return bpnode_fault(fault, VERIFY_LINK, verify.previous, verify.leaf_depth, -1);
+    }
+
+    return 0;
+}
+
+static uint64_t bplus_listing(struct btree* tree, struct node* list) {
+    struct bplus* index = tree->index;
+    return listing_bpnodes(index->root, list);
+}
+
+static void free_subtree(struct bplus* index, struct bpnode* node) {
+    if (node->leaf) {
+        for (int i = 0; i < node->num_keys; i++) {
+            free_info(&node->infos[i]);
+        }
+    } else {
+        for (int i = 0; i < node->num_keys + 1; i++) {
+            free_subtree(index, node->links[i]);
+        }
+    }
+
+    free_bpnode(index, node);
+}
+
+static void shape_bpnode(struct bplus* index, struct bpnode* node, int depth, struct shape_walk* walk) {
+    struct btree_shape* shape = walk->shape;
+    uint32_t capacity = node->leaf ? index->leaf_keys : index->inner_keys;
+
+    shape_node(walk, depth, node->num_keys, capacity, node->leaf);
+    shape_arena(walk, &shape->node_bytes, index->arena, node, sizeof(struct bpnode));
+    shape_arena(walk, &shape->key_bytes, index->arena, node->keys, sizeof(bkey_t) * (capacity + 1));
+
+    if (node->leaf) {
+        shape_arena(walk, &shape->key_bytes, index->arena, node->infos, sizeof(struct info) * (capacity + 1));
+        for (int i = 0; i < node->num_keys; i++) {
+            shape_payload(walk, &node->infos[i]);
+        }
+    } else {
+        shape_arena(walk, &shape->link_bytes, index->arena, node->links, sizeof(struct bpnode*) * (capacity + 2));
+        for (int i = 0; i < node->num_keys + 1; i++) {
+            shape_bpnode(index, node->links[i], depth + 1, walk);
+        }
+    }
+}
+
+static void bplus_shape(struct btree* tree, struct shape_walk* walk) {
+    struct bplus* index = tree->index;
+    shape_bpnode(index, index->root, 0, walk);
+}
+
+static void bplus_destroy(struct btree* tree) {
+    struct bplus* index = tree->index;
+    free_subtree(index, index->root);
+    free(index);
+}
+
+const struct index_ops BPLUS_OPS = {
+    .lookup = bplus_lookup,
+    .insert = bplus_insert,
+    .remove = bplus_remove,
+    .range = bplus_range,
+    .listing = bplus_listing,
+    .destroy = bplus_destroy,
+    .shape = bplus_shape,
+    .rekey = bplus_rekey,
+    .verify = bplus_verify
+};
+
+/**
+ * Leaves hold branching - 1 records like the nodes of the plain tree, while
+ * internal nodes hold as many separators and links as fit in the space a
+ * node of the plain tree spends on its records and links.
+ */
+void bplus_init(struct btree* tree) {
+    struct bplus* index = malloc(sizeof(struct bplus));
+    size_t scale = (sizeof(struct key_value) + sizeof(void*)) / (sizeof(bkey_t) + sizeof(void*));
+
+    index->leaf_keys = tree->branching - 1;
+    index->inner_keys = tree->branching * scale - 1;
+    index->stats = tree->stats;
+    index->arena = tree->arena;
+    index->root = new_bpnode(index, 1);
+    tree->index = index;
+}
+
+// UTILITY
+
+struct bpnode* new_bpnode(struct bplus* index, int leaf) {
+    struct bpnode* node = arena_alloc(index->arena, sizeof(struct bpnode));
+    STATS_ADD(index->stats, allocations, 1);
+    node->num_keys = 0;
+    node->leaf = leaf;
+    node->prev = NULL;
+    node->next = NULL;
+
+    // one spare slot holds the overflow until the node is split
+    if (leaf) {
+        node->keys = arena_alloc(index->arena, sizeof(bkey_t) * (index->leaf_keys + 1));
+        node->infos = arena_alloc(index->arena, sizeof(struct info) * (index->leaf_keys + 1));
+        node->links = NULL;
+    } else {
+        node->keys = arena_alloc(index->arena, sizeof(bkey_t) * (index->inner_keys + 1));
+        node->links = arena_alloc(index->arena, sizeof(struct bpnode*) * (index->inner_keys + 2));
+        node->infos = NULL;
+    }
+
+    return node;
+}
+
+uint64_t listing_bpnodes(struct bpnode* node, struct node* insert) {
+    if (insert) {
+        insert->num_keys = node->num_keys;
+        insert->keys = malloc(node->num_keys * sizeof(bkey_t));
+        memcpy(insert->keys, node->keys, node->num_keys * sizeof(bkey_t));
+    }
+
+    uint64_t index = 1;
+    if (!node->leaf) {
+        for (int i = 0; i < node->num_keys + 1; i++) {
+            index += listing_bpnodes(node->links[i], insert ? insert + index : NULL);
+        }
+    }
+
+    return index;
+}
+
+void display_bplus(struct bpnode* node, char* prefix, int last) {
+    printf("%s%s%s", prefix, (last ? " └─ " : " ├─ "), (node->leaf ? "[" : "("));
+
+    for (int i=0; i < node->num_keys; i++) {
+        char* end = (i < node->num_keys-1) ? ", " : "";
+        print_key(stdout, node->keys[i]);
+        printf("%s", end);
+    }
+
+    printf("%s\n", (node->leaf ? "]" : ")"));
+
+    if (!node->leaf) {
+        for (int i=0; i < node->num_keys + 1; i++) {
+            char* new_prefix = malloc(100 * sizeof(char));
+            strcpy(new_prefix, prefix);
+            strcat(new_prefix, (last ? "    " : " |  "));
+            display_bplus(node->links[i], new_prefix, i == node->num_keys);
+            free(new_prefix);
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef BPLUS_H
+#define BPLUS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "btreestore.h"
+#include "btree.h"
+
+#define BPLUS_MAX_HEIGHT (64)
+
+/**
+ * Internal nodes hold separators and links only, leaves hold the records
+ * and are chained to their neighbours so ranges are read by walking leaves.
+ */
+struct bpnode {
+    uint32_t num_keys;
+    int leaf;
+
+    bkey_t* keys;
+    struct bpnode** links;
+    struct info* infos;
+
+    struct bpnode* prev;
+    struct bpnode* next;
+};
+
+struct bplus {
+    struct bpnode* root;
+    uint32_t leaf_keys;
+    uint32_t inner_keys;
+    struct btree_stats* stats;
+
+    // where nodes come from, NULL for malloc
+    struct arena* arena;
+};
+
+// INDEX
+
+extern const struct index_ops BPLUS_OPS;
+
+void bplus_init(struct btree* tree);
+
+// UTILITY
+
+struct bpnode* new_bpnode(struct bplus* index, int leaf);
+
+uint64_t listing_bpnodes(struct bpnode* node, struct node* insert);
+
+void display_bplus(struct bpnode* node, char* prefix, int last);
+
+#endif
@@ -1,4 +1,10 @@
 #include "btree.h"
+#include "payload.h"
+#include "stats.h"
+#include "trace.h"
+#include "epoch.h"
+#include "pool.h"
+#include "arena.h"
 
 // HELPER FUNCTIONS
 
@@ -8,33 +14,70 @@ static void swap_keys(struct key_value* a, struct key_value* b) {
     *b = temp;
 }
 
-static void swap_links(struct bnode** a, struct bnode** b) {
-    struct bnode** temp = a;
-    *a = *b;
-    *b = *temp;
+static void free_bnode(struct bnode* node) {
+    struct arena* arena = node->arena;
+    arena_free(arena, node->links);
+    arena_free(arena, node->keys);
+    arena_free(arena, node);
 }
 
 /**
- * The function has two modes, switched to by the variable bounds. If bounds
- * is true then the function behaves as a normal binary search returning the
- * index of the key being searched for. Else it returns the index where an
- * element would be inserted to maintain sorted order in the keylist.
+ * Frees every node and payload of the subtree, working down a stack which
+ * holds the next link to free of each node on the way.
  */
-int key_index(struct bnode* node, uint32_t key, int l, int r) {
-    int m = (l + r) / 2;
-    struct key_value* items = node->keys;
-    int greater = key > items[m].key && node->num_keys > 0;
+static void free_subtree(struct bnode* target) {
+    struct search_path stack;
+    stack.nodes[0] = target;
+    stack.slots[0] = 0;
+    stack.depth = (target != NULL);
+
+    while (stack.depth > 0) {
+        struct bnode* node = stack.nodes[stack.depth - 1];
+        int* next = &stack.slots[stack.depth - 1];
+
+        while (*next < node->num_keys + 1 && node->links[*next] == NULL) {
+            *next += 1;
+        }
 
-    if (key == items[m].key || l > r) {
-        return (greater && l > r) ? m + 1 : m;
-    } else {
-        return key_index(node, key,
-            (greater) ? m + 1 : l,
-            (greater) ? r : m - 1
-        );
+        // free the subtree under the next link before the node itself
+        if (*next < node->num_keys + 1) {
+            stack.nodes[stack.depth] = node->links[*next];
+            stack.slots[stack.depth] = 0;
+            node->links[*next] = NULL;
+            stack.depth += 1;
+            continue;
+        }
+
+        for (int i = 0; i < node->num_keys; i++) {
+            free_info(&node->keys[i].info);
+        }
+
+        free_bnode(node);
+        stack.depth -= 1;
     }
 }
 
+/**
+ * Searches keys l to r of the node, returning the index of the key if it is
+ * present, or else the index at which it would be inserted to keep the keys
+ * in sorted order.
+ */
+int key_index(struct bnode* node, bkey_t key, int l, int r) {
+    struct key_value* items = node->keys;
+    while (l <= r) {
+        int m = (l + r) / 2;
+        if (key_equal(key, items[m].key)) {
+            return m;
+        } else if (key_less(items[m].key, key)) {
+            l = m + 1;
+        } else {
+            r = m - 1;
+        }
+    }
+
+    return l;
+}
+
 /**
  * Inserts a key_value from the keys list of a node such that they remain in
  * sorted order, and returns the index at which the key_value item was inserted.
@@ -47,7 +90,7 @@ int insert_key(struct bnode* node, struct key_value* item) {
     }
 
     int index = key_index(node, item->key, 0, node->num_keys-1);
-    int contained = node->keys[index].key == item->key;
+    int contained = index < node->num_keys && key_equal(node->keys[index].key, item->key);
 
     if (!contained) {
         node->num_keys += 1;
@@ -63,20 +106,24 @@ int insert_key(struct bnode* node, struct key_value* item) {
 }
 
 /**
- * Inserts a link at the given index into the node links list.
+ * Inserts a link at the given index into the node links list, for a node
+ * which has just gained a key and so is one link short.
  */
 void insert_link(struct bnode* node, struct bnode* link, int index) {
-    for (int i = index; i+1 < node->num_keys + 1; i++) {
-        node->links[i+1] = node->links[i];
-    }
+    memmove(
+        node->links + index + 1,
+        node->links + index,
+        (node->num_keys - index) * sizeof(struct bnode*)
+    );
+
+    node->links[index] = link;
 }
 
 void take_key(struct bnode* node, int index, struct key_value* buffer) {
     if (buffer) {
         *buffer = node->keys[index];
-    } else if (node->keys[index].info.data != NULL) {
-        free(node->keys[index].info.data);
-        node->keys[index].info.data = NULL;
+    } else {
+        free_info(&node->keys[index].info);
     }
 
     for (int i = index; i < node->num_keys; i++) {
@@ -92,19 +139,18 @@ void take_key(struct bnode* node, int index, struct key_value* buffer) {
 
 void take_link(struct btree* tree, struct bnode* node, int index, struct bnode** buffer) {
     struct bnode* target = node->links[index];
-    // debug(tree->root, "", 1);
-    for (int i=0; i + index + 1 < tree->branching + 1; i++) {
-        node->links[i + index] = node->links[i + index + 1];
-        if (node->links[i]) {
-            node->links[i]->link_index = i;
-            node->links[i]->parent = node;
-        }
-    }
+    memmove(
+        node->links + index,
+        node->links + index + 1,
+        (tree->branching - index) * sizeof(struct bnode*)
+    );
+
+    node->links[tree->branching] = NULL;
 
     if (buffer) {
-        *buffer = node->links[index];
-    } else if (node->links[index]) {
-        free_node(tree, target);
+        *buffer = target;
+    } else {
+        free_subtree(target);
     }
 }
 
@@ -122,44 +168,194 @@ struct btree* new_tree(uint32_t branching_factor) {
     struct btree* tree = malloc(sizeof(struct btree));
     tree->branching = branching_factor;
     tree->root = NULL;
+    tree->pool = NULL;
     return tree;
 }
 
 /**
- * Finds the parent node of the key and the index for that key, and stores
- * the results in a search_result struct. Returns whether key was found.
+ * Finds the node holding the key, or the leaf it belongs in, along with the
+ * index of the key in that node, and stores the results in a search_result
+ * struct. When the result has a path, the nodes passed through on the way
+ * down are pushed onto it. Returns whether key was found.
  */
-int find_key(struct btree* tree, struct bnode* node, uint32_t key, struct search_result* result) {
-    if (node->num_keys == 0) {
-        result->node = node;
-        result->index = 0;
-        return 0;
+int find_key(struct btree* tree, struct bnode* node, bkey_t key, struct search_result* result) {
+    struct search_path* path = result->path;
+    int depth = 0;
+
+    while (1) {
+        int index = (node->num_keys > 0) ? key_index(node, key, 0, node->num_keys-1) : 0;
+        int found = index < node->num_keys && key_equal(node->keys[index].key, key);
+
+        if (found || node->leaf || node->num_keys == 0) {
+            if (path) {
+                path->depth = depth;
+            }
+
+            trace_reached(depth);
+            result->index = index;
+            result->node = node;
+            return found;
+        }
+
+        if (path) {
+            path->nodes[depth] = node;
+            path->slots[depth] = index;
+        }
+
+        node = node->links[index];
+        depth += 1;
+    }
+}
+
+// COPY ON WRITE
+
+/**
+ * Nodes and payloads which writers replaced or deleted while snapshots could
+ * still see them, each stamped with the version it was retired at.
+ */
+struct retired {
+    struct retired* next;
+    uint64_t version;
+    struct bnode* node;
+    struct info info;
+};
+
+struct snapshot {
+    struct snapshot* next;
+    struct btree* live;
+    uint64_t version;
+};
+
+/**
+ * Versions of a tree which takes snapshots. Nodes are stamped with the
+ * version they were created at, and a snapshot sees every node stamped no
+ * later than its own version, so writers copy those nodes before changing
+ * them rather than changing them in place.
+ */
+struct versions {
+    uint64_t current;
+
+    // live snapshots, newest first, and the version of the newest
+    struct snapshot* snapshots;
+    uint64_t shared;
+
+    struct retired* retired;
+};
+
+static struct bnode* tree_node(struct btree* tree, int leaf) {
+    struct versions* versions = tree->index;
+    struct bnode* node = new_node_in(tree->arena, tree->branching, leaf);
+    node->version = versions ? versions->current : 0;
+    return node;
+}
+
+static void retire(struct versions* versions, struct bnode* node, struct info* info) {
+    struct retired* retired = malloc(sizeof(struct retired));
+    retired->version = versions->current;
+    retired->node = node;
+    retired->info = info ? *info : (struct info) { 0 };
+    retired->next = versions->retired;
+    versions->retired = retired;
+}
+
+/**
+ * Frees whatever the oldest live snapshot, if any, was taken after. Payloads
+ * go on to the epochs, if given, for readers still pinned to them.
+ */
+static void reclaim(struct versions* versions, struct epochs* epochs) {
+    uint64_t oldest = UINT64_MAX;
+    for (struct snapshot* snapshot = versions->snapshots; snapshot; snapshot = snapshot->next) {
+        oldest = snapshot->version;
+    }
+
+    struct retired** cursor = &versions->retired;
+    while (*cursor) {
+        struct retired* retired = *cursor;
+        if (retired->version > oldest) {
+            cursor = &retired->next;
+            continue;
+        }
+
+        if (retired->node) {
+            free_bnode(retired->node);
+        } else {
+            epoch_retire(epochs, &retired->info);
+        }
+
+        *cursor = retired->next;
+        free(retired);
     }
+}
 
-    int index = key_index(node, key, 0, node->num_keys-1);
-    if (node->keys[index].key == key || node->leaf) {
-        result->index = index;
-        result->node = node;
-        return node->keys[index].key == key || (!node->num_keys);
+/**
+ * Frees a payload which has been taken out of the tree once no reader can
+ * hold it, holding onto it while snapshots may still read it.
+ */
+static void release_info(struct btree* tree, struct info* info) {
+    struct versions* versions = tree->index;
+    if (versions && versions->snapshots) {
+        retire(versions, NULL, info);
     } else {
-        return find_key(
-            tree,
-            node->links[index],
-            key,
-            result
-        );
+        epoch_retire(tree->epochs, info);
     }
 }
 
+/**
+ * Returns node if it can be changed in place, or else a copy of it to change
+ * instead, retiring the original for the snapshots which see it.
+ */
+static struct bnode* writable(struct btree* tree, struct bnode* node) {
+    struct versions* versions = tree->index;
+    if (versions == NULL || versions->snapshots == NULL || node->version > versions->shared) {
+        return node;
+    }
+
+    struct bnode* copy = tree_node(tree, node->leaf);
+    copy->num_keys = node->num_keys;
+    memcpy(copy->keys, node->keys, sizeof(struct key_value) * tree->branching);
+    memcpy(copy->links, node->links, sizeof(struct bnode*) * (tree->branching + 1));
+
+    retire(versions, node, NULL);
+    STATS_ADD(tree->stats, allocations, 1);
+    return copy;
+}
+
+static struct bnode* writable_link(struct btree* tree, struct bnode* parent, int slot) {
+    parent->links[slot] = writable(tree, parent->links[slot]);
+    return parent->links[slot];
+}
+
 // TREE INSERTION
 
-struct bnode* split_node(struct btree* tree, struct bnode* node) {
+/**
+ * Picks the key of a full node which is promoted when it is split. String
+ * keys take the shortest key within a window around the median, so the keys
+ * compared on the way down from the root are short.
+ */
+int separator_index(struct bnode* node) {
     int median = (node->num_keys - (node->num_keys+1) % 2) / 2;
-    struct bnode* split = new_node(tree->branching, node->leaf);
+
+#if BTREE_KEY_WIDTH == 0
+    int window = node->num_keys / 4;
+    int first = (median - window > 1) ? median - window : 1;
+    int last = (median + window < node->num_keys - 2) ? median + window : node->num_keys - 2;
+
+    for (int i = first; i <= last; i++) {
+        if (node->keys[i].key.len < node->keys[median].key.len) {
+            median = i;
+        }
+    }
+#endif
+
+    return median;
+}
+
+struct bnode* split_node(struct btree* tree, struct bnode* node) {
+    int median = separator_index(node);
+    struct bnode* split = tree_node(tree, node->leaf);
 
     // update properties
     split->num_keys = node->num_keys - (median + 1);
-    split->parent = node->parent;
     split->leaf = node->leaf;
     node->num_keys = median;
 
@@ -170,306 +366,1106 @@ struct bnode* split_node(struct btree* tree, struct bnode* node) {
         }
 
         split->links[i] = node->links[i + (median + 1)];
+        node->links[i + (median + 1)] = NULL;
         if (!split->links[i] && !split->leaf) {
-            split->links[i] = new_node(tree->branching, 1);
-        }
-
-        if (split->links[i]) {
-            split->links[i]->link_index = i;
-            split->links[i]->parent = split;
+            split->links[i] = tree_node(tree, 1);
+            STATS_ADD(tree->stats, allocations, 1);
         }
     }
 
     return split;
 }
 
-void divide(struct btree* tree, struct bnode* target) {
-    if (target->num_keys == tree->branching) {
-        if (target == tree->root) {
-            tree->root = new_node(tree->branching, 0);
-            target->parent = tree->root;
-        }
-
-        // promote median key to parent
-        struct bnode* parent = target->parent;
-        int median = (target->num_keys - (target->num_keys+1) % 2) / 2;
-        int inserted_index = insert_key(parent, &target->keys[median]);
-
-        // split and update parent links
-        struct bnode* split = split_node(tree, target);
-        parent->leaf = 0;
-
-        // move parent links
-        memmove(
-            parent->links + inserted_index + 1,
-            parent->links + inserted_index,
-            (parent->num_keys - inserted_index) * (sizeof(struct bnode*))
-        );
+/**
+ * Splits the full target, a link of parent, promoting its separator into the
+ * parent. Returns the index of the separator in the parent, which has target
+ * on its left and the split off keys on its right.
+ */
+static int split_child(struct btree* tree, struct bnode* parent, struct bnode* target) {
+    // promote median key to parent
+    int median = separator_index(target);
+    int inserted_index = insert_key(parent, &target->keys[median]);
+
+    // split and update parent links
+    struct bnode* split = split_node(tree, target);
+    parent->leaf = 0;
+    STATS_ADD(tree->stats, splits, 1);
+    TRACE_COUNT(splits);
+    STATS_ADD(tree->stats, allocations, 1);
+
+    // move parent links
+    memmove(
+        parent->links + inserted_index + 1,
+        parent->links + inserted_index,
+        (parent->num_keys - inserted_index) * (sizeof(struct bnode*))
+    );
+
+    parent->links[inserted_index] = target;
+    parent->links[inserted_index + 1] = split;
+    return inserted_index;
+}
 
-        parent->links[inserted_index] = target;
-        parent->links[inserted_index + 1] = split;
+static struct bnode* grow_root(struct btree* tree) {
+    tree->root = tree_node(tree, 0);
+    STATS_ADD(tree->stats, root_grows, 1);
+    STATS_ADD(tree->stats, allocations, 1);
+    return tree->root;
+}
 
-        target->link_index = inserted_index;
-        split->link_index = inserted_index + 1;
+/**
+ * Splits target while it is full, promoting its separator into the parent on
+ * the path, and climbs the path for as long as the parents fill up in turn.
+ */
+void divide(struct btree* tree, struct bnode* target, struct search_path* path) {
+    int depth = path->depth;
 
-        if (target != tree->root) {
-            divide(tree, target->parent);
-        }
+    while (target->num_keys == tree->branching) {
+        struct bnode* parent = (depth == 0) ? grow_root(tree) : path->nodes[--depth];
+        split_child(tree, parent, target);
+        target = parent;
     }
 }
 
 // TREE DELETION
 
+/**
+ * Replaces a root left without keys by its only link.
+ */
+static void shrink_root(struct btree* tree) {
+    if (tree->root->leaf || tree->root->num_keys > 0) {
+        return;
+    }
+
+    struct bnode* old_root = tree->root;
+    tree->root = tree->root->links[0];
+
+    memset(old_root->links, 0, sizeof(void*) * (tree->branching + 1));
+    free_subtree(old_root);
+    STATS_ADD(tree->stats, root_shrinks, 1);
+}
+
 /**
  * Takes key, and a link if node is not a leaf, from sibling if there is excess
  * of keys and if successful returns 1. Note that if direction is LEFT then the
  * max key and, possibly, link of the left sibling is taken or if it is RIGHT
  * then it takes the min key and, possibly, link of the right sibling.
  */
-int robin_hood(struct btree* tree, struct bnode* node, enum Direction side) {
-    int sibling_index = node->link_index + (side == LEFT ? -1 : 1);
-    if (sibling_index < 0 || sibling_index > node->parent->num_keys) {
+static int robin_hood(struct btree* tree, struct bnode* node, struct bnode* parent, int slot, enum Direction side) {
+    int sibling_index = slot + (side == LEFT ? -1 : 1);
+    if (sibling_index < 0 || sibling_index > parent->num_keys) {
         return 0;
     }
 
-    struct bnode* sibling = node->parent->links[sibling_index];
-    struct key_value key_buffer = { -1 };
+    struct bnode* sibling = parent->links[sibling_index];
+    struct key_value key_buffer;
 
     // if sibling exists, there must exists a key separating them,
     // then check if there is an excess of keys to redistribute
     if (sibling->num_keys > 1) {
-        // move parent key to current node
-        take_key(node->parent, edge_index(node->parent, side, 1), &key_buffer);
-        insert_key(node, &key_buffer);
+        int separator = slot - (side == LEFT ? 1 : 0);
 
-        // if node is not a leaf move link
+        // take the sibling's edge link while its keys still index it
+        struct bnode* link = NULL;
         if (!node->leaf) {
-            struct bnode* buffer = NULL;
-            int take_index = edge_index(sibling, !side, 0);
-            take_link(tree, sibling, take_index, &buffer);
-
-            // insert link
-            for (int i = edge_index(node, side, 0) + 1; i < node->num_keys + 1; i++) {
-                swap_links(&node->links[i], &buffer);
-            }
+            take_link(tree, sibling, edge_index(sibling, !side, 0), &link);
         }
 
+        // move separating parent key to current node
+        take_key(parent, separator, &key_buffer);
+        insert_key(node, &key_buffer);
+
         // move sibling key to parent
         take_key(sibling, edge_index(sibling, !side, 1), &key_buffer);
-        insert_key(node->parent, &key_buffer);
+        insert_key(parent, &key_buffer);
+
+        if (link) {
+            insert_link(node, link, (side == LEFT) ? 0 : node->num_keys);
+        }
 
+        STATS_ADD(tree->stats, borrows, 1);
         return 1;
     } else {
         return 0;
     }
 }
 
-void combine(struct btree* tree, struct bnode* node) {
-    enum Direction side = (node->link_index > 0 ? LEFT : RIGHT);
-    int sibling_index = node->link_index + (side == LEFT ? -1 : 1);
-    int parent_index = node->link_index - (side == LEFT ? 1 : 0);
-    struct bnode* sibling = node->parent->links[sibling_index];
+/**
+ * Merges node, found at slot of its parent, with its left sibling, or right
+ * if it has none, pulling down the parent key separating them. The sibling
+ * is freed and node keeps all of the keys and links in order.
+ */
+static void combine(struct btree* tree, struct bnode* node, struct bnode* parent, int slot) {
+    enum Direction side = (slot > 0 ? LEFT : RIGHT);
+    int sibling_index = slot + (side == LEFT ? -1 : 1);
+    int parent_index = slot - (side == LEFT ? 1 : 0);
+    struct bnode* sibling = parent->links[sibling_index];
+    int node_keys = node->num_keys;
+    int sibling_keys = sibling->num_keys;
+
+    // move key down from parent, handing its data over to node
+    struct key_value separator;
+    take_key(parent, parent_index, &separator);
 
-    // offset keys and links for insertion
     if (side == LEFT) {
+        // sibling keys and links go before those of node
+        memmove(
+            node->keys + sibling_keys + 1,
+            node->keys,
+            node_keys * sizeof(struct key_value)
+        );
+
+        memcpy(node->keys, sibling->keys, sibling_keys * sizeof(struct key_value));
+        node->keys[sibling_keys] = separator;
+
         if (!node->leaf) {
             memmove(
-                node->links + sibling->num_keys + 1,
+                node->links + sibling_keys + 1,
                 node->links,
-                (node->num_keys + 1) * sizeof(struct bnode*)
+                (node_keys + 1) * sizeof(struct bnode*)
             );
+
+            memcpy(node->links, sibling->links, (sibling_keys + 1) * sizeof(struct bnode*));
         }
+    } else {
+        // sibling keys and links go after those of node
+        node->keys[node_keys] = separator;
+        memcpy(node->keys + node_keys + 1, sibling->keys, sibling_keys * sizeof(struct key_value));
 
-        memmove(
-            node->keys + sibling->num_keys,
-            node->keys,
-            node->num_keys * sizeof(struct key_value)
-        );
+        if (!node->leaf) {
+            memcpy(node->links + node_keys + 1, sibling->links, (sibling_keys + 1) * sizeof(struct bnode*));
+        }
     }
 
-    // drain keys and links from sibling
-    int links_offset = (side == LEFT ? 0 : node->num_keys + 1);
-    int keys_offset = (side == LEFT ? node->num_keys : 0);
-    struct bnode* buffer = NULL;
-    for (int i = 0; i < sibling->num_keys + 1; i++) {
-        if (i < sibling->num_keys) {
-            node->keys[i + keys_offset] = sibling->keys[i];
-            memset(&sibling->keys[i], 0, sizeof(struct key_value));
+    node->num_keys = node_keys + sibling_keys + 1;
+
+    // kill the emptied sibling, which now owns neither keys nor links
+    sibling->num_keys = 0;
+    memset(sibling->links, 0, sizeof(struct bnode*) * (tree->branching + 1));
+    take_link(tree, parent, sibling_index, NULL);
+    STATS_ADD(tree->stats, merges, 1);
+    TRACE_COUNT(merges);
+}
+
+/**
+ * Restores the minimum number of keys in target, whose ancestors are on the
+ * path, by borrowing from a sibling or else combining with one. Combining
+ * takes a key from the parent, so the path is climbed for as long as the
+ * parents are emptied in turn.
+ */
+void merge(struct btree* tree, struct bnode* target, struct search_path* path) {
+    int depth = path->depth;
+
+    while (1) {
+        if (tree->root == target && tree->root->num_keys == 0) {
+            return;
         }
 
-        if (sibling->links[i]) {
-            node->links[i + links_offset] = sibling->links[i];
-            sibling->links[i] = NULL;
+        int min_keys = (target->leaf) ? 1 : 2;
+        if (target->num_keys >= min_keys) {
+            return;
+        }
+
+        struct bnode* parent = path->nodes[depth - 1];
+        int slot = path->slots[depth - 1];
 
-            if (node->links[i + links_offset]) {
-                node->links[i + links_offset]->link_index = i + links_offset;
-                node->links[i + links_offset]->parent = node;
+        if (robin_hood(tree, target, parent, slot, LEFT) || robin_hood(tree, target, parent, slot, RIGHT)) {
+            if (target->num_keys < 1) {
+                continue;
             }
+
+            return;
+        }
+
+        combine(tree, target, parent, slot);
+        if (parent == tree->root || parent->num_keys >= 1) {
+            break;
         }
+
+        target = parent;
+        depth -= 1;
     }
 
-    node->num_keys += sibling->num_keys;
-    sibling->num_keys = 0;
+    shrink_root(tree);
+}
 
-    // take key from parent
-    insert_key(node, &node->parent->keys[parent_index]);
-    take_key(node->parent, parent_index, NULL);
+// TOP-DOWN
 
-    // kill sibling and recurse
-    free_node(tree, sibling);
+/**
+ * Makes sure the child at slot of parent has a key to spare before it is
+ * descended into, borrowing one from a sibling or else combining with one.
+ * The parent must be writable, and the child returned is writable too,
+ * though it may have become the root.
+ */
+static struct bnode* fill_child(struct btree* tree, struct bnode* parent, int slot) {
+    struct bnode* child = writable_link(tree, parent, slot);
+    if (child->num_keys > 1) {
+        return child;
+    }
 
-    if (node->parent != tree->root && node->parent->num_keys < 1) {
-        merge(tree, node->parent);
+    for (int side = LEFT; side <= RIGHT; side++) {
+        int sibling = slot + (side == LEFT ? -1 : 1);
+        if (sibling >= 0 && sibling <= parent->num_keys && parent->links[sibling]->num_keys > 1) {
+            writable_link(tree, parent, sibling);
+            robin_hood(tree, child, parent, slot, side);
+            return child;
+        }
     }
+
+    writable_link(tree, parent, slot > 0 ? slot - 1 : slot + 1);
+    combine(tree, child, parent, slot);
+    shrink_root(tree);
+    return child;
 }
 
-void merge(struct btree* tree, struct bnode* target) {
-    // fprintf(stderr, "\nMerging tree\n");
-    // debug(tree->root, "", 1);
-    // fprintf(stderr, "\n\n");
-    if (tree->root == target && tree->root->num_keys == 0) {
-        return;
+/**
+ * Takes the smallest key of the subtree under node when side is LEFT, or the
+ * largest when it is RIGHT, filling each node on the way down.
+ */
+static void take_edge(struct btree* tree, struct bnode* node, enum Direction side, struct key_value* buffer, int* depth) {
+    while (!node->leaf) {
+        node = fill_child(tree, node, edge_index(node, side, 0));
+        *depth += 1;
     }
 
-    int min_keys = (target->leaf) ? 1 : 2;
-    if (target->num_keys >= min_keys) {
+    take_key(node, edge_index(node, side, 1), buffer);
+}
+
+/**
+ * Inserts in a single pass down the tree, splitting every full node passed
+ * through, so the leaf always has room and no split climbs back up. Nodes
+ * hold up to branching keys, as a node must split in two while it is full.
+ */
+static int top_down_insert(struct btree* tree, bkey_t key, struct info* info) {
+    tree->root = writable(tree, tree->root);
+    if (tree->root->num_keys == tree->branching) {
+        struct bnode* target = tree->root;
+        split_child(tree, grow_root(tree), target);
+    }
+
+    struct bnode* node = tree->root;
+    int depth = 0;
+
+    while (1) {
+        int index = (node->num_keys > 0) ? key_index(node, key, 0, node->num_keys-1) : 0;
+        if (index < node->num_keys && key_equal(node->keys[index].key, key)) {
+            trace_reached(depth);
+            return 1;
+        }
+
+        if (node->leaf) {
+            struct key_value item = {
+                .key = key,
+                .info = *info
+            };
+
+            insert_key(node, &item);
+            trace_reached(depth);
+            return 0;
+        }
+
+        struct bnode* child = writable_link(tree, node, index);
+        if (child->num_keys == tree->branching) {
+            split_child(tree, node, child);
+            if (key_equal(node->keys[index].key, key)) {
+                trace_reached(depth);
+                return 1;
+            }
+
+            child = node->links[index + key_less(node->keys[index].key, key)];
+        }
+
+        node = child;
+        depth += 1;
+    }
+}
+
+/**
+ * Deletes in a single pass down the tree. Every node descended into is first
+ * given a key to spare, so taking a key from a leaf never leaves it short and
+ * no merge climbs back up.
+ */
+static int top_down_remove(struct btree* tree, bkey_t key) {
+    tree->root = writable(tree, tree->root);
+    struct bnode* node = tree->root;
+    int depth = 0;
+
+    while (1) {
+        int index = (node->num_keys > 0) ? key_index(node, key, 0, node->num_keys-1) : 0;
+        int found = index < node->num_keys && key_equal(node->keys[index].key, key);
+
+        if (node->leaf) {
+            trace_reached(depth);
+            if (found) {
+                struct key_value removed;
+                take_key(node, index, &removed);
+                release_info(tree, &removed.info);
+            }
+
+            return !found;
+        }
+
+        if (!found) {
+            node = fill_child(tree, node, index);
+            depth += 1;
+            continue;
+        }
+
+        // replace the key with its predecessor or successor, taken from
+        // whichever side has a key to spare
+        struct bnode* left = node->links[index];
+        struct bnode* right = node->links[index + 1];
+        if (left->num_keys > 1 || right->num_keys > 1) {
+            struct key_value* destination = &node->keys[index];
+            release_info(tree, &destination->info);
+
+            depth += 1;
+            if (left->num_keys > 1) {
+                take_edge(tree, writable_link(tree, node, index), RIGHT, destination, &depth);
+            } else {
+                take_edge(tree, writable_link(tree, node, index + 1), LEFT, destination, &depth);
+            }
+
+            trace_reached(depth);
+            return 0;
+        }
+
+        // otherwise pull the key down between its children and carry on
+        writable_link(tree, node, index);
+        right = writable_link(tree, node, index + 1);
+        combine(tree, right, node, index + 1);
+        shrink_root(tree);
+        node = right;
+        depth += 1;
+    }
+}
+
+// WHOLE TREE WALKS
+
+/**
+ * A node near the root, in pre-order. Large trees are walked as a task for
+ * each subtree under the first level wide enough to keep every worker busy,
+ * with the few nodes above that level handled on the calling thread.
+ */
+struct walk_entry {
+    struct bnode* node;
+    int top;
+    uint64_t size;
+    struct node* insert;
+    void* context;
+
+    // the bounds its parent gives the subtree, NULL at the edges of the tree
+    uint32_t depth;
+    bkey_t* low;
+    bkey_t* high;
+    struct btree_fault fault;
+};
+
+struct walk {
+    struct walk_entry* entries;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+static int walk_in_parallel(struct btree* tree) {
+    return tree->pool != NULL && tree->num_nodes >= BTREE_PARALLEL_KEYS;
+}
+
+/**
+ * Depth of the first level holding a few subtrees for each worker, judged by
+ * the fanout along the leftmost path.
+ */
+static int split_depth(struct btree* tree) {
+    uint64_t width = 1;
+    int depth = 0;
+
+    for (struct bnode* node = tree->root; !node->leaf && width < 8 * tree->processors; node = node->links[0]) {
+        width *= node->num_keys + 1;
+        depth += 1;
+    }
+
+    return depth;
+}
+
+static void gather(struct walk* walk, struct bnode* node, int depth, int split, bkey_t* low, bkey_t* high) {
+    if (walk->count == walk->capacity) {
+        walk->capacity = walk->capacity ? walk->capacity * 2 : 64;
+        walk->entries = realloc(walk->entries, walk->capacity * sizeof(struct walk_entry));
+    }
+
+    int top = depth < split && !node->leaf;
+    walk->entries[walk->count++] = (struct walk_entry) {
+        .node = node,
+        .top = top,
+        .size = 1,
+        .depth = depth,
+        .low = low,
+        .high = high
+    };
+
+    if (!top) {
         return;
     }
 
-    // fix properties
+    for (int i = 0; i < node->num_keys + 1; i++) {
+        if (node->links[i]) {
+            bkey_t* below = (i > 0) ? &node->keys[i-1].key : low;
+            bkey_t* above = (i < node->num_keys) ? &node->keys[i].key : high;
+            gather(walk, node->links[i], depth + 1, split, below, above);
+        }
+    }
+}
 
-    for (int direction = LEFT; direction <= RIGHT; direction++) {
-        if (robin_hood(tree, target, direction)) {
-            if (target->num_keys < 1) {
-                merge(tree, target);
+static void run_walk(struct pool* pool, struct walk* walk, void (*run)(void* entry)) {
+    for (uint32_t i = 0; i < walk->count; i++) {
+        if (!walk->entries[i].top) {
+            pool_spawn(pool, run, &walk->entries[i]);
+        }
+    }
+
+    pool_wait(pool);
+}
+
+static void count_subtree(void* entry) {
+    struct walk_entry* walked = entry;
+    walked->size = listing_nodes(walked->node, NULL);
+}
+
+static void list_subtree(void* entry) {
+    struct walk_entry* walked = entry;
+    listing_nodes(walked->node, walked->insert);
+}
+
+static void free_walked(void* entry) {
+    struct walk_entry* walked = entry;
+    free_subtree(walked->node);
+}
+
+static void rekey_node(struct bnode* node, struct rekey* rekey) {
+    for (int i = 0; i < node->num_keys; i++) {
+        rekey_info(rekey, node->keys[i].key, &node->keys[i].info);
+    }
+}
+
+static void rekey_subtree(struct bnode* node, struct rekey* rekey) {
+    rekey_node(node, rekey);
+    for (int i = 0; !node->leaf && i < node->num_keys + 1; i++) {
+        if (node->links[i]) {
+            rekey_subtree(node->links[i], rekey);
+        }
+    }
+}
+
+static void rekey_walked(void* entry) {
+    struct walk_entry* walked = entry;
+    rekey_subtree(walked->node, walked->context);
+}
+
+/**
+ * Subtrees are counted first, which places each of them in the pre-order
+ * listing, and are then listed into their place.
+ */
+static uint64_t list_in_parallel(struct btree* tree, struct node* list) {
+    struct walk walk = { NULL, 0, 0 };
+    gather(&walk, tree->root, 0, split_depth(tree), NULL, NULL);
+
+    run_walk(tree->pool, &walk, count_subtree);
+
+    uint64_t position = 0;
+    for (uint32_t i = 0; i < walk.count; i++) {
+        struct walk_entry* entry = &walk.entries[i];
+        entry->insert = list ? list + position : NULL;
+        if (entry->insert && entry->top) {
+            list_node(entry->node, entry->insert);
+        }
+
+        position += entry->size;
+    }
+
+    if (list) {
+        run_walk(tree->pool, &walk, list_subtree);
+    }
+
+    free(walk.entries);
+    return position;
+}
+
+/**
+ * Frees the subtrees in parallel, then the nodes above them, which the
+ * subtrees never look back at.
+ */
+static void free_in_parallel(struct btree* tree) {
+    struct walk walk = { NULL, 0, 0 };
+    gather(&walk, tree->root, 0, split_depth(tree), NULL, NULL);
+
+    run_walk(tree->pool, &walk, free_walked);
+
+    for (uint32_t i = 0; i < walk.count; i++) {
+        struct bnode* node = walk.entries[i].node;
+        if (walk.entries[i].top) {
+            for (int k = 0; k < node->num_keys; k++) {
+                free_info(&node->keys[k].info);
             }
 
-            return;
+            free_bnode(node);
         }
     }
 
-    combine(tree, target);
+    free(walk.entries);
+}
+
+/**
+ * Payloads copied rather than rewritten in place are retired by the thread
+ * that copied them, so only in place rekeys are spread over the workers.
+ */
+static void rekey_in_parallel(struct btree* tree, struct rekey* rekey) {
+    struct walk walk = { NULL, 0, 0 };
+    gather(&walk, tree->root, 0, split_depth(tree), NULL, NULL);
+    for (uint32_t i = 0; i < walk.count; i++) {
+        walk.entries[i].context = rekey;
+    }
 
-    if (tree->root->num_keys < 1) {
-        struct bnode* old_root = tree->root;
-        tree->root = tree->root->links[0];
-        tree->root->parent = NULL;
+    run_walk(tree->pool, &walk, rekey_walked);
 
-        memset(old_root->links, 0, sizeof(void*) * (tree->branching + 1));
-        free_node(tree, old_root);
+    for (uint32_t i = 0; i < walk.count; i++) {
+        if (walk.entries[i].top) {
+            rekey_node(walk.entries[i].node, rekey);
+        }
     }
+
+    free(walk.entries);
 }
 
-struct bnode* new_node(uint32_t branching, int leaf) {
-    struct bnode* node = malloc(sizeof(struct bnode));
-    node->parent = NULL;
-    node->num_keys = 0;
-    node->leaf = leaf;
+/**
+ * What every node of the tree is checked against. Top down trees, and their
+ * snapshots, split nodes on the way down rather than once they overflow, so
+ * their nodes may be left full.
+ */
+struct bverify {
+    struct bnode* root;
+    uint32_t max_keys;
+    uint32_t leaf_depth;
+};
+
+static int bnode_fault(struct btree_fault* fault, enum verify_fault kind, struct bnode* node, uint32_t depth, int slot) {
+    fault->kind = kind;
+    fault->node = node;
+    fault->depth = depth;
+    fault->slot = slot;
+    if (slot >= 0 && slot < node->num_keys) {
+        fault->key = node->keys[slot].key;
+    }
 
-    node->links = malloc(sizeof(void*) * (branching+1));
-    node->keys = malloc(sizeof(struct key_value) * branching);
-    memset(node->links, 0, sizeof(void*) * (branching+1));
-    memset(node->keys, 0, sizeof(struct key_value) * branching);
-    return node;
+    return 1;
 }
 
-void disconnect_node(struct btree* tree, struct bnode* node) {
-    // fprintf(stderr, "disonnectin %p\n", node);
-    if (node) {
-        if (node->parent) {
-            // disconnect from parent
-            node->parent->links[node->link_index] = NULL;
-            node->parent = NULL;
+/**
+ * Checks the node on its own, whose keys must lie strictly between low and
+ * high where they are given.
+ */
+static int check_bnode(struct bverify* verify, struct bnode* node, uint32_t depth, bkey_t* low, bkey_t* high, struct btree_fault* fault) {
+    if (node->num_keys > verify->max_keys || (node != verify->root && node->num_keys == 0)) {
+        return bnode_fault(fault, VERIFY_FILL, node, depth, -1);
+    }
+
+    if (node->leaf && depth != verify->leaf_depth) {
+        return bnode_fault(fault, VERIFY_DEPTH, node, depth, -1);
+    }
+
+    for (int i = 0; i < node->num_keys; i++) {
+        bkey_t key = node->keys[i].key;
+        if (i > 0 && !key_less(node->keys[i-1].key, key)) {
+            return bnode_fault(fault, VERIFY_ORDER, node, depth, i);
         }
 
-        // recurse down tree disconnecting all nodes
-        for (int i = 0; i < tree->branching; i++) {
-            disconnect_node(tree, node->links[i]);
+        if ((low && !key_less(*low, key)) || (high && !key_less(key, *high))) {
+            return bnode_fault(fault, VERIFY_BOUNDS, node, depth, i);
         }
 
-        // free stored data
-        for (int i = 0; i < tree->branching; i++) {
-            if (node->keys[i].info.data) {
-                free(node->keys[i].info.data);
+        if (!payload_intact(key, &node->keys[i].info)) {
+            return bnode_fault(fault, VERIFY_MAC, node, depth, i);
+        }
+    }
+
+    for (int i = 0; !node->leaf && i < node->num_keys + 1; i++) {
+        if (node->links[i] == NULL) {
+            return bnode_fault(fault, VERIFY_LINK, node, depth, i);
+        }
+    }
+
+    return 0;
+}
+
+static int verify_subtree(struct bverify* verify, struct bnode* node, uint32_t depth, bkey_t* low, bkey_t* high, struct btree_fault* fault) {
+    if (check_bnode(verify, node, depth, low, high, fault)) {
+        return 1;
+    }
+
+    for (int i = 0; !node->leaf && i < node->num_keys + 1; i++) {
+        bkey_t* below = (i > 0) ? &node->keys[i-1].key : low;
+        bkey_t* above = (i < node->num_keys) ? &node->keys[i].key : high;
+        if (verify_subtree(verify, node->links[i], depth + 1, below, above, fault)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void verify_walked(void* entry) {
+    struct walk_entry* walked = entry;
+    verify_subtree(walked->context, walked->node, walked->depth, walked->low, walked->high, &walked->fault);
+}
+
+/**
+ * Checks the subtrees in parallel, then the nodes above them, and reports
+ * the fault met first in pre-order, as the serial walk would.
+ */
+static int verify_in_parallel(struct btree* tree, struct bverify* verify, struct btree_fault* fault) {
+    struct walk walk = { NULL, 0, 0 };
+    gather(&walk, tree->root, 0, split_depth(tree), NULL, NULL);
+    for (uint32_t i = 0; i < walk.count; i++) {
+        walk.entries[i].context = verify;
+    }
+
+    run_walk(tree->pool, &walk, verify_walked);
+
+    int result = 0;
+    for (uint32_t i = 0; i < walk.count && !result; i++) {
+        struct walk_entry* entry = &walk.entries[i];
+        if (entry->top) {
+            check_bnode(verify, entry->node, entry->depth, entry->low, entry->high, &entry->fault);
+        }
+
+        if (entry->fault.kind != VERIFY_INTACT) {
+            *fault = entry->fault;
+            result = 1;
+        }
+    }
+
+    free(walk.entries);
+    return result;
+}
+
+static void free_tree(struct btree* tree) {
+    if (walk_in_parallel(tree)) {
+        free_in_parallel(tree);
+    } else {
+        free_subtree(tree->root);
+    }
+}
+
+// INDEX
+
+static struct info* tree_lookup(struct btree* tree, bkey_t key, struct info* copy) {
+    struct search_result search = { NULL, -1 };
+
+    if (find_key(tree, tree->root, key, &search)) {
+        return &search.node->keys[search.index].info;
+    } else {
+        return NULL;
+    }
+}
+
+static int tree_insert(struct btree* tree, bkey_t key, struct info* info) {
+    struct search_path path;
+    struct search_result search = { NULL, -1, &path };
+
+    if (!find_key(tree, tree->root, key, &search)) {
+        struct key_value item = {
+            .key = key,
+            .info = *info
+        };
+
+        // insert data into given node
+        insert_key(search.node, &item);
+        divide(tree, search.node, &path);
+        return 0;
+    } else {
+        return 1;
+    }
+}
+
+static int tree_remove(struct btree* tree, bkey_t key) {
+    struct search_path path;
+    struct search_result search = { NULL, -1, &path };
+
+    if (find_key(tree, tree->root, key, &search)) {
+        struct bnode* target = search.node;
+
+        if (!target->leaf) {
+            // continue the path down to the predecessor's leaf
+            struct bnode* subnode = target;
+            int slot = search.index;
+            while (!subnode->leaf) {
+                path.nodes[path.depth] = subnode;
+                path.slots[path.depth] = slot;
+                path.depth += 1;
+                subnode = subnode->links[slot];
+                slot = subnode->num_keys;
             }
+
+            // move largest subkey in the left subtree into target
+            struct key_value* destination = &target->keys[search.index];
+            epoch_retire(tree->epochs, &destination->info);
+            take_key(subnode, subnode->num_keys-1, destination);
+            target = subnode;
+        } else {
+            struct key_value removed;
+            take_key(target, search.index, &removed);
+            epoch_retire(tree->epochs, &removed.info);
         }
 
-        // fprintf(stderr, "freeing links & keys\n");
-        free(node->links);
-        free(node->keys);
-        free(node);
+        merge(tree, target, &path);
+        return 0;
+    } else {
+        return 1;
     }
 }
 
-void recursive_free_node(struct bnode* target) {
-    if (target != NULL) {
-        // recursively free subtree
-        for (int i = 0; i < target->num_keys + 1; i++) {
-            if (target->links[i]) {
-                recursive_free_node(target->links[i]);
-                target->links[i] = NULL;
+/**
+ * Visits keys of the subtree in order from the first no less than low,
+ * returning 1 once a key greater than high is reached or visit asks to stop.
+ */
+static int range_node(struct bnode* node, bkey_t low, bkey_t high, range_visit visit, void* context, uint64_t* count) {
+    if (node == NULL) {
+        return 0;
+    }
+
+    int start = (node->num_keys > 0) ? key_index(node, low, 0, node->num_keys-1) : 0;
+    for (int i = start; i < node->num_keys + 1; i++) {
+        if (!node->leaf && range_node(node->links[i], low, high, visit, context, count)) {
+            return 1;
+        }
+
+        if (i < node->num_keys) {
+            if (key_less(high, node->keys[i].key)) {
+                return 1;
             }
 
-            // free associated data with key
-            if (i < target->num_keys && target->keys[i].info.data) {
-                free(target->keys[i].info.data);
-                target->keys[i].info.data = NULL;
+            *count += 1;
+            if (visit(node->keys[i].key, &node->keys[i].info, context)) {
+                return 1;
             }
         }
+    }
+
+    return 0;
+}
 
-        free(target->links);
-        free(target->keys);
-        free(target);
+static uint64_t tree_range(struct btree* tree, bkey_t low, bkey_t high, range_visit visit, void* context) {
+    uint64_t count = 0;
+    range_node(tree->root, low, high, visit, context, &count);
+    return count;
+}
+
+static uint64_t tree_listing(struct btree* tree, struct node* list) {
+    if (walk_in_parallel(tree)) {
+        return list_in_parallel(tree, list);
     }
+
+    return listing_nodes(tree->root, list);
 }
 
-void fix_node(struct btree* tree, struct bnode* node) {
-    for (int i=0; i + 1 < tree->branching + 1; i++) {
-        if (!node->links[i]) {
-            for (int j=i; j < tree->branching + 1; j++) {
-                if (j + 1 < tree->branching + 1) {
-                    node->links[j] = node->links[j + 1];
-                } else {
-                    node->links[j] = NULL;
-                }
+static void shape_bnode(struct btree* tree, struct bnode* node, int depth, struct shape_walk* walk) {
+    struct btree_shape* shape = walk->shape;
 
-                if (node->links[j]) {
-                    node->links[j]->link_index = j;
-                    node->links[j]->parent = node;
-                }
-            }
+    shape_node(walk, depth, node->num_keys, tree->branching - 1, 1);
+    shape_arena(walk, &shape->node_bytes, node->arena, node, sizeof(struct bnode));
+    shape_arena(walk, &shape->key_bytes, node->arena, node->keys, sizeof(struct key_value) * tree->branching);
+    shape_arena(walk, &shape->link_bytes, node->arena, node->links, sizeof(void*) * (tree->branching + 1));
+
+    for (int i = 0; i < node->num_keys; i++) {
+        shape_payload(walk, &node->keys[i].info);
+    }
+
+    for (int i = 0; i < node->num_keys + 1; i++) {
+        if (node->links[i]) {
+            shape_bnode(tree, node->links[i], depth + 1, walk);
+        }
+    }
+}
+
+static void tree_shape(struct btree* tree, struct shape_walk* walk) {
+    shape_bnode(tree, tree->root, 0, walk);
+}
+
+/**
+ * Snapshots share nodes with the tree and read them without its lock, so
+ * while any are live the tree is left alone.
+ */
+static int tree_rekey(struct btree* tree, struct rekey* rekey) {
+    struct versions* versions = tree->index;
+    if (versions && versions->snapshots) {
+        return 1;
+    }
+
+    if (rekey->in_place && walk_in_parallel(tree)) {
+        rekey_in_parallel(tree, rekey);
+    } else {
+        rekey_subtree(tree->root, rekey);
+    }
+
+    return 0;
+}
+
+static int tree_verify(struct btree* tree, struct btree_fault* fault) {
+    struct bverify verify = {
+        .root = tree->root,
+        .max_keys = tree->index ? tree->branching : tree->branching - 1
+    };
+
+    for (struct bnode* node = tree->root; !node->leaf && node->links[0]; node = node->links[0]) {
+        verify.leaf_depth += 1;
+    }
+
+    if (walk_in_parallel(tree)) {
+        return verify_in_parallel(tree, &verify, fault);
+    } else {
+        return verify_subtree(&verify, tree->root, 0, NULL, NULL, fault);
+    }
+}
+
+static void tree_destroy(struct btree* tree) {
+    free_tree(tree);
+}
+
+const struct index_ops BTREE_OPS = {
+    .lookup = tree_lookup,
+    .insert = tree_insert,
+    .remove = tree_remove,
+    .range = tree_range,
+    .listing = tree_listing,
+    .destroy = tree_destroy,
+    .shape = tree_shape,
+    .rekey = tree_rekey,
+    .verify = tree_verify
+};
+
+/**
+ * Snapshots may share the node holding key, so while any are live the key
+ * is taken out and put back, which copies the nodes on its path.
+ */
+static int top_down_update(struct btree* tree, bkey_t key, struct update* update) {
+    struct versions* versions = tree->index;
+    if (versions->snapshots == NULL) {
+        struct info* stored = tree_lookup(tree, key, NULL);
+        if (stored) {
+            update_info(update, key, stored);
         }
+
+        return stored == NULL;
     }
+
+    if (top_down_remove(tree, key)) {
+        return 1;
+    }
+
+    top_down_insert(tree, key, update_payload(update, key));
+    update->encrypted = 0;
+    return 0;
 }
 
+static void top_down_destroy(struct btree* tree) {
+    free_tree(tree);
+    reclaim(tree->index, NULL);
+    free(tree->index);
+}
+
+static int snapshot_insert(struct btree* tree, bkey_t key, struct info* info) {
+    return 1;
+}
+
+static int snapshot_remove(struct btree* tree, bkey_t key) {
+    return 1;
+}
+
+static int snapshot_update(struct btree* tree, bkey_t key, struct update* update) {
+    return 1;
+}
+
+/**
+ * Releases a snapshot handle, whose index is its entry in the snapshots of
+ * the live tree. Handles are released without holding the store they were
+ * taken from, so it is locked here while reclaiming.
+ */
+static void snapshot_destroy(struct btree* handle) {
+    struct snapshot* snapshot = handle->index;
+    struct btree* tree = snapshot->live;
+    struct versions* versions = tree->index;
+
+    pthread_rwlock_wrlock(&tree->lock);
+    struct snapshot** cursor = &versions->snapshots;
+    while (*cursor != snapshot) {
+        cursor = &(*cursor)->next;
+    }
+
+    *cursor = snapshot->next;
+    versions->shared = versions->snapshots ? versions->snapshots->version : 0;
+    reclaim(versions, tree->epochs);
+    pthread_rwlock_unlock(&tree->lock);
+
+    free(snapshot);
+}
+
+static const struct index_ops SNAPSHOT_OPS = {
+    .lookup = tree_lookup,
+    .insert = snapshot_insert,
+    .remove = snapshot_remove,
+    .range = tree_range,
+    .listing = tree_listing,
+    .destroy = snapshot_destroy,
+    .shape = tree_shape,
+    .update = snapshot_update,
+    .verify = tree_verify
+};
+
+/**
+ * Opens a read-only handle on the tree as it is now. Nodes visible to the
+ * handle are copied rather than changed by later writes, and anything they
+ * drop is only freed once no older snapshot remains.
+ */
+static void* top_down_snapshot(struct btree* tree) {
+    struct versions* versions = tree->index;
+    struct snapshot* snapshot = malloc(sizeof(struct snapshot));
+    snapshot->live = tree;
+    snapshot->version = versions->current;
+    snapshot->next = versions->snapshots;
+    versions->snapshots = snapshot;
+    versions->shared = versions->current;
+    versions->current += 1;
+
+    struct btree* handle = malloc(sizeof(struct btree));
+    *handle = (struct btree) {
+        .branching = tree->branching,
+        .processors = tree->processors,
+        .pool = tree->pool,
+        .root = tree->root,
+        .num_nodes = tree->num_nodes,
+        .ops = &SNAPSHOT_OPS,
+        .index = snapshot
+    };
+
+    pthread_rwlock_init(&handle->lock, NULL);
+    return handle;
+}
+
+const struct index_ops BTREE_TOP_DOWN_OPS = {
+    .lookup = tree_lookup,
+    .insert = top_down_insert,
+    .remove = top_down_remove,
+    .range = tree_range,
+    .listing = tree_listing,
+    .destroy = top_down_destroy,
+    .shape = tree_shape,
+    .snapshot = top_down_snapshot,
+    .rekey = tree_rekey,
+    .update = top_down_update,
+    .verify = tree_verify
+};
+
+void top_down_init(struct btree* tree) {
+    struct versions* versions = calloc(1, sizeof(struct versions));
+    versions->current = 1;
+    tree->index = versions;
+    tree->root = tree_node(tree, 1);
+}
+
+// UTILITY
+
+struct bnode* new_node(uint32_t branching, int leaf) {
+    return new_node_in(NULL, branching, leaf);
+}
+
+/**
+ * A node whose arrays are allocated along with it from arena, or from
+ * malloc for a NULL arena.
+ */
+struct bnode* new_node_in(struct arena* arena, uint32_t branching, int leaf) {
+    struct bnode* node = arena_alloc(arena, sizeof(struct bnode));
+    node->num_keys = 0;
+    node->leaf = leaf;
+    node->version = 0;
+    node->arena = arena;
+
+    node->links = arena_alloc(arena, sizeof(void*) * (branching+1));
+    node->keys = arena_alloc(arena, sizeof(struct key_value) * branching);
+    memset(node->links, 0, sizeof(void*) * (branching+1));
+    memset(node->keys, 0, sizeof(struct key_value) * branching);
+
+    return node;
+}
+
+/**
+ * Finds the node whose links hold target, searching the tree from the root,
+ * and the index of the link. Returns NULL if target is the root or is not in
+ * the tree.
+ */
+static struct bnode* find_parent(struct btree* tree, struct bnode* target, int* slot) {
+    struct search_path stack;
+    stack.nodes[0] = tree->root;
+    stack.slots[0] = 0;
+    stack.depth = (tree->root != NULL && tree->root != target);
+
+    while (stack.depth > 0) {
+        struct bnode* node = stack.nodes[stack.depth - 1];
+        int* next = &stack.slots[stack.depth - 1];
+
+        if (node->leaf || *next > node->num_keys) {
+            stack.depth -= 1;
+            continue;
+        }
+
+        struct bnode* link = node->links[*next];
+        if (link == target) {
+            *slot = *next;
+            return node;
+        }
+
+        *next += 1;
+        if (link) {
+            stack.nodes[stack.depth] = link;
+            stack.slots[stack.depth] = 0;
+            stack.depth += 1;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Frees the subtree under node, first taking it out of the links of its
+ * parent. Nodes do not know their parent, so it is searched for from the
+ * root, which makes this a walk over the tree for any node but the root.
+ */
 void free_node(struct btree* tree, struct bnode* node) {
-    struct bnode* parent = node->parent;
-    if (parent) {
-        // speparate subtree from parent
-        parent->links[node->link_index] = NULL;
+    int slot;
+    struct bnode* parent = find_parent(tree, node, &slot);
 
-        // readjust links
-        fix_node(tree, parent);
+    if (parent) {
+        take_link(tree, parent, slot, NULL);
+    } else {
+        free_subtree(node);
     }
+}
 
-    // recursively free subtree
-    recursive_free_node(node);
+void list_node(struct bnode* node, struct node* insert) {
+    insert->num_keys = node->num_keys;
+    insert->keys = malloc(node->num_keys * sizeof(bkey_t));
+    for (int i = 0; i < node->num_keys; i++) {
+        insert->keys[i] = node->keys[i].key;
+    }
 }
 
 uint64_t listing_nodes(struct bnode* node, struct node* insert) {
     // recursively call providing bnode as argument
     if (node) {
         if (insert) {
-            insert->num_keys = node->num_keys;
-            insert->keys = malloc(node->num_keys * sizeof(uint32_t));
-            for (int i = 0; i < node->num_keys; i++) {
-                insert->keys[i] = node->keys[i].key;
-            }
+            list_node(node, insert);
         }
 
         uint64_t index = 1;
         for (int i = 0; i < node->num_keys + 1; i++) {
-            index += listing_nodes(node->links[i], insert + index);
+            index += listing_nodes(node->links[i], insert ? insert + index : NULL);
         }
 
         return index;
@@ -487,7 +1483,8 @@ void display(struct bnode* node, char* prefix, int last) {
 
     for (int i=0; i < node->num_keys; i++) {
         char* end = (i < node->num_keys-1) ? ", " : "";
-        printf("%d%s", node->keys[i].key, end);
+        print_key(stdout, node->keys[i].key);
+        printf("%s", end);
     }
 
     printf(")\n");
@@ -518,7 +1515,8 @@ void debug(struct bnode* node, char* prefix, int last) {
 
     for (int i=0; i < node->num_keys; i++) {
         char* end = (i < node->num_keys-1) ? ", " : "";
-        fprintf(stderr, "%d%s", node->keys[i].key, end);
+        print_key(stderr, node->keys[i].key);
+        fprintf(stderr, "%s", end);
     }
 
     fprintf(stderr, ") %p\n", node);
@@ -5,17 +5,74 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "btreestore.h"
 
+/**
+ * Nodes hold no pointer back to their parent, writers find it on the path
+ * recorded by find_key instead.
+ */
 struct bnode {
     uint32_t num_keys;
-    int link_index;
     int leaf;
 
+    // version of the tree the node was created at, see btree_snapshot
+    uint64_t version;
+
     struct key_value* keys;
     struct bnode** links;
-    struct bnode* parent;
+
+    // where the node and its arrays came from, NULL for malloc
+    struct arena* arena;
+};
+
+struct btree;
+struct shape_walk;
+struct trace;
+struct epochs;
+struct dedup;
+struct arena;
+struct pool;
+struct rekey;
+struct update;
+
+/**
+ * Operations implemented by each kind of index a store can be built on.
+ * Payloads handed to insert are owned by the index from then on.
+ */
+struct index_ops {
+    // the record of key, or NULL, which indexes that unlock before returning
+    // copy into copy and return that instead
+    struct info* (*lookup)(struct btree* tree, bkey_t key, struct info* copy);
+    int (*insert)(struct btree* tree, bkey_t key, struct info* info);
+    int (*remove)(struct btree* tree, bkey_t key);
+    uint64_t (*range)(struct btree* tree, bkey_t low, bkey_t high, range_visit visit, void* context);
+    uint64_t (*listing)(struct btree* tree, struct node* list);
+    void (*destroy)(struct btree* tree);
+    void (*shape)(struct btree* tree, struct shape_walk* walk);
+
+    // NULL for indexes which cannot take snapshots
+    void* (*snapshot)(struct btree* tree);
+
+    // lists the nodes in one pass, used over listing when given
+    uint64_t (*export)(struct btree* tree, struct node** list);
+
+    // moves the payloads rekey picks onto its key, returning 1 if the index
+    // cannot now, NULL for indexes whose readers hold payloads without locks
+    int (*rekey)(struct btree* tree, struct rekey* rekey);
+
+    // replaces the payload of key, returning 1 if it is absent, used over
+    // updating the info lookup returns when given
+    int (*update)(struct btree* tree, bkey_t key, struct update* update);
+
+    // checks the structure of the index and the MAC of every value, with
+    // the store held shared
+    int (*verify)(struct btree* tree, struct btree_fault* fault);
+
+    // set for indexes whose writers synchronise among themselves, which the
+    // store only pins calls to rather than locking
+    int lock_free;
 };
 
 struct btree {
@@ -23,16 +80,72 @@ struct btree {
     uint8_t processors;
     struct bnode* root;
     uint64_t num_nodes;
+
+    const struct index_ops* ops;
+    void* index;
+
+    // NULL unless the store was opened with stats
+    struct btree_stats* stats;
+
+    // NULL unless the store was opened with trace_events
+    struct trace* trace;
+
+    // pins of readers holding payloads, which deletes wait on before freeing
+    struct epochs* epochs;
+
+    // values are stored with a MAC, see store_options
+    int macs;
+
+    // values are compressed, see store_options
+    int compress;
+
+    // small values are held in their records, see store_options
+    int inline_values;
+
+    // NULL unless the store was opened with dedup, shared by partitions
+    struct dedup* dedup;
+
+    // NULL unless the store was opened with huge_pages, one per partition
+    struct arena* arena;
+
+    // workers for walks over the whole tree, NULL for stores opened for one
+    // processor or of modes which do not walk in parallel, shared by
+    // partitions
+    struct pool* pool;
+
+    // shared by lookups, exclusive for anything which changes the index,
+    // unused by lock free indexes
+    pthread_rwlock_t lock;
 };
 
 struct key_value {
-    uint32_t key;
+    bkey_t key;
     struct info info;
 };
 
+// every node holds at least one key, so no tree reaches this height
+#define BTREE_MAX_HEIGHT (64)
+
+// stores opened for more than one processor export and tear down trees with
+// at least this many keys on that many threads
+#define BTREE_PARALLEL_KEYS (1 << 16)
+
+/**
+ * The nodes passed through on the way down from the root, and the link
+ * followed out of each, which writers climb back up when rebalancing.
+ */
+struct search_path {
+    struct bnode* nodes[BTREE_MAX_HEIGHT];
+    int slots[BTREE_MAX_HEIGHT];
+    int depth;
+};
+
 struct search_result {
     struct bnode* node;
     int index;
+
+    // filled in by find_key when set
+    struct search_path* path;
 };
 
 enum Direction {
@@ -42,36 +155,66 @@ enum Direction {
 
 // CORE FUNCTIONALITY
 
-void divide(struct btree* tree, struct bnode* target);
+void divide(struct btree* tree, struct bnode* target, struct search_path* path);
 
-void merge(struct btree* tree, struct bnode* target);
+void merge(struct btree* tree, struct bnode* target, struct search_path* path);
 
-int find_key(struct btree* tree, struct bnode* node, uint32_t key, struct search_result* result);
+int find_key(struct btree* tree, struct bnode* node, bkey_t key, struct search_result* result);
 
 // MANAGING KEYS AND LINKS
 
 int insert_key(struct bnode* node, struct key_value* item);
 
-int key_index(struct bnode* node, uint32_t key, int l, int r);
+int key_index(struct bnode* node, bkey_t key, int l, int r);
 
 void take_key(struct bnode* node, int index, struct key_value* buffer);
 
+int separator_index(struct bnode* node);
+
 void take_link(struct btree* tree, struct bnode* node, int index, struct bnode** buffer);
 
 int edge_index(struct bnode* node, enum Direction side, int is_key);
 
+// INDEX
+
+extern const struct index_ops BTREE_OPS;
+
+extern const struct index_ops BTREE_TOP_DOWN_OPS;
+
+void top_down_init(struct btree* tree);
+
 // UTILITY
 
 struct btree* new_tree(uint32_t branching_factor);
 
 uint64_t listing_nodes(struct bnode* node, struct node* insert);
 
+void list_node(struct bnode* node, struct node* insert);
+
 struct bnode* new_node(uint32_t branching, int leaf);
 
+struct bnode* new_node_in(struct arena* arena, uint32_t branching, int leaf);
+
 void display(struct bnode* node, char* prefix, int last);
 
 void debug(struct bnode* node, char* prefix, int last);
 
 void free_node(struct btree* tree, struct bnode* node);
 
+// STORE
+
+void init_index(struct btree* tree, enum store_mode mode);
+
+void store_lock_shared(struct btree* tree);
+
+void store_lock_exclusive(struct btree* tree);
+
+void store_unlock(struct btree* tree);
+
+uint64_t store_listing(struct btree* tree, struct node** list);
+
+int store_rekey(struct btree* tree, struct rekey* rekey);
+
+int store_update(struct btree* tree, bkey_t key, struct update* update);
+
 #endif
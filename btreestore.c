@@ -1,5 +1,16 @@
 #include "btreestore.h"
 #include "btree.h"
+#include "payload.h"
+#include "bplus.h"
+#include "betree.h"
+#include "bwtree.h"
+#include "partition.h"
+#include "stats.h"
+#include "trace.h"
+#include "epoch.h"
+#include "dedup.h"
+#include "arena.h"
+#include "pool.h"
 
 void print_links(struct bnode* node, int size, char* msg);
 void print_keys(struct bnode* node, int size, char* msg);
@@ -10,151 +21,716 @@ uint32_t displace(uint32_t value, uint32_t sum, uint32_t key[2]) {
          ^ ((value >> 5) + key[1]) % POWER_32;
 }
 
+/**
+ * Lock free indexes only need the calling thread pinned, so that the pages
+ * and payloads it reaches outlive concurrent writes.
+ */
+void store_lock_shared(struct btree* tree) {
+    if (tree->ops->lock_free) {
+        epoch_pin(tree->epochs);
+    } else {
+        pthread_rwlock_rdlock(&tree->lock);
+    }
+}
+
+void store_lock_exclusive(struct btree* tree) {
+    if (tree->ops->lock_free) {
+        epoch_pin(tree->epochs);
+    } else {
+        pthread_rwlock_wrlock(&tree->lock);
+    }
+}
+
+void store_unlock(struct btree* tree) {
+    if (tree->ops->lock_free) {
+        epoch_unpin(tree->epochs);
+    } else {
+        pthread_rwlock_unlock(&tree->lock);
+    }
+}
+
+/**
+ * Hands the encrypted value over to the index, releasing it if the key is
+ * already present. Values are encrypted before the store is locked, so the
+ * index checks again for a key which was inserted in the meantime.
+ */
+static int place_item(struct btree* tree, bkey_t key, struct info* info) {
+    uint64_t allocations = tree->stats ? count_allocations(info) : 0;
+
+    store_lock_exclusive(tree);
+    int result = tree->ops->insert(tree, key, info);
+    __atomic_add_fetch(&tree->num_nodes, result == 0, __ATOMIC_RELAXED);
+    store_unlock(tree);
+
+    if (result != 0) {
+        free_info(info);
+    } else {
+        STATS_ADD(tree->stats, inserts, 1);
+        STATS_ADD(tree->stats, allocations, allocations);
+    }
+
+    return result;
+}
+
+/**
+ * Calls are timed only when the store keeps stats or a trace, so plain
+ * stores never read the clock.
+ */
+static uint64_t call_start(struct btree* tree) {
+    if (!tree->stats && !tree->trace) {
+        return 0;
+    }
+
+    trace_begin();
+    return clock_ns();
+}
+
+static void call_end(struct btree* tree, enum stats_call call, bkey_t key, uint64_t start) {
+    if (!tree->stats && !tree->trace) {
+        return;
+    }
+
+    uint64_t end = clock_ns();
+    stats_record(tree->stats, call, end - start);
+    if (tree->trace) {
+        trace_record(tree->trace, call, key, start, end);
+    }
+}
+
+static int key_present(struct btree* tree, bkey_t key) {
+    struct info copy;
+    store_lock_shared(tree);
+    int present = tree->ops->lookup(tree, key, &copy) != NULL;
+    store_unlock(tree);
+    return present;
+}
+
 void* init_store(uint16_t branching, uint8_t n_processors) {
+    return init_store_with(branching, n_processors, NULL);
+}
+
+void* init_store_with(uint16_t branching, uint8_t n_processors, struct store_options* options) {
+    struct store_options defaults = { .mode = STORE_BTREE };
+    options = options ? options : &defaults;
+
     struct btree* tree = malloc(sizeof(struct btree));
-    tree->root = new_node(branching, 1);
     tree->processors = n_processors;
     tree->branching = branching;
     tree->num_nodes = 0;
+    tree->root = NULL;
+    tree->index = NULL;
+    tree->stats = options->stats ? calloc(1, sizeof(struct btree_stats)) : NULL;
+    tree->trace = options->trace_events ? trace_create(options->trace_events) : NULL;
+    tree->epochs = epochs_create();
+    tree->macs = options->macs;
+    tree->compress = options->compress;
+    tree->inline_values = options->inline_values;
+    tree->dedup = options->dedup ? dedup_create() : NULL;
+    tree->arena = options->huge_pages && options->partitions <= 1 ? arena_create(-1) : NULL;
+    pthread_rwlock_init(&tree->lock, NULL);
+
+    // only the plain trees walk in parallel
+    int walks = options->mode == STORE_BTREE || options->mode == STORE_TOP_DOWN;
+    tree->pool = (n_processors > 1 && walks) ? pool_create(n_processors) : NULL;
+
+    if (options->partitions > 1) {
+        tree->ops = &PARTITION_OPS;
+        partition_init(tree, options);
+    } else {
+        init_index(tree, options->mode);
+    }
+
     return tree;
 }
 
+/**
+ * Builds the index of the given mode on a tree whose other fields are set,
+ * which is how partitions build theirs.
+ */
+void init_index(struct btree* tree, enum store_mode mode) {
+    switch (mode) {
+        case STORE_BPLUS:
+            tree->ops = &BPLUS_OPS;
+            bplus_init(tree);
+            break;
+        case STORE_BEPSILON:
+            tree->ops = &BEPSILON_OPS;
+            betree_init(tree);
+            break;
+        case STORE_TOP_DOWN:
+            tree->ops = &BTREE_TOP_DOWN_OPS;
+            top_down_init(tree);
+            break;
+        case STORE_BWTREE:
+            tree->ops = &BWTREE_OPS;
+            bwtree_init(tree);
+            break;
+        default:
+            tree->ops = &BTREE_OPS;
+            tree->root = new_node_in(tree->arena, tree->branching, 1);
+            break;
+    }
+}
+
 void close_store(void * helper) {
     struct btree* tree = helper;
 
-    free_node(tree, tree->root);
+    tree->ops->destroy(tree);
+    pthread_rwlock_destroy(&tree->lock);
+    free(tree->stats);
+    if (tree->trace) {
+        trace_destroy(tree->trace);
+    }
+
+    if (tree->epochs) {
+        epochs_destroy(tree->epochs);
+    }
+
+    // after the epochs, whose limbo may still hold shared buffers
+    if (tree->dedup) {
+        dedup_destroy(tree->dedup);
+    }
+
+    if (tree->arena) {
+        arena_destroy(tree->arena);
+    }
+
+    if (tree->pool) {
+        pool_destroy(tree->pool);
+    }
+
     free(tree);
     return;
 }
 
-int btree_insert(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void* helper) {
-    struct search_result search = { NULL, -1 };
+/**
+ * The flags values inserted or updated whole are asked to be stored with.
+ */
+static uint32_t value_flags(struct btree* tree) {
+    return (tree->macs ? INFO_MAC : 0)
+        | (tree->compress ? INFO_COMPRESSED : 0)
+        | (tree->inline_values ? INFO_INLINE : 0)
+        | (tree->dedup ? INFO_SHARED : 0);
+}
+
+/**
+ * Encrypts and stores a value under a key which is not yet present. Returns
+ * 1 if the key is present or the value is longer than VALUE_MAX_BYTES.
+ */
+int btree_insert(bkey_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void* helper) {
     struct btree* tree = helper;
+    if (count > VALUE_MAX_BYTES) {
+        return 1;
+    }
 
-    if (!find_key(tree, tree->root, key, &search)) {
-        // fill in key_value struct
-        struct key_value item = {
-            .key = key,
-            .info = {
-                .key = { 0, 0, 0, 0 },
-                .nonce = nonce,
-                .size = count,
-                .data = NULL
-            }
-        };
+    uint64_t start = call_start(tree);
+    int result = 1;
 
-        memcpy(item.info.key, encryption_key, sizeof(uint32_t) * 4);
+    if (!key_present(tree, key)) {
+        struct info info;
+        encrypt_value(&info, key, plaintext, count, encryption_key, nonce, value_flags(tree));
+        dedup_intern(tree->dedup, &info);
+        STATS_ADD(tree->stats, bytes_encrypted, info.size);
 
-        // encrypt data
-        if (count > 0) {
-            int padded = count + (count % 8 > 0 ? (8 - (count % 8)) : 0);
-            item.info.data = malloc(padded);
-            int num_blocks = padded / 8;
+        result = place_item(tree, key, &info);
+    } else {
+        fprintf(stderr, "FAILED TO FIND INSERT\n");
+    }
 
-            // copy plaintext to padded text, padding it will null
-            // terminating characters
-            uint64_t* text = malloc(padded);
-            for (int i=0; i < padded; i++) {
-                ((char*) text)[i] = (i < count ? ((char*) plaintext)[i] : '\0');
-            }
+    call_end(tree, STATS_INSERT, key, start);
+    return result;
+}
 
-            encrypt_tea_ctr(text, encryption_key, nonce, item.info.data, num_blocks);
-            free(text);
+/**
+ * Replaces the value of key with the index locked, returning 1 if the key
+ * is absent. As for a rekey, the old value is only written over when no
+ * pinned thread may be holding it.
+ */
+int store_update(struct btree* tree, bkey_t key, struct update* update) {
+    store_lock_exclusive(tree);
+    update->in_place = !update->pinned && epoch_quiet(tree->epochs);
+    update->epochs = tree->epochs;
+
+    int result;
+    if (tree->ops->update) {
+        result = tree->ops->update(tree, key, update);
+    } else {
+        struct info* stored = tree->ops->lookup(tree, key, NULL);
+        if (stored) {
+            update_info(update, key, stored);
         }
 
-        // insert data into given node
-        insert_key(search.node, &item);
-        divide(tree, search.node);
-        tree->num_nodes += 1;
+        result = stored == NULL;
+    }
 
-        return 0;
-    } else {
-        fprintf(stderr, "FAILED TO FIND INSERT\n");
+    store_unlock(tree);
+    return result;
+}
+
+static void update_init(struct update* update, struct btree* tree, void* plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce) {
+    memset(update, 0, sizeof(struct update));
+    update->plaintext = plaintext;
+    update->count = count;
+    update->nonce = nonce;
+    update->flags = value_flags(tree);
+    update->dedup = tree->dedup;
+    update->pinned = epoch_pinned(tree->epochs);
+    memcpy(update->key, encryption_key, sizeof(uint32_t) * 4);
+}
+
+/**
+ * Replaces the value of a key which is present, without taking it out of
+ * the index. The new value is encrypted over the old one's buffer when it
+ * fits there. Returns 1 if the key is absent or the value is longer than
+ * VALUE_MAX_BYTES.
+ */
+int btree_update(bkey_t key, void* plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void* helper) {
+    struct btree* tree = helper;
+    if (count > VALUE_MAX_BYTES) {
         return 1;
     }
+
+    uint64_t start = call_start(tree);
+
+    struct update update;
+    update_init(&update, tree, plaintext, count, encryption_key, nonce);
+    int result = store_update(tree, key, &update);
+    if (update.encrypted) {
+        free_info(&update.info);
+    }
+
+    STATS_ADD(tree->stats, bytes_encrypted, result == 0 ? update.size : 0);
+    call_end(tree, STATS_UPDATE, key, start);
+    return result;
 }
 
-int btree_retrieve(uint32_t key, struct info* found, void* helper) {
-    struct search_result search = { NULL, -1 };
+/**
+ * Updates the value of key, or inserts it if the key is absent. An insert
+ * which loses to another thread inserting the same key turns back into an
+ * update. Returns 1 if the store would not take the value, as snapshots
+ * will not and as none will past VALUE_MAX_BYTES, or if the key was deleted
+ * again in between.
+ */
+int btree_upsert(bkey_t key, void* plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void* helper) {
     struct btree* tree = helper;
+    if (count > VALUE_MAX_BYTES) {
+        return 1;
+    }
 
-    if (find_key(tree, tree->root, key, &search)) {
-        struct key_value* stored = &search.node->keys[search.index];
-        *found = stored->info;
-        return 0;
+    uint64_t start = call_start(tree);
+
+    struct update update;
+    update_init(&update, tree, plaintext, count, encryption_key, nonce);
+    int result = store_update(tree, key, &update);
+    if (result) {
+        // placing the payload hands it over, or frees it
+        result = place_item(tree, key, update_payload(&update, key));
+        update.encrypted = 0;
+
+        if (result) {
+            result = store_update(tree, key, &update);
+        }
+    }
+
+    if (update.encrypted) {
+        free_info(&update.info);
+    }
+
+    STATS_ADD(tree->stats, bytes_encrypted, result == 0 ? update.size : 0);
+    call_end(tree, STATS_UPSERT, key, start);
+    return result;
+}
+
+int btree_retrieve(bkey_t key, struct info* found, void* helper) {
+    struct btree* tree = helper;
+    uint64_t start = call_start(tree);
+
+    store_lock_shared(tree);
+    struct info* stored = tree->ops->lookup(tree, key, found);
+    if (stored) {
+        *found = *stored;
+    }
+
+    store_unlock(tree);
+
+    STATS_ADD(tree->stats, lookups, 1);
+    STATS_ADD(tree->stats, misses, stored == NULL);
+    call_end(tree, STATS_RETRIEVE, key, start);
+    return stored == NULL;
+}
+
+/**
+ * Holds the store shared while decrypting, so the value cannot be deleted
+ * from under it. Output must hold the value's original size for compressed
+ * values. Returns 2 if the value fails its MAC, writing nothing, or does
+ * not decompress.
+ */
+int btree_decrypt(bkey_t key, void* output, void* helper) {
+    struct btree* tree = helper;
+    uint64_t start = call_start(tree);
+    int result = 1;
+
+    struct info copy;
+    store_lock_shared(tree);
+    struct info* stored = tree->ops->lookup(tree, key, &copy);
+    if (stored && !payload_intact(key, stored)) {
+        result = 2;
+    } else if (stored) {
+        result = decrypt_value(stored, output) ? 2 : 0;
+        STATS_ADD(tree->stats, bytes_decrypted, stored->size);
+    }
+
+    store_unlock(tree);
+
+    STATS_ADD(tree->stats, lookups, 1);
+    STATS_ADD(tree->stats, misses, stored == NULL);
+    call_end(tree, STATS_DECRYPT, key, start);
+    return result;
+}
+
+int btree_delete(bkey_t key, void* helper) {
+    struct btree* tree = helper;
+    uint64_t start = call_start(tree);
+
+    store_lock_exclusive(tree);
+    int removed = tree->ops->remove(tree, key) == 0;
+    __atomic_sub_fetch(&tree->num_nodes, removed, __ATOMIC_RELAXED);
+    store_unlock(tree);
+
+    STATS_ADD(tree->stats, deletes, removed);
+    call_end(tree, STATS_DELETE, key, start);
+    return removed;
+}
+
+/**
+ * Lists the nodes of the index into a new array, with the store locked.
+ */
+uint64_t store_listing(struct btree* tree, struct node** list) {
+    // exclusive, as some indexes reorganise themselves before listing
+    store_lock_exclusive(tree);
+    uint64_t count;
+    if (tree->ops->export) {
+        count = tree->ops->export(tree, list);
     } else {
+        count = tree->ops->listing(tree, NULL);
+        *list = malloc(count * sizeof(struct node));
+        count = tree->ops->listing(tree, *list);
+    }
+
+    store_unlock(tree);
+    return count;
+}
+
+uint64_t btree_export(void* helper, struct node** list) {
+    struct btree* tree = helper;
+    uint64_t start = call_start(tree);
+
+    uint64_t count = store_listing(tree, list);
+
+    bkey_t none;
+    memset(&none, 0, sizeof(bkey_t));
+    call_end(tree, STATS_EXPORT, none, start);
+    return count;
+}
+
+/**
+ * Visits every key between low and high inclusive in ascending order, along
+ * with its stored info, until visit returns non-zero. Returns the number of
+ * keys visited. The store stays locked throughout, so visit must not call
+ * back into it.
+ */
+uint64_t btree_range(bkey_t low, bkey_t high, range_visit visit, void* context, void* helper) {
+    struct btree* tree = helper;
+    uint64_t start = call_start(tree);
+
+    store_lock_exclusive(tree);
+    uint64_t count = tree->ops->range(tree, low, high, visit, context);
+    store_unlock(tree);
+
+    call_end(tree, STATS_RANGE, low, start);
+    return count;
+}
+
+/**
+ * Rekeys the index with it locked. Payloads are rewritten where they lie
+ * unless a pinned thread, the caller included, may be holding one of them.
+ */
+int store_rekey(struct btree* tree, struct rekey* rekey) {
+    if (tree->ops->rekey == NULL) {
         return 1;
     }
+
+    store_lock_exclusive(tree);
+    rekey->in_place = !rekey->pinned && epoch_quiet(tree->epochs);
+    rekey->epochs = tree->epochs;
+    int result = tree->ops->rekey(tree, rekey);
+    store_unlock(tree);
+    return result;
 }
 
-int btree_decrypt(uint32_t key, void* output, void* helper) {
-    struct info result = { 0, { 0, 0, 0, 0 }, 0, NULL };
+/**
+ * Moves the values of the records filter picks, or of every record when it
+ * is NULL, onto a new encryption key in one pass, without decrypting them or
+ * changing the shape of the index. Each record's nonce becomes the nonce
+ * given mixed with the hash of its key. Returns 1, having changed nothing,
+ * for Bw-tree stores and for top down stores with live snapshots.
+ */
+int btree_rekey(range_visit filter, void* context, uint32_t encryption_key[4], uint64_t nonce, void* helper) {
     struct btree* tree = helper;
+    struct rekey rekey = {
+        .filter = filter,
+        .context = context,
+        .nonce = nonce,
+        .pinned = epoch_pinned(tree->epochs)
+    };
+
+    memcpy(rekey.key, encryption_key, sizeof(uint32_t) * 4);
+    return store_rekey(tree, &rekey);
+}
 
-    if (btree_retrieve(key, &result, tree) == 0) {
-        int padded = result.size;
-        padded += (padded % 8 > 0 ? (8 - (padded % 8)) : 0);
+// PINNING
 
-        void* buffer = malloc(padded);
-        void* copy = malloc(padded);
-        memcpy(copy, result.data, padded);
+/**
+ * Pins the calling thread to the store. The info handed out by btree_retrieve
+ * points at the stored value, which a concurrent delete would otherwise free
+ * while it is being read. Values a pinned thread retrieved stay readable
+ * until it unpins, however they are deleted. Pins nest, and only cost the
+ * thread a store to its own record.
+ */
+void btree_pin(void* helper) {
+    struct btree* tree = helper;
+    epoch_pin(tree->epochs);
+}
 
-        decrypt_tea_ctr(
-            copy,
-            result.key,
-            result.nonce,
-            buffer,
-            padded / 8
-        );
+void btree_unpin(void* helper) {
+    struct btree* tree = helper;
+    epoch_unpin(tree->epochs);
+}
 
-        memcpy(output, buffer, result.size);
+// SNAPSHOTS
 
-        free(copy);
-        free(buffer);
+/**
+ * Takes a read-only, point in time view of the store, which is read through
+ * the same calls as the store while writers carry on, without holding them
+ * up. Writes through a snapshot fail. Snapshots must be released before the
+ * store is closed. Returns NULL if the store's mode cannot take snapshots,
+ * which only STORE_TOP_DOWN can.
+ */
+void* btree_snapshot(void* helper) {
+    struct btree* tree = helper;
+
+    if (tree->ops->snapshot == NULL) {
+        return NULL;
+    }
+
+    store_lock_exclusive(tree);
+    void* snapshot = tree->ops->snapshot(tree);
+    store_unlock(tree);
+    return snapshot;
+}
+
+void btree_snapshot_release(void* snapshot) {
+    close_store(snapshot);
+}
+
+// STATISTICS
+
+/**
+ * Reports the layout and memory footprint of the index. Counts of nodes and
+ * bytes held by nodes are exact, while payload and allocator slack bytes are
+ * estimated from at most sample evenly spread nodes, or every node if sample
+ * is 0. Sampling costs an extra walk over the nodes without touching the
+ * payloads. Returns 1 if the index cannot report its shape.
+ */
+int btree_shape(void* helper, struct btree_shape* shape, uint64_t sample) {
+    struct btree* tree = helper;
+    struct shape_walk walk = { .shape = shape, .stride = UINT64_MAX };
+    memset(shape, 0, sizeof(struct btree_shape));
+
+    if (tree->ops->shape == NULL) {
+        return 1;
+    }
+
+    store_lock_shared(tree);
+
+    // count the nodes first to spread the sample over them
+    if (sample > 0) {
+        tree->ops->shape(tree, &walk);
+        walk.stride = (shape->nodes + sample - 1) / sample;
+        memset(shape, 0, sizeof(struct btree_shape));
+    }
+
+    walk.stride = (walk.stride > 1 && sample > 0) ? walk.stride : 1;
+    tree->ops->shape(tree, &walk);
+    store_unlock(tree);
+
+    if (shape->inspected < shape->nodes) {
+        double scale = (double) shape->nodes / shape->inspected;
+        shape->payload_bytes *= scale;
+        shape->slack_bytes *= scale;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies the counters and latency histograms of a store opened with stats.
+ * Returns 1, with stats zeroed, if the store keeps none.
+ */
+int btree_stats(void* helper, struct btree_stats* stats) {
+    struct btree* tree = helper;
+
+    if (tree->stats == NULL) {
+        memset(stats, 0, sizeof(struct btree_stats));
+        return 1;
+    }
+
+    stats_snapshot(tree->stats, stats);
+    return 0;
+}
+
+/**
+ * Writes the calls held in the trace rings of a store opened with
+ * trace_events to path, in the Chrome trace format. Each call records the
+ * key, the depth reached and the nodes split or merged along the way. Returns
+ * 1 if the store keeps no trace or the file cannot be written.
+ */
+int btree_trace_dump(void* helper, const char* path) {
+    struct btree* tree = helper;
+
+    if (tree->trace == NULL) {
+        return 1;
+    }
+
+    return trace_dump(tree->trace, path);
+}
+
+// INTEGRITY
+
+/**
+ * Checks the invariants of the index and the MAC of every value, returning
+ * 1 with the first fault found, or 0 if there is none. Stores opened for
+ * several processors check large B-trees a subtree per task. Readers carry
+ * on meanwhile, and so do the writers of lock free indexes.
+ */
+int btree_verify(void* helper, struct btree_fault* fault) {
+    struct btree* tree = helper;
+    memset(fault, 0, sizeof(struct btree_fault));
+    fault->slot = -1;
+
+    store_lock_shared(tree);
+    int result = tree->ops->verify(tree, fault);
+    store_unlock(tree);
+    return result;
+}
+
+// STREAMING
+
+/**
+ * Starts an insert of count bytes which are handed over in any number of
+ * btree_insert_write calls, so the whole plaintext never has to be held at
+ * once. The value is encrypted as it arrives, so it is never compressed.
+ * Returns NULL if the key is already present or count is longer than
+ * VALUE_MAX_BYTES.
+ */
+void* btree_insert_begin(bkey_t key, size_t count, uint32_t encryption_key[4], uint64_t nonce, void* helper) {
+    struct btree* tree = helper;
+
+    if (count > VALUE_MAX_BYTES || key_present(tree, key)) {
+        return NULL;
+    }
+
+    struct insert_stream* stream = malloc(sizeof(struct insert_stream));
+    insert_stream_init(stream, key, count, encryption_key, nonce, value_flags(tree), helper);
+    return stream;
+}
+
+int btree_insert_write(void* stream, void* plaintext, size_t count) {
+    struct insert_stream* insert = stream;
+    struct btree* tree = insert->helper;
+
+    if (insert_stream_write(insert, plaintext, count) == 0) {
+        STATS_ADD(tree->stats, bytes_encrypted, count);
         return 0;
     } else {
         return 1;
     }
 }
 
-int btree_delete(uint32_t key, void* helper) {
-    struct search_result search = { NULL, -1 };
-    struct btree* tree = helper;
+/**
+ * Inserts the streamed value and releases the stream. Fails if fewer bytes
+ * were written than declared in btree_insert_begin.
+ */
+int btree_insert_commit(void* stream) {
+    struct insert_stream* insert = stream;
+    int result = 1;
+
+    if (insert_stream_finish(insert) == 0) {
+        struct btree* tree = insert->helper;
+        dedup_intern(tree->dedup, &insert->info);
+        result = place_item(tree, insert->key, &insert->info);
+    }
 
-    if (find_key(tree, tree->root, key, &search)) {
-        struct bnode* target = search.node;
+    free(insert);
+    return result;
+}
 
-        // free the data associated with the previous key
+/**
+ * Starts reading a value in pieces. The stream reads the stored value in
+ * place and pins the calling thread until btree_decrypt_end, so the value
+ * stays readable even if the key is deleted meanwhile. The stream must be
+ * ended on the thread which began it. Values failing their MAC are not
+ * read, as if absent, and neither are compressed values which do not
+ * decompress. A compressed value is decompressed whole by the stream.
+ */
+void* btree_decrypt_begin(bkey_t key, void* helper) {
+    struct btree* tree = helper;
+    struct info result = { 0, { 0, 0, 0, 0 }, 0, NULL };
 
-        if (!target->leaf) {
-            struct bnode* subnode = target;
-            while (subnode && !subnode->leaf) {
-                subnode = subnode->links[subnode->num_keys];
-            }
+    struct decrypt_stream* stream = NULL;
 
-            // move largest subkey in the left subtree into target
-            struct key_value* destination = &target->keys[search.index];
-            free(destination->info.data);
-            take_key(subnode, subnode->num_keys-1, destination);
-            target = subnode;
+    epoch_pin(tree->epochs);
+    if (btree_retrieve(key, &result, helper) == 0 && payload_intact(key, &result)) {
+        stream = malloc(sizeof(struct decrypt_stream));
+        if (decrypt_stream_init(stream, &result) == 0) {
+            stream->helper = helper;
         } else {
-            take_key(target, search.index, NULL);
+            free(stream);
+            stream = NULL;
         }
+    }
 
-        merge(tree, target);
-        tree->num_nodes -= 1;
-        return 1;
-    } else {
-        return 0;
+    if (stream == NULL) {
+        epoch_unpin(tree->epochs);
     }
+
+    return stream;
 }
 
-uint64_t btree_export(void* helper, struct node** list) {
-    struct btree* tree = helper;
-    *list = malloc(tree->num_nodes * sizeof(struct node));
-    return listing_nodes(tree->root, *list);
+/**
+ * Decrypts the next count bytes of the value into output and returns how many
+ * were produced, which is less than count only at the end of the value.
+ */
+size_t btree_decrypt_read(void* stream, void* output, size_t count) {
+    struct decrypt_stream* decrypt = stream;
+    struct btree* tree = decrypt->helper;
+
+    size_t done = decrypt_stream_read(decrypt, output, count);
+    STATS_ADD(tree->stats, bytes_decrypted, done);
+    return done;
 }
 
+void btree_decrypt_end(void* stream) {
+    struct decrypt_stream* decrypt = stream;
+    struct btree* tree = decrypt->helper;
+
+    decrypt_stream_release(decrypt);
+    epoch_unpin(tree->epochs);
+    free(stream);
+}
+
+// ENCRYPTION
+
 void encrypt_tea(uint32_t plain[2], uint32_t cipher[2], uint32_t key[4]) {
     uint32_t v0 = plain[0], v1 = plain[1];
     uint32_t sum = 0;
@@ -186,19 +762,40 @@ void decrypt_tea(uint32_t cipher[2], uint32_t plain[2], uint32_t key[4]) {
 }
 
 void encrypt_tea_ctr(uint64_t* plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint32_t num_blocks) {
-    uint64_t a, b;
-    for (int i=0; i < num_blocks; i++) {
-        a = i ^ nonce;
-        encrypt_tea((uint32_t*) &a, (uint32_t*) &b, key);
-        cipher[i] = plain[i] ^ b;
-    }
+    encrypt_tea_ctr_from(plain, key, nonce, 0, cipher, num_blocks);
 }
 
 void decrypt_tea_ctr(uint64_t* cipher, uint32_t key[4], uint64_t nonce, uint64_t * plain, uint32_t num_blocks) {
-    uint64_t a, b;
-    for (int i=num_blocks-1; i >= 0; i--) {
-        a = i ^ nonce;
-        encrypt_tea((uint32_t*) &a, (uint32_t*) &b, key);
-        plain[i] = cipher[i] ^ b;
+    decrypt_tea_ctr_from(cipher, key, nonce, 0, plain, num_blocks);
+}
+
+/**
+ * The keystream for one counter block. The halves go through uint32_t arrays
+ * by memcpy, as writing a uint64_t through a uint32_t pointer breaks strict
+ * aliasing and optimised builds drop the write.
+ */
+static uint64_t keystream_block(uint32_t key[4], uint64_t nonce, uint64_t counter) {
+    uint64_t block = counter ^ nonce;
+    uint32_t input[2], output[2];
+
+    memcpy(input, &block, sizeof(block));
+    encrypt_tea(input, output, key);
+    memcpy(&block, output, sizeof(block));
+    return block;
+}
+
+/**
+ * Counter mode starting at an arbitrary block index, so a value can be
+ * processed in pieces with the counter running on between them.
+ */
+void encrypt_tea_ctr_from(uint64_t* plain, uint32_t key[4], uint64_t nonce, uint64_t counter, uint64_t* cipher, uint32_t num_blocks) {
+    for (uint32_t i=0; i < num_blocks; i++) {
+        cipher[i] = plain[i] ^ keystream_block(key, nonce, counter + i);
+    }
+}
+
+void decrypt_tea_ctr_from(uint64_t* cipher, uint32_t key[4], uint64_t nonce, uint64_t counter, uint64_t* plain, uint32_t num_blocks) {
+    for (int64_t i=num_blocks-1; i >= 0; i--) {
+        plain[i] = cipher[i] ^ keystream_block(key, nonce, counter + i);
     }
 }
@@ -5,21 +5,238 @@
 #define POWER_32 (1UL << 32)
 #define DELTA (0x9E3779B9)
 
+// ciphertext bytes held by each link of a chained value, values no larger
+// than this are stored as a single flat buffer
+#define CHUNK_BYTES (4096)
+
+// info records the size of a value in 32 bits, so no value may be longer
+#define VALUE_MAX_BYTES (UINT32_MAX)
+
+// info flags
+#define INFO_CHAINED (1 << 0)
+#define INFO_MAC (1 << 1)
+#define INFO_COMPRESSED (1 << 2)
+#define INFO_INLINE (1 << 3)
+#define INFO_SHARED (1 << 4)
+
+// ciphertext of at most this many bytes may be held in the info itself
+#define INFO_INLINE_BYTES (16)
+
 #include <stdint.h>
 #include <stddef.h>
 
+#include "bkey.h"
+
+// keys are made with key_from_int, or from up to BTREE_KEY_MAX bytes with
+// key_from_bytes in builds with string keys, which refuses longer input
+// rather than cutting it short
+
+// size counts the bytes stored, which for a value with INFO_COMPRESSED set
+// decrypt to original bytes
 struct info {
     uint32_t size;
     uint32_t key[4];
     uint64_t nonce;
-    void* data;
+
+    // when INFO_INLINE is set the ciphertext is in blocks, with no buffer
+    union {
+        void* data;
+        uint64_t blocks[INFO_INLINE_BYTES / 8];
+    };
+
+    uint32_t flags;
+    uint32_t original;
+
+    // over the ciphertext, when INFO_MAC is set
+    uint64_t mac;
+};
+
+// when INFO_CHAINED is set, data points at the first chunk of the value
+struct chunk {
+    struct chunk* next;
+    uint32_t size;
+    uint64_t data[];
 };
 
 struct node {
     uint16_t num_keys;
-    uint32_t* keys;
+    bkey_t* keys;
+};
+
+enum store_mode {
+    STORE_BTREE = 0,
+    STORE_BPLUS = 1,
+    STORE_BEPSILON = 2,
+
+    // the B-tree, splitting and merging on the way down instead of back up
+    STORE_TOP_DOWN = 3,
+
+    // lock free pages changed by installing deltas, as in the Bw-tree
+    STORE_BWTREE = 4
+};
+
+enum partition_scheme {
+    // spreads keys evenly, ranges merge across every partition
+    PARTITION_HASH = 0,
+
+    // splits the span of keys set by partition_low and partition_high evenly,
+    // ranges only visit the partitions they span
+    PARTITION_RANGE = 1
+};
+
+// zero initialised options give the same store as init_store
+struct store_options {
+    enum store_mode mode;
+
+    // keep the counters and histograms read by btree_stats
+    int stats;
+
+    // keep the last trace_events calls of each thread for btree_trace_dump,
+    // rounded up to a power of two, 0 for no trace
+    uint32_t trace_events;
+
+    // split the store into this many independent trees of the mode, each
+    // locked on its own, 0 or 1 for a single tree
+    uint32_t partitions;
+    enum partition_scheme partition_by;
+
+    // with PARTITION_RANGE, the keys split between the partitions, those
+    // outside going to the first or last. Left zero the whole key space is
+    // split, which leaves keys counted up from zero in the first partition
+    bkey_t partition_low;
+    bkey_t partition_high;
+
+    // keep a MAC of each value, checked whenever it is decrypted
+    int macs;
+
+    // compress values inserted or updated whole before they are encrypted,
+    // where that saves space
+    int compress;
+
+    // keep values of up to INFO_INLINE_BYTES of ciphertext in their record
+    // rather than a buffer of their own
+    int inline_values;
+
+    // share one buffer between values which encrypt to the same ciphertext,
+    // as values with the same plaintext, key and nonce do
+    int dedup;
+
+    // allocate the nodes of B-trees and B+ trees from 2MB huge pages, so a
+    // descent misses the TLB less often
+    int huge_pages;
+
+    // with huge_pages, place partition i on NUMA node i modulo the number
+    // of nodes, for callers which keep each partition's threads there
+    int numa;
+};
+
+// latency histograms have this many buckets per power of two, so a bucket
+// is within 1/STATS_SUB_BUCKETS of the latencies it holds
+#define STATS_SUB_BUCKETS (8)
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS)
+
+enum stats_call {
+    STATS_INSERT = 0,
+    STATS_RETRIEVE,
+    STATS_DECRYPT,
+    STATS_DELETE,
+    STATS_RANGE,
+    STATS_EXPORT,
+    STATS_UPDATE,
+    STATS_UPSERT,
+    STATS_CALLS
+};
+
+struct btree_histogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+struct btree_stats {
+    uint64_t inserts;
+    uint64_t lookups;
+    uint64_t misses;
+    uint64_t deletes;
+
+    uint64_t splits;
+    uint64_t borrows;
+    uint64_t merges;
+    uint64_t root_grows;
+    uint64_t root_shrinks;
+
+    uint64_t bytes_encrypted;
+    uint64_t bytes_decrypted;
+    uint64_t allocations;
+
+    struct btree_histogram latency[STATS_CALLS];
 };
 
+#define SHAPE_LEVELS (64)
+#define SHAPE_FILL_BUCKETS (10)
+
+/**
+ * Layout of the index as reported by btree_shape. Fill buckets count nodes
+ * by the fraction of their key capacity in use, in tenths, with full nodes in
+ * the last bucket. Byte counts are what the store asked the allocator for,
+ * slack is what the allocator handed out on top.
+ */
+struct btree_shape {
+    uint32_t height;
+    uint64_t nodes;
+    uint64_t records;
+    uint64_t level_nodes[SHAPE_LEVELS];
+    uint64_t fill[SHAPE_FILL_BUCKETS];
+
+    uint64_t node_bytes;
+    uint64_t key_bytes;
+    uint64_t link_bytes;
+    uint64_t buffer_bytes;
+    uint64_t payload_bytes;
+    uint64_t slack_bytes;
+
+    // nodes whose payloads and allocations were inspected, payload and slack
+    // bytes are scaled up from these when sampling
+    uint64_t inspected;
+};
+
+enum verify_fault {
+    VERIFY_INTACT = 0,
+
+    // keys out of order within a node, or outside the bounds its parent
+    // gives it
+    VERIFY_ORDER,
+    VERIFY_BOUNDS,
+
+    // a node holding more keys than it can, or fewer than it must
+    VERIFY_FILL,
+
+    // a leaf at another depth than the first leaf
+    VERIFY_DEPTH,
+
+    // a missing link, or a leaf chained to the wrong neighbour
+    VERIFY_LINK,
+
+    // a value whose ciphertext does not match its MAC
+    VERIFY_MAC
+};
+
+/**
+ * The first fault btree_verify finds, walking down from the root. Node is
+ * the index's own node, at depth below the root, and slot is the key or link
+ * within it, or -1 for the node as a whole.
+ */
+struct btree_fault {
+    enum verify_fault kind;
+    void* node;
+    uint32_t depth;
+    int slot;
+    bkey_t key;
+};
+
+typedef int (*range_visit)(bkey_t key, struct info* info, void* context);
+
 struct double_pipe {
     union {
         int arr[2];
@@ -34,18 +251,68 @@ struct double_pipe {
 
 void* init_store(uint16_t branching, uint8_t n_processors);
 
+void* init_store_with(uint16_t branching, uint8_t n_processors, struct store_options* options);
+
 void close_store(void* helper);
 
-int btree_insert(uint32_t key, void* plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void* helper);
+int btree_insert(bkey_t key, void* plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void* helper);
 
-int btree_retrieve(uint32_t key, struct info* found, void* helper);
+int btree_update(bkey_t key, void* plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void* helper);
 
-int btree_decrypt(uint32_t key, void* output, void* helper);
+int btree_upsert(bkey_t key, void* plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void* helper);
 
-int btree_delete(uint32_t key, void* helper);
+int btree_retrieve(bkey_t key, struct info* found, void* helper);
+
+int btree_decrypt(bkey_t key, void* output, void* helper);
+
+int btree_delete(bkey_t key, void* helper);
 
 uint64_t btree_export(void* helper, struct node** list);
 
+uint64_t btree_range(bkey_t low, bkey_t high, range_visit visit, void* context, void* helper);
+
+int btree_rekey(range_visit filter, void* context, uint32_t encryption_key[4], uint64_t nonce, void* helper);
+
+// PINNING
+
+void btree_pin(void* helper);
+
+void btree_unpin(void* helper);
+
+// SNAPSHOTS
+
+void* btree_snapshot(void* helper);
+
+void btree_snapshot_release(void* snapshot);
+
+// STATISTICS
+
+int btree_stats(void* helper, struct btree_stats* stats);
+
+uint64_t btree_stats_percentile(struct btree_histogram* histogram, double q);
+
+int btree_shape(void* helper, struct btree_shape* shape, uint64_t sample);
+
+int btree_trace_dump(void* helper, const char* path);
+
+// INTEGRITY
+
+int btree_verify(void* helper, struct btree_fault* fault);
+
+// STREAMING
+
+void* btree_insert_begin(bkey_t key, size_t count, uint32_t encryption_key[4], uint64_t nonce, void* helper);
+
+int btree_insert_write(void* stream, void* plaintext, size_t count);
+
+int btree_insert_commit(void* stream);
+
+void* btree_decrypt_begin(bkey_t key, void* helper);
+
+size_t btree_decrypt_read(void* stream, void* output, size_t count);
+
+void btree_decrypt_end(void* stream);
+
 // ENCRYPTION
 
 void encrypt_tea(uint32_t plain[2], uint32_t cipher[2], uint32_t key[4]);
@@ -56,4 +323,8 @@ void encrypt_tea_ctr(uint64_t* plain, uint32_t key[4], uint64_t nonce, uint64_t*
 
 void decrypt_tea_ctr(uint64_t* cipher, uint32_t key[4], uint64_t nonce, uint64_t* plain, uint32_t num_blocks);
 
+void encrypt_tea_ctr_from(uint64_t* plain, uint32_t key[4], uint64_t nonce, uint64_t counter, uint64_t* cipher, uint32_t num_blocks);
+
+void decrypt_tea_ctr_from(uint64_t* cipher, uint32_t key[4], uint64_t nonce, uint64_t counter, uint64_t* plain, uint32_t num_blocks);
+
 #endif
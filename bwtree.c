@@ -0,0 +1,886 @@
+#include "bwtree.h"
+#include "payload.h"
+#include "stats.h"
+#include "trace.h"
+#include "epoch.h"
+
+/**
+ * The keys of a page as of one of its states, with the infos or links they
+ * lead to, built by applying the deltas on top of a copy of the base.
+ */
+struct bwview {
+    uint32_t num_keys;
+    bkey_t* keys;
+    struct info* infos;
+    uint64_t* links;
+};
+
+// HELPER FUNCTIONS
+
+/**
+ * Index of the first key which is no less than key.
+ */
+static uint32_t lower_bound(bkey_t* keys, uint32_t num_keys, bkey_t key) {
+    uint32_t l = 0, r = num_keys;
+    while (l < r) {
+        uint32_t m = (l + r) / 2;
+        if (key_less(keys[m], key)) {
+            l = m + 1;
+        } else {
+            r = m;
+        }
+    }
+
+    return l;
+}
+
+/**
+ * Index of the first key which is greater than key, and so the index of the
+ * link whose page would hold key.
+ */
+static uint32_t upper_bound(bkey_t* keys, uint32_t num_keys, bkey_t key) {
+    uint32_t l = 0, r = num_keys;
+    while (l < r) {
+        uint32_t m = (l + r) / 2;
+        if (!key_less(key, keys[m])) {
+            l = m + 1;
+        } else {
+            r = m;
+        }
+    }
+
+    return l;
+}
+
+// MAPPING TABLE
+
+static struct bwpage** page_slot(struct bwtree* index, uint64_t pid) {
+    struct bwpage** chunk = __atomic_load_n(&index->chunks[pid >> BWTREE_CHUNK_BITS], __ATOMIC_ACQUIRE);
+    return &chunk[pid & ((1 << BWTREE_CHUNK_BITS) - 1)];
+}
+
+static struct bwpage* page_state(struct bwtree* index, uint64_t pid) {
+    return __atomic_load_n(page_slot(index, pid), __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Swings the page from the state it was read at to the new one, failing if
+ * another thread changed the page first.
+ */
+static int install(struct bwtree* index, uint64_t pid, struct bwpage* expected, struct bwpage* state) {
+    return __atomic_compare_exchange_n(page_slot(index, pid), &expected, state, 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Names a new page holding state, reusing an identifier handed back if there
+ * is one. The chunk the page falls in is added by whichever thread gets there
+ * first. Returns BWTREE_NO_PAGE once the table is full.
+ */
+static uint64_t new_pid(struct bwtree* index, struct bwpage* state) {
+    uint64_t pid = BWTREE_NO_PAGE;
+    if (__atomic_load_n(&index->num_free, __ATOMIC_ACQUIRE) > 0) {
+        pthread_mutex_lock(&index->free_lock);
+        if (index->num_free > 0) {
+            pid = index->free_pids[index->num_free - 1];
+            __atomic_store_n(&index->num_free, index->num_free - 1, __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_unlock(&index->free_lock);
+    }
+
+    if (pid == BWTREE_NO_PAGE) {
+        pid = __atomic_load_n(&index->num_pages, __ATOMIC_RELAXED);
+        do {
+            if (pid >= BWTREE_MAX_PAGES) {
+                return BWTREE_NO_PAGE;
+            }
+        } while (!__atomic_compare_exchange_n(&index->num_pages, &pid, pid + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+
+    struct bwpage*** chunk = &index->chunks[pid >> BWTREE_CHUNK_BITS];
+    if (__atomic_load_n(chunk, __ATOMIC_ACQUIRE) == NULL) {
+        struct bwpage** fresh = calloc(1 << BWTREE_CHUNK_BITS, sizeof(struct bwpage*));
+        struct bwpage** expected = NULL;
+        if (!__atomic_compare_exchange_n(chunk, &expected, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(fresh);
+        }
+    }
+
+    __atomic_store_n(page_slot(index, pid), state, __ATOMIC_RELEASE);
+    return pid;
+}
+
+/**
+ * Hands back the identifier of a page which was never published, so no
+ * thread can be reaching it.
+ */
+static void free_pid(struct bwtree* index, uint64_t pid) {
+    __atomic_store_n(page_slot(index, pid), NULL, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&index->free_lock);
+    if (index->num_free == index->free_capacity) {
+        index->free_capacity = index->free_capacity ? index->free_capacity * 2 : 16;
+        index->free_pids = realloc(index->free_pids, index->free_capacity * sizeof(uint64_t));
+    }
+
+    index->free_pids[index->num_free] = pid;
+    __atomic_store_n(&index->num_free, index->num_free + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&index->free_lock);
+}
+
+/**
+ * Whether no page could be named, so pages can no longer split.
+ */
+static int table_full(struct bwtree* index) {
+    return __atomic_load_n(&index->num_pages, __ATOMIC_RELAXED) >= BWTREE_MAX_PAGES
+        && __atomic_load_n(&index->num_free, __ATOMIC_ACQUIRE) == 0;
+}
+
+// PAGE STATES
+
+static struct bwpage* new_page(struct bwtree* index, enum bwkind kind) {
+    struct bwpage* page = malloc(sizeof(struct bwpage));
+    STATS_ADD(index->stats, allocations, 1);
+    page->kind = kind;
+    return page;
+}
+
+/**
+ * Puts the delta on top of the state, keeping the bounds of the page.
+ */
+static void stack_delta(struct bwpage* delta, struct bwpage* state) {
+    delta->level = state->level;
+    delta->depth = state->depth + 1;
+    delta->next = state;
+    delta->bounded = state->bounded;
+    delta->high = state->high;
+    delta->right = state->right;
+}
+
+/**
+ * A base holding the view, which it takes the arrays of, with the bounds of
+ * the state it replaces.
+ */
+static struct bwpage* new_base(struct bwtree* index, struct bwpage* state, struct bwview* view) {
+    struct bwpage* base = new_page(index, BW_BASE);
+    stack_delta(base, state);
+    base->depth = 0;
+    base->next = NULL;
+
+    base->base.num_keys = view->num_keys;
+    base->base.keys = view->keys;
+    base->base.infos = view->infos;
+    base->base.links = view->links;
+    return base;
+}
+
+static void free_page(struct bwpage* page) {
+    if (page->kind == BW_BASE) {
+        free(page->base.keys);
+        free(page->base.infos);
+        free(page->base.links);
+    }
+
+    free(page);
+}
+
+/**
+ * Frees a state down to its base, without the payloads it leads to.
+ */
+static void free_chain(void* state) {
+    struct bwpage* page = state;
+    while (page) {
+        struct bwpage* next = page->next;
+        free_page(page);
+        page = next;
+    }
+}
+
+// VIEWS
+
+static void apply_delta(struct bwview* view, struct bwpage* delta) {
+    uint32_t index, moved;
+
+    switch (delta->kind) {
+        case BW_INSERT:
+            index = lower_bound(view->keys, view->num_keys, delta->record.key);
+            moved = view->num_keys - index;
+            memmove(view->keys + index + 1, view->keys + index, moved * sizeof(bkey_t));
+            memmove(view->infos + index + 1, view->infos + index, moved * sizeof(struct info));
+            view->keys[index] = delta->record.key;
+            view->infos[index] = delta->record.info;
+            view->num_keys += 1;
+            break;
+
+        case BW_DELETE:
+            index = lower_bound(view->keys, view->num_keys, delta->record.key);
+            if (index < view->num_keys && key_equal(view->keys[index], delta->record.key)) {
+                moved = view->num_keys - index - 1;
+                memmove(view->keys + index, view->keys + index + 1, moved * sizeof(bkey_t));
+                memmove(view->infos + index, view->infos + index + 1, moved * sizeof(struct info));
+                view->num_keys -= 1;
+            }
+            break;
+
+        case BW_UPDATE:
+            index = lower_bound(view->keys, view->num_keys, delta->record.key);
+            view->infos[index] = delta->record.info;
+            break;
+
+        case BW_SEPARATOR:
+            index = upper_bound(view->keys, view->num_keys, delta->entry.key);
+            moved = view->num_keys - index;
+            memmove(view->keys + index + 1, view->keys + index, moved * sizeof(bkey_t));
+            memmove(view->links + index + 2, view->links + index + 1, moved * sizeof(uint64_t));
+            view->keys[index] = delta->entry.key;
+            view->links[index + 1] = delta->entry.link;
+            view->num_keys += 1;
+            break;
+
+        case BW_SPLIT:
+            // the separator of an internal page moves up with the split
+            view->num_keys = lower_bound(view->keys, view->num_keys, delta->entry.key);
+            break;
+    }
+}
+
+/**
+ * Replays the deltas of the state oldest first on top of its base.
+ */
+static void build_view(struct bwpage* state, struct bwview* view) {
+    struct bwpage** chain = malloc((state->depth + 1) * sizeof(struct bwpage*));
+    uint32_t length = 0;
+    for (struct bwpage* page = state; page; page = page->next) {
+        chain[length++] = page;
+    }
+
+    struct bwpage* base = chain[length - 1];
+    uint32_t capacity = base->base.num_keys + length;
+    view->num_keys = base->base.num_keys;
+    view->keys = malloc(capacity * sizeof(bkey_t));
+    memcpy(view->keys, base->base.keys, view->num_keys * sizeof(bkey_t));
+
+    if (state->level == 0) {
+        view->infos = malloc(capacity * sizeof(struct info));
+        view->links = NULL;
+        memcpy(view->infos, base->base.infos, view->num_keys * sizeof(struct info));
+    } else {
+        view->infos = NULL;
+        view->links = malloc((capacity + 1) * sizeof(uint64_t));
+        memcpy(view->links, base->base.links, (view->num_keys + 1) * sizeof(uint64_t));
+    }
+
+    for (int64_t i = (int64_t) length - 2; i >= 0; i--) {
+        apply_delta(view, chain[i]);
+    }
+
+    free(chain);
+}
+
+static void free_view(struct bwview* view) {
+    free(view->keys);
+    free(view->infos);
+    free(view->links);
+}
+
+// SEARCHING
+
+/**
+ * Follows right links from the page until reaching the one whose bounds hold
+ * key, which differs only if the page split after its link was read.
+ */
+static struct bwpage* settle(struct bwtree* index, uint64_t* pid, bkey_t key) {
+    struct bwpage* state = page_state(index, *pid);
+    while (state->bounded && !key_less(key, state->high)) {
+        *pid = state->right;
+        state = page_state(index, *pid);
+    }
+
+    return state;
+}
+
+/**
+ * The page below the internal page which would hold key. Separators not yet
+ * consolidated sit in deltas, newest first.
+ */
+static uint64_t child_link(struct bwpage* state, bkey_t key) {
+    struct bwpage* page = state;
+    for (; page->kind != BW_BASE; page = page->next) {
+        if (page->kind == BW_SEPARATOR && !key_less(key, page->entry.key)
+                && (!page->entry.bounded || key_less(key, page->entry.high))) {
+            return page->entry.link;
+        }
+    }
+
+    return page->base.links[upper_bound(page->base.keys, page->base.num_keys, key)];
+}
+
+/**
+ * Walks down to the page at level which would hold key. Returns 0 if the tree
+ * is not that tall yet.
+ */
+static int descend(struct bwtree* index, bkey_t key, uint16_t level, uint64_t* pid, struct bwpage** state) {
+    *pid = __atomic_load_n(&index->root, __ATOMIC_ACQUIRE);
+    if (page_state(index, *pid)->level < level) {
+        return 0;
+    }
+
+    int depth = 0;
+    struct bwpage* page = settle(index, pid, key);
+    while (page->level > level) {
+        *pid = child_link(page, key);
+        page = settle(index, pid, key);
+        depth += 1;
+    }
+
+    if (level == 0) {
+        trace_reached(depth);
+    }
+
+    *state = page;
+    return 1;
+}
+
+static struct info* leaf_find(struct bwpage* state, bkey_t key) {
+    for (struct bwpage* page = state; page; page = page->next) {
+        switch (page->kind) {
+            case BW_INSERT:
+            case BW_UPDATE:
+                if (key_equal(page->record.key, key)) {
+                    return &page->record.info;
+                }
+                break;
+
+            case BW_DELETE:
+                if (key_equal(page->record.key, key)) {
+                    return NULL;
+                }
+                break;
+
+            case BW_BASE: {
+                uint32_t index = lower_bound(page->base.keys, page->base.num_keys, key);
+                int found = index < page->base.num_keys && key_equal(page->base.keys[index], key);
+                return found ? &page->base.infos[index] : NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// CONSOLIDATION
+
+static void consolidate(struct bwtree* index, uint64_t pid);
+
+/**
+ * Adds a root above the old one once its only sibling needs a separator.
+ * Returns 0 if another thread grew the tree first, or -1 if the table is
+ * full.
+ */
+static int grow_root(struct bwtree* index, uint16_t level, bkey_t key, uint64_t link) {
+    uint64_t old = __atomic_load_n(&index->root, __ATOMIC_ACQUIRE);
+    if (page_state(index, old)->level >= level) {
+        return 0;
+    }
+
+    struct bwpage* root = new_page(index, BW_BASE);
+    root->level = level;
+    root->depth = 0;
+    root->next = NULL;
+    root->bounded = 0;
+    root->base.num_keys = 1;
+    root->base.keys = malloc(sizeof(bkey_t));
+    root->base.infos = NULL;
+    root->base.links = malloc(2 * sizeof(uint64_t));
+    root->base.keys[0] = key;
+    root->base.links[0] = old;
+    root->base.links[1] = link;
+
+    uint64_t pid = new_pid(index, root);
+    if (pid == BWTREE_NO_PAGE) {
+        free_page(root);
+        return -1;
+    }
+
+    if (!__atomic_compare_exchange_n(&index->root, &old, pid, 0, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+        free_pid(index, pid);
+        free_page(root);
+        return 0;
+    }
+
+    STATS_ADD(index->stats, root_grows, 1);
+    return 1;
+}
+
+/**
+ * Points the parent level at the page split off at link, whose keys run from
+ * key up to high. Until this lands the page is reached through the right link
+ * of the page it split from, which it stays if the table is too full to grow
+ * a root.
+ */
+static void post_separator(struct bwtree* index, uint16_t level, bkey_t key, int bounded, bkey_t high, uint64_t link) {
+    struct bwpage* delta = new_page(index, BW_SEPARATOR);
+    delta->entry.key = key;
+    delta->entry.bounded = bounded;
+    delta->entry.high = high;
+    delta->entry.link = link;
+
+    uint64_t pid;
+    struct bwpage* state;
+    while (1) {
+        if (!descend(index, key, level, &pid, &state)) {
+            if (grow_root(index, level, key, link) != 0) {
+                free(delta);
+                return;
+            }
+
+            continue;
+        }
+
+        stack_delta(delta, state);
+        if (install(index, pid, state, delta)) {
+            break;
+        }
+    }
+
+    if (delta->depth >= index->chain) {
+        consolidate(index, pid);
+    }
+}
+
+/**
+ * Moves the upper half of an overfull page to a new page, then tells the
+ * parent level about it. The new page is only published by the split delta,
+ * so if another thread changed the page first it is simply dropped. Returns
+ * 0, leaving the view, if the table is too full to name the new page.
+ */
+static int split_page(struct bwtree* index, uint64_t pid, struct bwpage* state, struct bwview* view) {
+    uint64_t link = new_pid(index, NULL);
+    if (link == BWTREE_NO_PAGE) {
+        return 0;
+    }
+
+    uint32_t keep = view->num_keys / 2;
+    bkey_t separator = view->keys[keep];
+
+    // separators of internal pages move up rather than right
+    uint32_t first = (state->level == 0) ? keep : keep + 1;
+    struct bwview upper = { .num_keys = view->num_keys - first, .infos = NULL, .links = NULL };
+    upper.keys = malloc((upper.num_keys + 1) * sizeof(bkey_t));
+    memcpy(upper.keys, view->keys + first, upper.num_keys * sizeof(bkey_t));
+
+    if (state->level == 0) {
+        upper.infos = malloc((upper.num_keys + 1) * sizeof(struct info));
+        memcpy(upper.infos, view->infos + first, upper.num_keys * sizeof(struct info));
+    } else {
+        upper.links = malloc((upper.num_keys + 1) * sizeof(uint64_t));
+        memcpy(upper.links, view->links + first, (upper.num_keys + 1) * sizeof(uint64_t));
+    }
+
+    free_view(view);
+    struct bwpage* right = new_base(index, state, &upper);
+    __atomic_store_n(page_slot(index, link), right, __ATOMIC_RELEASE);
+
+    struct bwpage* delta = new_page(index, BW_SPLIT);
+    stack_delta(delta, state);
+    delta->entry.key = separator;
+    delta->entry.link = link;
+    delta->bounded = 1;
+    delta->high = separator;
+    delta->right = link;
+
+    if (!install(index, pid, state, delta)) {
+        free_pid(index, link);
+        free_page(right);
+        free(delta);
+        return 1;
+    }
+
+    STATS_ADD(index->stats, splits, 1);
+    TRACE_COUNT(splits);
+    post_separator(index, state->level + 1, separator, state->bounded, state->high, link);
+    consolidate(index, pid);
+    return 1;
+}
+
+/**
+ * Replaces the chain of deltas on a page with a single base, or splits the
+ * page if it has grown too big and the table can name another page. The
+ * replaced chain is freed once no pinned thread can be walking it. Whoever
+ * loses the race to change the page first leaves the work to the next writer
+ * to find the chain long.
+ */
+static void consolidate(struct bwtree* index, uint64_t pid) {
+    struct bwpage* state = page_state(index, pid);
+    if (state->kind == BW_BASE) {
+        return;
+    }
+
+    struct bwview view;
+    build_view(state, &view);
+
+    if (view.num_keys > index->max_keys && split_page(index, pid, state, &view)) {
+        return;
+    }
+
+    struct bwpage* base = new_base(index, state, &view);
+    if (install(index, pid, state, base)) {
+        epoch_defer(index->epochs, state, free_chain);
+    } else {
+        free_page(base);
+    }
+}
+
+// INDEX OPERATIONS
+
+static struct info* bwtree_lookup(struct btree* tree, bkey_t key, struct info* copy) {
+    uint64_t pid;
+    struct bwpage* state;
+    descend(tree->index, key, 0, &pid, &state);
+    return leaf_find(state, key);
+}
+
+/**
+ * Inserts are refused once the table is full, as the pages they land in could
+ * no longer split.
+ */
+static int bwtree_insert(struct btree* tree, bkey_t key, struct info* info) {
+    struct bwtree* index = tree->index;
+    if (table_full(index)) {
+        return 1;
+    }
+
+    struct bwpage* delta = new_page(index, BW_INSERT);
+    delta->record.key = key;
+    delta->record.info = *info;
+
+    uint64_t pid;
+    struct bwpage* state;
+    descend(index, key, 0, &pid, &state);
+
+    while (1) {
+        if (leaf_find(state, key)) {
+            free(delta);
+            return 1;
+        }
+
+        stack_delta(delta, state);
+        if (install(index, pid, state, delta)) {
+            break;
+        }
+
+        state = settle(index, &pid, key);
+    }
+
+    if (delta->depth >= index->chain) {
+        consolidate(index, pid);
+    }
+
+    return 0;
+}
+
+/**
+ * The payload is retired as soon as the delete delta lands, as no thread
+ * which starts after can reach it.
+ */
+static int bwtree_remove(struct btree* tree, bkey_t key) {
+    struct bwtree* index = tree->index;
+    struct bwpage* delta = new_page(index, BW_DELETE);
+    delta->record.key = key;
+
+    uint64_t pid;
+    struct bwpage* state;
+    struct info removed;
+    descend(index, key, 0, &pid, &state);
+
+    while (1) {
+        struct info* found = leaf_find(state, key);
+        if (found == NULL) {
+            free(delta);
+            return 1;
+        }
+
+        removed = *found;
+        stack_delta(delta, state);
+        if (install(index, pid, state, delta)) {
+            break;
+        }
+
+        state = settle(index, &pid, key);
+    }
+
+    epoch_retire(index->epochs, &removed);
+    if (delta->depth >= index->chain) {
+        consolidate(index, pid);
+    }
+
+    return 0;
+}
+
+/**
+ * Pages are never written once reachable, so the new value goes in an
+ * update delta of its own, and the old one is retired as on a delete.
+ */
+static int bwtree_update(struct btree* tree, bkey_t key, struct update* update) {
+    struct bwtree* index = tree->index;
+    struct bwpage* delta = new_page(index, BW_UPDATE);
+    delta->record.key = key;
+
+    uint64_t pid;
+    struct bwpage* state;
+    struct info replaced;
+    descend(index, key, 0, &pid, &state);
+
+    while (1) {
+        struct info* found = leaf_find(state, key);
+        if (found == NULL) {
+            free(delta);
+            return 1;
+        }
+
+        replaced = *found;
+        delta->record.info = *update_payload(update, key);
+        stack_delta(delta, state);
+        if (install(index, pid, state, delta)) {
+            break;
+        }
+
+        state = settle(index, &pid, key);
+    }
+
+    update->encrypted = 0;
+    epoch_retire(index->epochs, &replaced);
+    if (delta->depth >= index->chain) {
+        consolidate(index, pid);
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the leaves left to right through their right links. Each leaf is
+ * read as of one state, but writers carry on meanwhile, so the range as a
+ * whole is not a point in time view.
+ */
+static uint64_t bwtree_range(struct btree* tree, bkey_t low, bkey_t high, range_visit visit, void* context) {
+    struct bwtree* index = tree->index;
+    uint64_t pid, count = 0;
+    struct bwpage* state;
+    descend(index, low, 0, &pid, &state);
+
+    while (1) {
+        struct bwview view;
+        build_view(state, &view);
+
+        for (uint32_t i = lower_bound(view.keys, view.num_keys, low); i < view.num_keys; i++) {
+            if (key_less(high, view.keys[i])) {
+                free_view(&view);
+                return count;
+            }
+
+            count += 1;
+            if (visit(view.keys[i], &view.infos[i], context)) {
+                free_view(&view);
+                return count;
+            }
+        }
+
+        free_view(&view);
+        if (!state->bounded || key_less(high, state->high)) {
+            return count;
+        }
+
+        pid = state->right;
+        state = page_state(index, pid);
+    }
+}
+
+static int bwpage_fault(struct btree_fault* fault, enum verify_fault kind, struct bwpage* state, struct bwview* view, int slot) {
+    fault->kind = kind;
+    fault->node = state;
+    fault->depth = state->level;
+    fault->slot = slot;
+    fault->key = view->keys[slot];
+    return 1;
+}
+
+/**
+ * Reads the leaves left to right as ranges do, checking each against the
+ * bounds of its page and the last key of the leaf before it. Writers carry
+ * on meanwhile, but pages only ever hand keys over to their right, so the
+ * leaves read stay in order. Faults name the state of the page read, and
+ * give its level as the depth.
+ */
+static int bwtree_verify(struct btree* tree, struct btree_fault* fault) {
+    struct bwtree* index = tree->index;
+    uint64_t pid = __atomic_load_n(&index->root, __ATOMIC_ACQUIRE);
+    struct bwpage* state = page_state(index, pid);
+
+    // the leftmost link of a page never changes, so it is found in the base
+    while (state->level > 0) {
+        struct bwpage* base = state;
+        while (base->kind != BW_BASE) {
+            base = base->next;
+        }
+
+        pid = base->base.links[0];
+        state = page_state(index, pid);
+    }
+
+    bkey_t previous;
+    int started = 0, result = 0;
+
+    while (!result) {
+        struct bwview view;
+        build_view(state, &view);
+
+        for (uint32_t i = 0; i < view.num_keys && !result; i++) {
+            if (started && !key_less(previous, view.keys[i])) {
+                result = bwpage_fault(fault, VERIFY_ORDER, state, &view, i);
+            } else if (state->bounded && !key_less(view.keys[i], state->high)) {
+                result = bwpage_fault(fault, VERIFY_BOUNDS, state, &view, i);
+            } else if (!payload_intact(view.keys[i], &view.infos[i])) {
+                result = bwpage_fault(fault, VERIFY_MAC, state, &view, i);
+            }
+
+            previous = view.keys[i];
+            started = 1;
+        }
+
+        free_view(&view);
+        if (!state->bounded) {
+            break;
+        }
+
+        pid = state->right;
+        state = page_state(index, pid);
+    }
+
+    return result;
+}
+
+/**
+ * Lists the pages a level at a time, each level left to right through the
+ * right links, in one pass as the number of pages may change meanwhile.
+ */
+static uint64_t bwtree_export(struct btree* tree, struct node** list) {
+    struct bwtree* index = tree->index;
+    uint64_t count = 0, capacity = 16;
+    uint64_t pid = __atomic_load_n(&index->root, __ATOMIC_ACQUIRE);
+    *list = malloc(capacity * sizeof(struct node));
+
+    while (1) {
+        uint64_t below = 0;
+        struct bwpage* state = page_state(index, pid);
+        uint16_t level = state->level;
+
+        for (int first = 1; ; first = 0) {
+            struct bwview view;
+            build_view(state, &view);
+
+            if (count == capacity) {
+                capacity *= 2;
+                *list = realloc(*list, capacity * sizeof(struct node));
+            }
+
+            (*list)[count].num_keys = view.num_keys;
+            (*list)[count].keys = malloc(view.num_keys * sizeof(bkey_t));
+            memcpy((*list)[count].keys, view.keys, view.num_keys * sizeof(bkey_t));
+            count += 1;
+
+            if (first && level > 0) {
+                below = view.links[0];
+            }
+
+            free_view(&view);
+            if (!state->bounded) {
+                break;
+            }
+
+            state = page_state(index, state->right);
+        }
+
+        if (level == 0) {
+            return count;
+        }
+
+        pid = below;
+    }
+}
+
+static void bwtree_destroy(struct btree* tree) {
+    struct bwtree* index = tree->index;
+
+    // chunks are only added for the pages named in them
+    for (uint64_t pid = 0; pid < index->num_pages; pid++) {
+        struct bwpage** chunk = index->chunks[pid >> BWTREE_CHUNK_BITS];
+        if (chunk == NULL) {
+            pid |= (1 << BWTREE_CHUNK_BITS) - 1;
+            continue;
+        }
+
+        struct bwpage* state = chunk[pid & ((1 << BWTREE_CHUNK_BITS) - 1)];
+        if (state == NULL) {
+            continue;
+        }
+
+        // payloads are freed through the one page whose bounds hold them
+        if (state->level == 0) {
+            struct bwview view;
+            build_view(state, &view);
+            for (uint32_t i = 0; i < view.num_keys; i++) {
+                free_info(&view.infos[i]);
+            }
+
+            free_view(&view);
+        }
+
+        free_chain(state);
+    }
+
+    for (int i = 0; i < BWTREE_CHUNKS; i++) {
+        free(index->chunks[i]);
+    }
+
+    pthread_mutex_destroy(&index->free_lock);
+    free(index->free_pids);
+    free(index);
+}
+
+const struct index_ops BWTREE_OPS = {
+    .lookup = bwtree_lookup,
+    .insert = bwtree_insert,
+    .remove = bwtree_remove,
+    .range = bwtree_range,
+    .export = bwtree_export,
+    .destroy = bwtree_destroy,
+    .update = bwtree_update,
+    .verify = bwtree_verify,
+    .lock_free = 1
+};
+
+/**
+ * Pages hold branching - 1 keys like the nodes of the plain tree. Small
+ * pages are consolidated sooner, so their chains stay shorter than them.
+ */
+void bwtree_init(struct btree* tree) {
+    struct bwtree* index = calloc(1, sizeof(struct bwtree));
+    index->max_keys = tree->branching - 1;
+    index->chain = (index->max_keys < BWTREE_CHAIN) ? index->max_keys : BWTREE_CHAIN;
+    index->stats = tree->stats;
+    index->epochs = tree->epochs;
+    pthread_mutex_init(&index->free_lock, NULL);
+
+    struct bwpage* leaf = new_page(index, BW_BASE);
+    leaf->level = 0;
+    leaf->depth = 0;
+    leaf->next = NULL;
+    leaf->bounded = 0;
+    leaf->base.num_keys = 0;
+    leaf->base.keys = malloc(sizeof(bkey_t));
+    leaf->base.infos = malloc(sizeof(struct info));
+    leaf->base.links = NULL;
+
+    index->root = new_pid(index, leaf);
+    tree->index = index;
+}
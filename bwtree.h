@@ -0,0 +1,106 @@
+#ifndef BWTREE_H
+#define BWTREE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "btreestore.h"
+#include "btree.h"
+
+// deltas a page may gather before it is consolidated into a new base
+#define BWTREE_CHAIN (8)
+
+// the mapping table grows a chunk of pages at a time, up to 2^28 pages
+#define BWTREE_CHUNK_BITS (16)
+#define BWTREE_CHUNKS (4096)
+#define BWTREE_MAX_PAGES ((uint64_t) BWTREE_CHUNKS << BWTREE_CHUNK_BITS)
+
+// names no page, for when the mapping table is full
+#define BWTREE_NO_PAGE (UINT64_MAX)
+
+enum bwkind {
+    BW_BASE = 0,
+    BW_INSERT,
+    BW_DELETE,
+    BW_UPDATE,
+    BW_SPLIT,
+    BW_SEPARATOR
+};
+
+/**
+ * One state of a page. A page is a chain of deltas ending in a base, and is
+ * changed by swinging its entry in the mapping table from the state it was
+ * read at to a new delta on top of it. Nothing reachable from the table is
+ * written again, so readers walk pages without locking. Every state carries
+ * the bounds of the page: keys from high up belong to the page right of it,
+ * as in a B-link tree.
+ */
+struct bwpage {
+    uint8_t kind;
+    uint8_t bounded;
+    uint16_t level;
+    uint32_t depth;
+    struct bwpage* next;
+
+    bkey_t high;
+    uint64_t right;
+
+    union {
+        // BW_INSERT, BW_DELETE and BW_UPDATE
+        struct {
+            bkey_t key;
+            struct info info;
+        } record;
+
+        // BW_SPLIT hands the keys from key up to the page at link, and
+        // BW_SEPARATOR sends keys from key up to high down to it
+        struct {
+            bkey_t key;
+            int bounded;
+            bkey_t high;
+            uint64_t link;
+        } entry;
+
+        // leaves hold infos, internal pages one more link than keys
+        struct {
+            uint32_t num_keys;
+            bkey_t* keys;
+            struct info* infos;
+            uint64_t* links;
+        } base;
+    };
+};
+
+/**
+ * Pages are named by their index in the mapping table, so a page is replaced
+ * by one compare and swap however many links lead to it. Pages split but
+ * never merge, so only the identifiers of pages which were never published,
+ * as when a split loses its race, are reused.
+ */
+struct bwtree {
+    uint64_t root;
+    uint64_t num_pages;
+    struct bwpage** chunks[BWTREE_CHUNKS];
+
+    // identifiers handed back, which are named again before any new one
+    pthread_mutex_t free_lock;
+    uint64_t* free_pids;
+    uint64_t num_free;
+    uint64_t free_capacity;
+
+    uint32_t max_keys;
+    uint32_t chain;
+    struct btree_stats* stats;
+    struct epochs* epochs;
+};
+
+// INDEX
+
+extern const struct index_ops BWTREE_OPS;
+
+void bwtree_init(struct btree* tree);
+
+#endif
@@ -0,0 +1,192 @@
+#include "compress.h"
+
+// HELPER FUNCTIONS
+
+static uint32_t read_sequence(const uint8_t* source) {
+    uint32_t sequence;
+    memcpy(&sequence, source, sizeof(uint32_t));
+    return sequence;
+}
+
+static uint32_t hash_sequence(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+
+/**
+ * Writes the part of a length which does not fit in its token, as bytes of
+ * 255 ended by one below 255. Returns NULL if it would pass end.
+ */
+static uint8_t* put_length(uint8_t* target, uint8_t* end, uint32_t length) {
+    for (; length >= 255; length -= 255) {
+        if (target >= end) {
+            return NULL;
+        }
+
+        *target++ = 255;
+    }
+
+    if (target >= end) {
+        return NULL;
+    }
+
+    *target++ = length;
+    return target;
+}
+
+/**
+ * Reads a length written by put_length onto length, returning 1 if the
+ * input ends first.
+ */
+static int get_length(const uint8_t** source, const uint8_t* end, uint32_t* length) {
+    uint8_t byte = 255;
+    while (byte == 255) {
+        if (*source >= end) {
+            return 1;
+        }
+
+        byte = *(*source)++;
+        *length += byte;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes one sequence: a token holding both lengths, the literals, then the
+ * offset back to the match. The last sequence of a block has literals only,
+ * given by a match of 0. Returns NULL if it would pass end.
+ */
+static uint8_t* put_sequence(uint8_t* target, uint8_t* end, const uint8_t* literals, uint32_t num_literals, uint32_t offset, uint32_t match) {
+    if (target >= end) {
+        return NULL;
+    }
+
+    uint32_t extra = match ? match - COMPRESS_MIN_MATCH : 0;
+    *target++ = (num_literals < 15 ? num_literals : 15) << 4 | (extra < 15 ? extra : 15);
+
+    if (num_literals >= 15 && (target = put_length(target, end, num_literals - 15)) == NULL) {
+        return NULL;
+    }
+
+    if (end - target < num_literals) {
+        return NULL;
+    }
+
+    memcpy(target, literals, num_literals);
+    target += num_literals;
+
+    if (match == 0) {
+        return target;
+    } else if (end - target < 2) {
+        return NULL;
+    }
+
+    *target++ = offset & 0xFF;
+    *target++ = offset >> 8;
+    return extra >= 15 ? put_length(target, end, extra - 15) : target;
+}
+
+// BLOCKS
+
+/**
+ * Compresses size bytes of input into output in the format of an LZ4 block:
+ * runs of literals, each followed by a copy of earlier output. Matches are
+ * found by a single probe of a hash table, so compression is one pass with
+ * no allocation. Returns the compressed size, or 0 if it would not fit in
+ * capacity bytes.
+ */
+uint32_t lz_compress(const void* input, uint32_t size, void* output, uint32_t capacity) {
+    const uint8_t* source = input;
+    uint8_t* target = output;
+    uint8_t* end = target + capacity;
+
+    uint32_t table[1 << COMPRESS_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    uint32_t anchor = 0;
+    uint32_t position = 0;
+    while (size >= COMPRESS_MIN_MATCH && position <= size - COMPRESS_MIN_MATCH) {
+        uint32_t sequence = read_sequence(source + position);
+        uint32_t hash = hash_sequence(sequence);
+        uint32_t candidate = table[hash];
+        table[hash] = position;
+
+        if (candidate >= position || position - candidate > COMPRESS_WINDOW
+                || read_sequence(source + candidate) != sequence) {
+            position += 1;
+            continue;
+        }
+
+        uint32_t match = COMPRESS_MIN_MATCH;
+        while (position + match < size && source[candidate + match] == source[position + match]) {
+            match += 1;
+        }
+
+        target = put_sequence(target, end, source + anchor, position - anchor, position - candidate, match);
+        if (target == NULL) {
+            return 0;
+        }
+
+        position += match;
+        anchor = position;
+    }
+
+    target = put_sequence(target, end, source + anchor, size - anchor, 0, 0);
+    return target ? target - (uint8_t*) output : 0;
+}
+
+/**
+ * Decompresses a block made by lz_compress into exactly original bytes of
+ * output. Returns 1 if the block is malformed or of another size, without
+ * ever reading or writing past either buffer.
+ */
+int lz_decompress(const void* input, uint32_t size, void* output, uint32_t original) {
+    const uint8_t* source = input;
+    const uint8_t* end = source + size;
+    uint8_t* target = output;
+    uint32_t written = 0;
+
+    while (source < end) {
+        uint8_t token = *source++;
+
+        uint32_t num_literals = token >> 4;
+        if (num_literals == 15 && get_length(&source, end, &num_literals)) {
+            return 1;
+        } else if (num_literals > end - source || num_literals > original - written) {
+            return 1;
+        }
+
+        memcpy(target + written, source, num_literals);
+        source += num_literals;
+        written += num_literals;
+
+        // the last sequence ends the block after its literals
+        if (source == end) {
+            break;
+        } else if (end - source < 2) {
+            return 1;
+        }
+
+        uint32_t offset = source[0] | (uint32_t) source[1] << 8;
+        source += 2;
+
+        uint32_t match = token & 15;
+        if (match == 15 && get_length(&source, end, &match)) {
+            return 1;
+        }
+
+        match += COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > written || match > original - written) {
+            return 1;
+        }
+
+        // a match may overlap the bytes it writes, repeating a short run
+        for (uint32_t i = 0; i < match; i++) {
+            target[written + i] = target[written - offset + i];
+        }
+
+        written += match;
+    }
+
+    return written != original;
+}
@@ -0,0 +1,24 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <string.h>
+
+// matches are found through a table of this many bits of hash over the four
+// bytes at each position, kept on the stack while compressing
+#define COMPRESS_HASH_BITS (12)
+
+// matches are at least this long and at most this far back
+#define COMPRESS_MIN_MATCH (4)
+#define COMPRESS_WINDOW (65535)
+
+// values shorter than this are stored as they are
+#define COMPRESS_MIN_SIZE (32)
+
+// BLOCKS
+
+uint32_t lz_compress(const void* input, uint32_t size, void* output, uint32_t capacity);
+
+int lz_decompress(const void* input, uint32_t size, void* output, uint32_t original);
+
+#endif
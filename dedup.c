@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+#include "payload.h"
+
+// HELPER FUNCTIONS
+
+static struct shared_payload* shared_of(void* data) {
+    return (struct shared_payload*) ((uint8_t*) data - offsetof(struct shared_payload, data));
+}
+
+static uint64_t hash_blocks(const uint64_t* blocks, uint32_t size) {
+    uint64_t hash = size * 0x9E3779B97F4A7C15UL;
+    for (uint32_t i = 0; i < size / 8; i++) {
+        hash = (hash ^ blocks[i]) * 0x9E3779B97F4A7C15UL;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+/**
+ * Doubles the buckets of a stripe once it holds as many buffers as it has
+ * buckets, so chains stay short.
+ */
+static void grow_stripe(struct dedup_stripe* stripe) {
+    uint64_t num_buckets = stripe->num_buckets ? stripe->num_buckets * 2 : 64;
+    struct shared_payload** buckets = calloc(num_buckets, sizeof(struct shared_payload*));
+
+    for (uint64_t i = 0; i < stripe->num_buckets; i++) {
+        struct shared_payload* shared = stripe->buckets[i];
+        while (shared) {
+            struct shared_payload* next = shared->next;
+            uint64_t bucket = shared->hash & (num_buckets - 1);
+            shared->next = buckets[bucket];
+            buckets[bucket] = shared;
+            shared = next;
+        }
+    }
+
+    free(stripe->buckets);
+    stripe->buckets = buckets;
+    stripe->num_buckets = num_buckets;
+}
+
+// TABLE
+
+struct dedup* dedup_create() {
+    struct dedup* dedup = calloc(1, sizeof(struct dedup));
+    for (int i = 0; i < DEDUP_STRIPES; i++) {
+        pthread_mutex_init(&dedup->stripes[i].lock, NULL);
+    }
+
+    return dedup;
+}
+
+/**
+ * Frees the table, once every value pointing into it has been released.
+ */
+void dedup_destroy(struct dedup* dedup) {
+    for (int i = 0; i < DEDUP_STRIPES; i++) {
+        pthread_mutex_destroy(&dedup->stripes[i].lock);
+        free(dedup->stripes[i].buckets);
+    }
+
+    free(dedup);
+}
+
+/**
+ * Points a value which was just encrypted at an identical buffer already in
+ * the table, releasing its own, or else adds its buffer to the table. The
+ * bytes are compared in full, so a hash collision never shares a buffer.
+ * Only values given a shared buffer, with INFO_SHARED, are interned.
+ */
+void dedup_intern(struct dedup* dedup, struct info* info) {
+    if (dedup == NULL || !(info->flags & INFO_SHARED)) {
+        return;
+    }
+
+    struct shared_payload* own = shared_of(info->data);
+    own->hash = hash_blocks(own->data, own->size);
+
+    struct dedup_stripe* stripe = &dedup->stripes[own->hash >> 60 & (DEDUP_STRIPES - 1)];
+    pthread_mutex_lock(&stripe->lock);
+
+    if (stripe->num_buckets > 0) {
+        struct shared_payload* shared = stripe->buckets[own->hash & (stripe->num_buckets - 1)];
+        for (; shared; shared = shared->next) {
+            if (shared->hash == own->hash && shared->size == own->size
+                    && memcmp(shared->data, own->data, own->size) == 0) {
+                __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&stripe->lock);
+
+                info->data = shared->data;
+                free(own);
+                return;
+            }
+        }
+    }
+
+    if (stripe->count >= stripe->num_buckets) {
+        grow_stripe(stripe);
+    }
+
+    uint64_t bucket = own->hash & (stripe->num_buckets - 1);
+    own->stripe = stripe;
+    own->next = stripe->buckets[bucket];
+    stripe->buckets[bucket] = own;
+    stripe->count += 1;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+// BUFFERS
+
+/**
+ * A buffer for size bytes of ciphertext, held by one value until interned.
+ */
+void* shared_alloc(uint32_t size) {
+    struct shared_payload* shared = malloc(sizeof(struct shared_payload) + size);
+    shared->next = NULL;
+    shared->stripe = NULL;
+    shared->hash = 0;
+    shared->refs = 1;
+    shared->size = size;
+    return shared->data;
+}
+
+/**
+ * Drops a value's reference to its buffer, freeing the buffer with the
+ * last one.
+ */
+void shared_release(void* data) {
+    struct shared_payload* shared = shared_of(data);
+    struct dedup_stripe* stripe = shared->stripe;
+    if (stripe == NULL) {
+        free(shared);
+        return;
+    }
+
+    pthread_mutex_lock(&stripe->lock);
+    if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_unlock(&stripe->lock);
+        return;
+    }
+
+    struct shared_payload** link = &stripe->buckets[shared->hash & (stripe->num_buckets - 1)];
+    while (*link != shared) {
+        link = &(*link)->next;
+    }
+
+    *link = shared->next;
+    stripe->count -= 1;
+    pthread_mutex_unlock(&stripe->lock);
+    free(shared);
+}
+
+/**
+ * Number of values sharing the buffer, changing under any reader which does
+ * not hold every value's store locked.
+ */
+uint64_t shared_refs(void* data) {
+    return __atomic_load_n(&shared_of(data)->refs, __ATOMIC_RELAXED);
+}
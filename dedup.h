@@ -0,0 +1,60 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "btreestore.h"
+
+// the table is split by hash into this many stripes, each locked on its own
+#define DEDUP_STRIPES (16)
+
+struct dedup_stripe;
+
+/**
+ * A flat ciphertext buffer which any number of values may point at. Values
+ * point at data, so readers never see the header. Until it is interned the
+ * buffer belongs to one value and has no stripe.
+ */
+struct shared_payload {
+    struct shared_payload* next;
+    struct dedup_stripe* stripe;
+    uint64_t hash;
+    uint64_t refs;
+    uint32_t size;
+    uint64_t data[];
+};
+
+struct dedup_stripe {
+    pthread_mutex_t lock;
+    struct shared_payload** buckets;
+    uint64_t num_buckets;
+    uint64_t count;
+};
+
+/**
+ * Ciphertext buffers of a store by content, shared by every value which
+ * encrypts to the same bytes.
+ */
+struct dedup {
+    struct dedup_stripe stripes[DEDUP_STRIPES];
+};
+
+// TABLE
+
+struct dedup* dedup_create();
+
+void dedup_destroy(struct dedup* dedup);
+
+void dedup_intern(struct dedup* dedup, struct info* info);
+
+// BUFFERS
+
+void* shared_alloc(uint32_t size);
+
+void shared_release(void* data);
+
+uint64_t shared_refs(void* data);
+
+#endif
@@ -0,0 +1,360 @@
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "payload.h"
+
+// identifies stores in the thread cache, as in trace.c
+static uint64_t next_epochs_id = 1;
+
+static __thread struct {
+    uint64_t id;
+    struct epoch_record* record;
+} cached_record;
+
+// a record claimed by a thread, handed back when the thread exits
+struct epoch_claim {
+    struct epoch_claim* next;
+    struct epoch_record* record;
+};
+
+// the calling thread's claims, whose address also identifies the thread
+static __thread struct epoch_claim* claims;
+
+// held while claims are added or handed back, and while a store's records
+// are torn down, so an exiting thread never touches a destroyed record
+static pthread_mutex_t claims_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t claims_once = PTHREAD_ONCE_INIT;
+static pthread_key_t claims_key;
+
+static int reclaim(struct epochs* epochs, struct epoch_record* self, uint64_t* epoch);
+
+// HELPER FUNCTIONS
+
+/**
+ * Hands back the records of an exiting thread, freeing what it retired that
+ * can no longer be read. The rest stays in the record's limbo for the thread
+ * which claims it next.
+ */
+static void release_claims(void* head) {
+    pthread_mutex_lock(&claims_lock);
+    struct epoch_claim* claim = head;
+    while (claim) {
+        struct epoch_claim* next = claim->next;
+        struct epoch_record* record = claim->record;
+
+        if (record) {
+            // a thread which has exited reads nothing, pinned or not
+            record->nesting = 0;
+            __atomic_store_n(&record->active, 0, __ATOMIC_SEQ_CST);
+
+            uint64_t epoch;
+            reclaim(record->epochs, record, &epoch);
+            record->claim = NULL;
+            __atomic_store_n(&record->owner, NULL, __ATOMIC_RELEASE);
+        }
+
+        free(claim);
+        claim = next;
+    }
+
+    claims = NULL;
+    pthread_mutex_unlock(&claims_lock);
+}
+
+static void create_claims_key() {
+    pthread_key_create(&claims_key, release_claims);
+}
+
+/**
+ * Claims a record for the calling thread, the first free one from vacant on
+ * if there is one, or else a new one.
+ */
+static struct epoch_record* claim_record(struct epochs* epochs, struct epoch_record* vacant) {
+    void* self = &claims;
+    struct epoch_record* record = vacant;
+    while (record) {
+        void* free_owner = NULL;
+        if (__atomic_compare_exchange_n(&record->owner, &free_owner, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+
+        record = record->next;
+    }
+
+    if (record == NULL) {
+        record = calloc(1, sizeof(struct epoch_record));
+        record->epochs = epochs;
+        record->owner = self;
+
+        pthread_mutex_lock(&epochs->lock);
+        record->next = epochs->records;
+        __atomic_store_n(&epochs->records, record, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&epochs->lock);
+    }
+
+    pthread_once(&claims_once, create_claims_key);
+    pthread_mutex_lock(&claims_lock);
+
+    // drop claims on the records of stores since destroyed
+    struct epoch_claim** link = &claims;
+    while (*link) {
+        struct epoch_claim* claim = *link;
+        if (claim->record == NULL) {
+            *link = claim->next;
+            free(claim);
+        } else {
+            link = &claim->next;
+        }
+    }
+
+    struct epoch_claim* claim = malloc(sizeof(struct epoch_claim));
+    claim->record = record;
+    claim->next = claims;
+    claims = claim;
+    record->claim = claim;
+
+    pthread_mutex_unlock(&claims_lock);
+    pthread_setspecific(claims_key, claims);
+    return record;
+}
+
+/**
+ * The calling thread's record, which is claimed the first time the thread
+ * pins the store. Records are only ever pushed onto the front of the list, so
+ * it can be walked without the lock.
+ */
+static struct epoch_record* thread_record(struct epochs* epochs) {
+    if (cached_record.id == epochs->id) {
+        return cached_record.record;
+    }
+
+    void* self = &claims;
+    struct epoch_record* vacant = NULL;
+    struct epoch_record* record = __atomic_load_n(&epochs->records, __ATOMIC_ACQUIRE);
+    while (record) {
+        void* owner = __atomic_load_n(&record->owner, __ATOMIC_RELAXED);
+        if (owner == self) {
+            break;
+        } else if (owner == NULL && vacant == NULL) {
+            vacant = record;
+        }
+
+        record = record->next;
+    }
+
+    if (record == NULL) {
+        record = claim_record(epochs, vacant);
+    }
+
+    cached_record.id = epochs->id;
+    cached_record.record = record;
+    return record;
+}
+
+static void release(struct retiree* retiree) {
+    if (retiree->release) {
+        retiree->release(retiree->pointer);
+    } else {
+        free_info(&retiree->info);
+    }
+}
+
+static void flush_limbo(struct limbo* limbo) {
+    for (uint64_t i = 0; i < limbo->count; i++) {
+        release(&limbo->retirees[i]);
+    }
+
+    limbo->count = 0;
+}
+
+static void push_limbo(struct limbo* limbo, struct retiree* retiree) {
+    if (limbo->count == limbo->capacity) {
+        limbo->capacity = limbo->capacity ? limbo->capacity * 2 : 16;
+        limbo->retirees = realloc(limbo->retirees, limbo->capacity * sizeof(struct retiree));
+    }
+
+    limbo->retirees[limbo->count++] = *retiree;
+}
+
+// PINNING
+
+struct epochs* epochs_create() {
+    struct epochs* epochs = calloc(1, sizeof(struct epochs));
+    epochs->id = __atomic_fetch_add(&next_epochs_id, 1, __ATOMIC_RELAXED);
+    epochs->global = 1;
+    pthread_mutex_init(&epochs->lock, NULL);
+    return epochs;
+}
+
+void epochs_destroy(struct epochs* epochs) {
+    // threads still running let go of their claims on the records
+    pthread_mutex_lock(&claims_lock);
+    for (struct epoch_record* record = epochs->records; record; record = record->next) {
+        if (record->claim) {
+            record->claim->record = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&claims_lock);
+
+    struct epoch_record* record = epochs->records;
+    while (record) {
+        struct epoch_record* next = record->next;
+        for (int i = 0; i < 3; i++) {
+            flush_limbo(&record->limbo[i]);
+            free(record->limbo[i].retirees);
+        }
+
+        free(record);
+        record = next;
+    }
+
+    pthread_mutex_destroy(&epochs->lock);
+    free(epochs);
+}
+
+/**
+ * Pins are nested, and only the outermost records the epoch. Costs a lookup
+ * of the thread's record and a store to it, no shared writes.
+ */
+void epoch_pin(struct epochs* epochs) {
+    if (epochs == NULL) {
+        return;
+    }
+
+    struct epoch_record* record = thread_record(epochs);
+    if (record->nesting++ > 0) {
+        return;
+    }
+
+    __atomic_store_n(&record->epoch, __atomic_load_n(&epochs->global, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_store_n(&record->active, 1, __ATOMIC_SEQ_CST);
+
+    // nothing the thread reads from here on may be read before the pin shows
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_unpin(struct epochs* epochs) {
+    if (epochs == NULL) {
+        return;
+    }
+
+    struct epoch_record* record = thread_record(epochs);
+    if (--record->nesting == 0) {
+        __atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+    }
+}
+
+int epoch_pinned(struct epochs* epochs) {
+    return epochs != NULL && thread_record(epochs)->nesting > 0;
+}
+
+/**
+ * Whether no thread but the caller is pinned.
+ */
+int epoch_quiet(struct epochs* epochs) {
+    if (epochs == NULL) {
+        return 1;
+    }
+
+    struct epoch_record* self = thread_record(epochs);
+    for (struct epoch_record* record = __atomic_load_n(&epochs->records, __ATOMIC_ACQUIRE); record; record = record->next) {
+        if (record != self && __atomic_load_n(&record->active, __ATOMIC_SEQ_CST)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// RECLAIMING
+
+/**
+ * Frees what the record retired that no pinned thread can still hold. With no
+ * thread pinned that is all of it, and returns 0. Otherwise the epoch moves
+ * on if no pinned thread lags behind it, what was retired two epochs back is
+ * freed, and returns 1 with the epoch anything retired now belongs to.
+ */
+static int reclaim(struct epochs* epochs, struct epoch_record* self, uint64_t* epoch) {
+    uint64_t global = __atomic_load_n(&epochs->global, __ATOMIC_SEQ_CST);
+    int pinned = 0, lagging = 0;
+
+    for (struct epoch_record* record = __atomic_load_n(&epochs->records, __ATOMIC_ACQUIRE); record; record = record->next) {
+        if (__atomic_load_n(&record->active, __ATOMIC_SEQ_CST)) {
+            pinned = 1;
+            lagging |= __atomic_load_n(&record->epoch, __ATOMIC_RELAXED) != global;
+        }
+    }
+
+    if (!pinned) {
+        for (int i = 0; i < 3; i++) {
+            flush_limbo(&self->limbo[i]);
+        }
+
+        return 0;
+    }
+
+    // every pinned thread has seen this epoch, so none can hold anything
+    // retired two epochs ago
+    if (!lagging) {
+        __atomic_compare_exchange_n(&epochs->global, &global, global + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        global = __atomic_load_n(&epochs->global, __ATOMIC_SEQ_CST);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (self->limbo[i].count > 0 && self->limbo[i].epoch + 2 <= global) {
+            flush_limbo(&self->limbo[i]);
+        }
+    }
+
+    *epoch = global;
+    return 1;
+}
+
+/**
+ * Each thread keeps what it retires in its own record, so writers retire
+ * concurrently without the store held exclusively. With no thread pinned
+ * nothing retired can still be read, and the thread frees its limbo at once.
+ * Otherwise the thread frees what it retired two epochs back.
+ */
+static void retire(struct epochs* epochs, struct retiree* retiree) {
+    struct epoch_record* self = thread_record(epochs);
+    uint64_t global;
+
+    if (!reclaim(epochs, self, &global)) {
+        release(retiree);
+        return;
+    }
+
+    struct limbo* limbo = &self->limbo[global % 3];
+    limbo->epoch = global;
+    push_limbo(limbo, retiree);
+}
+
+/**
+ * Frees a payload taken out of the index once no pinned reader can hold it.
+ * Values held inline went with the record, so there is nothing to wait on.
+ */
+void epoch_retire(struct epochs* epochs, struct info* info) {
+    if (epochs == NULL || (info->flags & INFO_INLINE)) {
+        free_info(info);
+        return;
+    }
+
+    struct retiree retiree = { .release = NULL, .pointer = NULL, .info = *info };
+    retire(epochs, &retiree);
+}
+
+/**
+ * Calls release on pointer once no pinned reader can hold it, for indexes
+ * whose readers walk nodes without locking.
+ */
+void epoch_defer(struct epochs* epochs, void* pointer, void (*release)(void* pointer)) {
+    if (epochs == NULL) {
+        release(pointer);
+        return;
+    }
+
+    struct retiree retiree = { .release = release, .pointer = pointer };
+    retire(epochs, &retiree);
+}
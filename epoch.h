@@ -0,0 +1,79 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "btreestore.h"
+
+// a payload, or anything else released through its own function
+struct retiree {
+    void (*release)(void* pointer);
+    void* pointer;
+    struct info info;
+};
+
+// retired by one thread in one epoch
+struct limbo {
+    struct retiree* retirees;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t epoch;
+};
+
+struct epochs;
+struct epoch_claim;
+
+/**
+ * A thread's pin on a store. Only the owning thread changes the nesting and
+ * its limbo, and other threads read whether it is active and at which epoch.
+ * A thread hands its record back when it exits, and the next thread to claim
+ * it takes over whatever is left in its limbo.
+ */
+struct epoch_record {
+    struct epoch_record* next;
+    struct epochs* epochs;
+
+    // the owning thread's token, NULL while the record is free to claim
+    void* owner;
+    struct epoch_claim* claim;
+
+    uint64_t epoch;
+    uint32_t active;
+    uint32_t nesting;
+
+    struct limbo limbo[3];
+};
+
+/**
+ * Deferred freeing of payloads which pinned readers may still hold. A payload
+ * retired in epoch e is freed once the epoch reaches e + 2, which it only can
+ * after every thread pinned at e or earlier has unpinned.
+ */
+struct epochs {
+    uint64_t id;
+    uint64_t global;
+
+    // held while a thread adds its record, records are never removed but
+    // are claimed again once their thread exits
+    pthread_mutex_t lock;
+    struct epoch_record* records;
+};
+
+struct epochs* epochs_create();
+
+void epochs_destroy(struct epochs* epochs);
+
+void epoch_pin(struct epochs* epochs);
+
+void epoch_unpin(struct epochs* epochs);
+
+int epoch_pinned(struct epochs* epochs);
+
+int epoch_quiet(struct epochs* epochs);
+
+void epoch_retire(struct epochs* epochs, struct info* info);
+
+void epoch_defer(struct epochs* epochs, void* pointer, void (*release)(void* pointer));
+
+#endif
@@ -0,0 +1,346 @@
+#include "partition.h"
+#include "arena.h"
+
+/**
+ * The records of one partition within a range, a batch at a time. Batches
+ * after the first resume from the last key handed over.
+ */
+struct cursor {
+    struct btree* tree;
+    bkey_t keys[PARTITION_BATCH];
+    struct info infos[PARTITION_BATCH];
+    uint32_t count;
+    uint32_t position;
+    int exhausted;
+
+    int resumed;
+    bkey_t last;
+};
+
+// stops a range over one partition when the visit asks to
+struct ordered {
+    range_visit visit;
+    void* context;
+    int stopped;
+};
+
+// HELPER FUNCTIONS
+
+/**
+ * Hash partitions take keys by their hash. Range partitions take keys by
+ * where they fall in the span, keys outside it going to the partition at the
+ * nearer end, so the partitions keep the order of the keys.
+ */
+static uint32_t route(struct partitions* partitions, bkey_t key) {
+    if (partitions->scheme == PARTITION_HASH) {
+        return ((unsigned __int128) key_hash(key) * partitions->count) >> 64;
+    }
+
+    uint64_t position = key_position(key);
+    position = (position < partitions->low) ? 0 : position - partitions->low;
+    if (position > partitions->span) {
+        position = partitions->span;
+    }
+
+    return ((unsigned __int128) position * partitions->count) / ((unsigned __int128) partitions->span + 1);
+}
+
+static int visit_ordered(bkey_t key, struct info* info, void* context) {
+    struct ordered* ordered = context;
+    ordered->stopped = ordered->visit(key, info, ordered->context);
+    return ordered->stopped;
+}
+
+static int collect(bkey_t key, struct info* info, void* context) {
+    struct cursor* cursor = context;
+    if (cursor->resumed && key_equal(key, cursor->last)) {
+        return 0;
+    }
+
+    cursor->keys[cursor->count] = key;
+    cursor->infos[cursor->count] = *info;
+    cursor->count += 1;
+    return cursor->count == PARTITION_BATCH;
+}
+
+static void refill(struct cursor* cursor, bkey_t low, bkey_t high) {
+    struct btree* tree = cursor->tree;
+    cursor->count = 0;
+    cursor->position = 0;
+
+    store_lock_exclusive(tree);
+    tree->ops->range(tree, cursor->resumed ? cursor->last : low, high, collect, cursor);
+    store_unlock(tree);
+
+    cursor->exhausted = cursor->count < PARTITION_BATCH;
+    if (cursor->count > 0) {
+        cursor->resumed = 1;
+        cursor->last = cursor->keys[cursor->count - 1];
+    }
+}
+
+/**
+ * Range partitions hold disjoint, ordered spans of keys, so the range is
+ * read from each partition it spans in turn.
+ */
+static uint64_t range_ordered(struct partitions* partitions, bkey_t low, bkey_t high, range_visit visit, void* context) {
+    struct ordered ordered = { visit, context, 0 };
+    uint32_t last = route(partitions, high);
+    uint64_t count = 0;
+
+    for (uint32_t i = route(partitions, low); i <= last && !ordered.stopped; i++) {
+        struct btree* tree = partitions->trees[i];
+        store_lock_exclusive(tree);
+        count += tree->ops->range(tree, low, high, visit_ordered, &ordered);
+        store_unlock(tree);
+    }
+
+    return count;
+}
+
+/**
+ * Hash partitions each hold keys from all over, so the range merges a cursor
+ * on every partition. Each partition is only locked while a batch is copied
+ * out of it, and writers carry on in between, so the range as a whole is not
+ * a point in time view.
+ */
+static uint64_t range_merged(struct partitions* partitions, bkey_t low, bkey_t high, range_visit visit, void* context) {
+    struct cursor* cursors = malloc(partitions->count * sizeof(struct cursor));
+    for (uint32_t i = 0; i < partitions->count; i++) {
+        cursors[i].tree = partitions->trees[i];
+        cursors[i].resumed = 0;
+        refill(&cursors[i], low, high);
+    }
+
+    uint64_t count = 0;
+    while (1) {
+        struct cursor* next = NULL;
+        for (uint32_t i = 0; i < partitions->count; i++) {
+            struct cursor* cursor = &cursors[i];
+            if (cursor->position == cursor->count && !cursor->exhausted) {
+                refill(cursor, low, high);
+            }
+
+            if (cursor->position < cursor->count && (next == NULL
+                    || key_less(cursor->keys[cursor->position], next->keys[next->position]))) {
+                next = cursor;
+            }
+        }
+
+        if (next == NULL) {
+            break;
+        }
+
+        count += 1;
+        if (visit(next->keys[next->position], &next->infos[next->position], context)) {
+            break;
+        }
+
+        next->position += 1;
+    }
+
+    free(cursors);
+    return count;
+}
+
+// INDEX OPERATIONS
+
+/**
+ * The partition is unlocked before the caller reads the record, so the record
+ * is copied out under its lock into the caller's copy. The store pins the
+ * caller, so the payload the copy points at outlives a concurrent delete.
+ */
+static struct info* partition_lookup(struct btree* tree, bkey_t key, struct info* copy) {
+    struct partitions* partitions = tree->index;
+    struct btree* partition = partitions->trees[route(partitions, key)];
+
+    store_lock_shared(partition);
+    struct info* stored = partition->ops->lookup(partition, key, copy);
+    if (stored && stored != copy) {
+        *copy = *stored;
+    }
+
+    store_unlock(partition);
+    return stored ? copy : NULL;
+}
+
+static int partition_insert(struct btree* tree, bkey_t key, struct info* info) {
+    struct partitions* partitions = tree->index;
+    struct btree* partition = partitions->trees[route(partitions, key)];
+
+    store_lock_exclusive(partition);
+    int result = partition->ops->insert(partition, key, info);
+    __atomic_add_fetch(&partition->num_nodes, result == 0, __ATOMIC_RELAXED);
+    store_unlock(partition);
+    return result;
+}
+
+static int partition_remove(struct btree* tree, bkey_t key) {
+    struct partitions* partitions = tree->index;
+    struct btree* partition = partitions->trees[route(partitions, key)];
+
+    store_lock_exclusive(partition);
+    int result = partition->ops->remove(partition, key);
+    __atomic_sub_fetch(&partition->num_nodes, result == 0, __ATOMIC_RELAXED);
+    store_unlock(partition);
+    return result;
+}
+
+static uint64_t partition_range(struct btree* tree, bkey_t low, bkey_t high, range_visit visit, void* context) {
+    struct partitions* partitions = tree->index;
+    if (partitions->scheme == PARTITION_RANGE) {
+        return range_ordered(partitions, low, high, visit, context);
+    } else {
+        return range_merged(partitions, low, high, visit, context);
+    }
+}
+
+/**
+ * Lists the nodes of each partition in turn.
+ */
+static uint64_t partition_export(struct btree* tree, struct node** list) {
+    struct partitions* partitions = tree->index;
+    uint64_t count = 0;
+    *list = NULL;
+
+    for (uint32_t i = 0; i < partitions->count; i++) {
+        struct node* nodes;
+        uint64_t listed = store_listing(partitions->trees[i], &nodes);
+
+        *list = realloc(*list, (count + listed) * sizeof(struct node));
+        memcpy(*list + count, nodes, listed * sizeof(struct node));
+        count += listed;
+        free(nodes);
+    }
+
+    return count;
+}
+
+static int partition_update(struct btree* tree, bkey_t key, struct update* update) {
+    struct partitions* partitions = tree->index;
+    return store_update(partitions->trees[route(partitions, key)], key, update);
+}
+
+/**
+ * Rekeys each partition in turn, under its own lock. Every partition is of
+ * the same mode, so either all of them can be rekeyed or none can.
+ */
+static int partition_rekey(struct btree* tree, struct rekey* rekey) {
+    struct partitions* partitions = tree->index;
+    int result = 0;
+
+    for (uint32_t i = 0; i < partitions->count && result == 0; i++) {
+        result = store_rekey(partitions->trees[i], rekey);
+    }
+
+    return result;
+}
+
+/**
+ * Checks each partition in turn under its own lock, stopping at the first
+ * fault.
+ */
+static int partition_verify(struct btree* tree, struct btree_fault* fault) {
+    struct partitions* partitions = tree->index;
+    int result = 0;
+
+    for (uint32_t i = 0; i < partitions->count && result == 0; i++) {
+        struct btree* partition = partitions->trees[i];
+        store_lock_shared(partition);
+        result = partition->ops->verify(partition, fault);
+        store_unlock(partition);
+    }
+
+    return result;
+}
+
+static void partition_shape(struct btree* tree, struct shape_walk* walk) {
+    struct partitions* partitions = tree->index;
+
+    for (uint32_t i = 0; i < partitions->count; i++) {
+        struct btree* partition = partitions->trees[i];
+        if (partition->ops->shape) {
+            store_lock_shared(partition);
+            partition->ops->shape(partition, walk);
+            store_unlock(partition);
+        }
+    }
+}
+
+static void partition_destroy(struct btree* tree) {
+    struct partitions* partitions = tree->index;
+
+    for (uint32_t i = 0; i < partitions->count; i++) {
+        struct btree* partition = partitions->trees[i];
+        partition->ops->destroy(partition);
+        pthread_rwlock_destroy(&partition->lock);
+        if (partition->arena) {
+            arena_destroy(partition->arena);
+        }
+
+        free(partition);
+    }
+
+    free(partitions->trees);
+    free(partitions);
+}
+
+const struct index_ops PARTITION_OPS = {
+    .lookup = partition_lookup,
+    .insert = partition_insert,
+    .remove = partition_remove,
+    .range = partition_range,
+    .export = partition_export,
+    .destroy = partition_destroy,
+    .shape = partition_shape,
+    .rekey = partition_rekey,
+    .update = partition_update,
+    .verify = partition_verify,
+    .lock_free = 1
+};
+
+/**
+ * Each partition is a tree of the store's mode, locked on its own, so the
+ * store itself only pins calls.
+ */
+void partition_init(struct btree* tree, struct store_options* options) {
+    struct partitions* partitions = malloc(sizeof(struct partitions));
+    partitions->count = options->partitions;
+    partitions->scheme = options->partition_by;
+    partitions->trees = malloc(partitions->count * sizeof(struct btree*));
+
+    // an empty span is taken to mean the whole key space
+    partitions->low = key_position(options->partition_low);
+    uint64_t high = key_position(options->partition_high);
+    if (high <= partitions->low) {
+        partitions->low = 0;
+        high = UINT64_MAX;
+    }
+
+    partitions->span = high - partitions->low;
+    int nodes = options->numa ? arena_nodes() : 1;
+
+    for (uint32_t i = 0; i < partitions->count; i++) {
+        struct btree* partition = malloc(sizeof(struct btree));
+        partition->branching = tree->branching;
+        partition->processors = tree->processors;
+        partition->pool = tree->pool;
+        partition->num_nodes = 0;
+        partition->root = NULL;
+        partition->index = NULL;
+        partition->stats = tree->stats;
+        partition->trace = tree->trace;
+        partition->epochs = tree->epochs;
+        partition->macs = tree->macs;
+        partition->compress = tree->compress;
+        partition->inline_values = tree->inline_values;
+        partition->dedup = tree->dedup;
+        partition->arena = options->huge_pages ? arena_create(options->numa ? i % nodes : -1) : NULL;
+        pthread_rwlock_init(&partition->lock, NULL);
+
+        init_index(partition, options->mode);
+        partitions->trees[i] = partition;
+    }
+
+    tree->index = partitions;
+}
@@ -0,0 +1,35 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "btreestore.h"
+#include "btree.h"
+
+// records a partition hands over at a time while a range merges partitions
+#define PARTITION_BATCH (64)
+
+/**
+ * Independent trees which keys are routed between, each a store of its own
+ * with its own lock, sharing the stats, trace and epochs of the store above.
+ */
+struct partitions {
+    uint32_t count;
+    enum partition_scheme scheme;
+    struct btree** trees;
+
+    // range partitions split key positions from low to low + span evenly
+    uint64_t low;
+    uint64_t span;
+};
+
+// INDEX
+
+extern const struct index_ops PARTITION_OPS;
+
+void partition_init(struct btree* tree, struct store_options* options);
+
+#endif
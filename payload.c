@@ -0,0 +1,615 @@
+#include "payload.h"
+#include "compress.h"
+#include "dedup.h"
+#include "epoch.h"
+
+// HELPER FUNCTIONS
+
+static uint64_t min_u64(uint64_t a, uint64_t b) {
+    return (a < b) ? a : b;
+}
+
+/**
+ * The ciphertext of a value which is not chained, wherever it is held.
+ */
+static uint64_t* flat_blocks(struct info* info) {
+    return (info->flags & INFO_INLINE) ? info->blocks : info->data;
+}
+
+/**
+ * Appends a new chunk to a chained value, sized to whichever is smaller of
+ * CHUNK_BYTES and the ciphertext which is yet to be written.
+ */
+static void extend_chain(struct insert_stream* stream) {
+    uint64_t remaining = PADDED(stream->info.size) - stream->counter * 8;
+    uint32_t size = min_u64(remaining, CHUNK_BYTES);
+
+    struct chunk* chunk = malloc(sizeof(struct chunk) + size);
+    chunk->next = NULL;
+    chunk->size = size;
+
+    if (stream->tail) {
+        stream->tail->next = chunk;
+    } else {
+        stream->info.data = chunk;
+    }
+
+    stream->tail = chunk;
+    stream->cursor = chunk->data;
+    stream->available = size / 8;
+}
+
+/**
+ * Copies whole plaintext blocks into the value and encrypts them in place,
+ * continuing the counter from wherever the previous write stopped.
+ */
+static void store_blocks(struct insert_stream* stream, const uint8_t* source, uint64_t num_blocks) {
+    while (num_blocks > 0) {
+        if (stream->available == 0) {
+            extend_chain(stream);
+        }
+
+        uint64_t count = min_u64(stream->available, num_blocks);
+        memcpy(stream->cursor, source, count * 8);
+        encrypt_tea_ctr_from(
+            stream->cursor,
+            stream->info.key,
+            stream->info.nonce,
+            stream->counter,
+            stream->cursor,
+            count
+        );
+
+        stream->cursor += count;
+        stream->available -= count;
+        stream->counter += count;
+        source += count * 8;
+        num_blocks -= count;
+    }
+}
+
+/**
+ * Decrypts the next ciphertext block of the value into buffer, moving on to
+ * the following chunk when the current one has been exhausted.
+ */
+static void load_block(struct decrypt_stream* stream, uint8_t buffer[8]) {
+    if (stream->available == 0) {
+        stream->chunk = stream->chunk->next;
+        stream->cursor = stream->chunk->data;
+        stream->available = stream->chunk->size / 8;
+    }
+
+    uint64_t block;
+    decrypt_tea_ctr_from(
+        stream->cursor,
+        stream->info.key,
+        stream->info.nonce,
+        stream->counter,
+        &block,
+        1
+    );
+
+    memcpy(buffer, &block, 8);
+    stream->cursor += 1;
+    stream->available -= 1;
+    stream->counter += 1;
+}
+
+// WRITING
+
+/**
+ * Prepares a stream which encrypts a value of count bytes as it is written,
+ * with a MAC if flags has INFO_MAC. Values no larger than CHUNK_BYTES are
+ * kept in a single buffer, larger ones are stored as a chain of chunks so no
+ * one allocation exceeds CHUNK_BYTES. With INFO_INLINE, values of up to
+ * INFO_INLINE_BYTES are kept in the info instead, which must then stay in
+ * the stream until the value is finished. With INFO_SHARED, a single buffer
+ * is made ready for dedup_intern.
+ */
+void insert_stream_init(struct insert_stream* stream, bkey_t key, size_t count, uint32_t encryption_key[4], uint64_t nonce, uint32_t flags, void* helper) {
+    memset(stream, 0, sizeof(struct insert_stream));
+    stream->helper = helper;
+    stream->key = key;
+    stream->info.size = count;
+    stream->info.nonce = nonce;
+    stream->info.flags = flags & INFO_MAC;
+    memcpy(stream->info.key, encryption_key, sizeof(uint32_t) * 4);
+
+    uint64_t padded = PADDED(count);
+    if (padded > CHUNK_BYTES) {
+        stream->info.flags |= INFO_CHAINED;
+    } else if (padded > 0 && padded <= INFO_INLINE_BYTES && (flags & INFO_INLINE)) {
+        stream->info.flags |= INFO_INLINE;
+        stream->cursor = stream->info.blocks;
+        stream->available = padded / 8;
+    } else if (padded > 0) {
+        stream->info.flags |= flags & INFO_SHARED;
+        stream->info.data = (flags & INFO_SHARED) ? shared_alloc(padded) : malloc(padded);
+        stream->cursor = stream->info.data;
+        stream->available = padded / 8;
+    }
+}
+
+/**
+ * Encrypts the next count bytes of plaintext into the value, and returns 1
+ * without writing anything if that would exceed the size given on creation.
+ */
+int insert_stream_write(struct insert_stream* stream, void* plaintext, size_t count) {
+    if (stream->written + count > stream->info.size) {
+        return 1;
+    }
+
+    const uint8_t* source = plaintext;
+    stream->written += count;
+
+    // complete the block left over from the previous write
+    if (stream->partial_size > 0) {
+        size_t taken = min_u64(8 - stream->partial_size, count);
+        memcpy(stream->partial + stream->partial_size, source, taken);
+        stream->partial_size += taken;
+        source += taken;
+        count -= taken;
+
+        if (stream->partial_size < 8) {
+            return 0;
+        }
+
+        store_blocks(stream, stream->partial, 1);
+        stream->partial_size = 0;
+    }
+
+    store_blocks(stream, source, count / 8);
+
+    // hold on to trailing bytes until the block can be completed
+    stream->partial_size = count % 8;
+    memcpy(stream->partial, source + (count - count % 8), stream->partial_size);
+    return 0;
+}
+
+/**
+ * Pads and encrypts the final block, and computes the MAC if INFO_MAC is
+ * set. Returns 1, having released the value, if fewer bytes were written
+ * than the size given on creation.
+ */
+int insert_stream_finish(struct insert_stream* stream) {
+    if (stream->written != stream->info.size) {
+        free_info(&stream->info);
+        return 1;
+    }
+
+    if (stream->partial_size > 0) {
+        memset(stream->partial + stream->partial_size, 0, 8 - stream->partial_size);
+        store_blocks(stream, stream->partial, 1);
+        stream->partial_size = 0;
+    }
+
+    if (stream->info.flags & INFO_MAC) {
+        stream->info.mac = payload_mac(stream->key, &stream->info);
+    }
+
+    return 0;
+}
+
+/**
+ * Compresses a value into a new buffer, returning its compressed size, or 0
+ * with no buffer if it is too short or compressing would not save a block.
+ */
+static uint32_t compress_value(const void* plaintext, size_t count, uint8_t** packed) {
+    *packed = NULL;
+    if (count < COMPRESS_MIN_SIZE || count > UINT32_MAX) {
+        return 0;
+    }
+
+    uint32_t capacity = PADDED(count) - 8;
+    *packed = malloc(capacity);
+    uint32_t size = lz_compress(plaintext, count, *packed, capacity);
+    if (size == 0) {
+        free(*packed);
+        *packed = NULL;
+    }
+
+    return size;
+}
+
+/**
+ * Encrypts a whole value into info, with INFO_MAC and INFO_INLINE in flags
+ * as for a stream. With INFO_COMPRESSED the value is compressed first, unless it would not shrink,
+ * in which case the flag is left off and the value is stored as it is.
+ */
+void encrypt_value(struct info* info, bkey_t key, void* plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, uint32_t flags) {
+    uint8_t* packed = NULL;
+    uint32_t size = (flags & INFO_COMPRESSED) ? compress_value(plaintext, count, &packed) : 0;
+
+    struct insert_stream stream;
+    insert_stream_init(&stream, key, packed ? size : count, encryption_key, nonce, flags, NULL);
+    if (packed) {
+        stream.info.flags |= INFO_COMPRESSED;
+        stream.info.original = count;
+    }
+
+    insert_stream_write(&stream, packed ? packed : plaintext, stream.info.size);
+    insert_stream_finish(&stream);
+    free(packed);
+    *info = stream.info;
+}
+
+// INTEGRITY
+
+/**
+ * Chains one block into the MAC. The block goes through uint32_t arrays by
+ * memcpy, as encrypt_tea writing a uint64_t through a uint32_t pointer breaks
+ * strict aliasing once the two are optimised together.
+ */
+static void mac_block(uint64_t* state, uint64_t block, uint32_t key[4]) {
+    uint64_t input = *state ^ block;
+    uint32_t halves[2], output[2];
+
+    memcpy(halves, &input, sizeof(input));
+    encrypt_tea(halves, output, key);
+    memcpy(state, output, sizeof(output));
+}
+
+/**
+ * CBC-MAC under TEA over the ciphertext, with the words of the value's key
+ * flipped so the MAC never shares a key with the keystream. The first blocks
+ * take in the record's key, nonce and sizes, so a value can neither be cut
+ * short nor moved onto another record unnoticed.
+ */
+uint64_t payload_mac(bkey_t key, struct info* info) {
+    uint32_t mac_key[4];
+    for (int i = 0; i < 4; i++) {
+        mac_key[i] = ~info->key[i];
+    }
+
+    uint64_t state = 0;
+    mac_block(&state, key_hash(key) ^ info->nonce, mac_key);
+    mac_block(&state, info->size | (uint64_t) info->original << 32, mac_key);
+
+    if (info->flags & INFO_CHAINED) {
+        for (struct chunk* chunk = info->data; chunk; chunk = chunk->next) {
+            for (uint32_t i = 0; i < chunk->size / 8; i++) {
+                mac_block(&state, chunk->data[i], mac_key);
+            }
+        }
+    } else if (info->size > 0) {
+        uint64_t* blocks = flat_blocks(info);
+        for (uint64_t i = 0; i < PADDED(info->size) / 8; i++) {
+            mac_block(&state, blocks[i], mac_key);
+        }
+    }
+
+    return state;
+}
+
+/**
+ * Whether the value matches its MAC, always so for values without one.
+ */
+int payload_intact(bkey_t key, struct info* info) {
+    return !(info->flags & INFO_MAC) || payload_mac(key, info) == info->mac;
+}
+
+// READING
+
+/**
+ * Number of bytes the value decrypts to.
+ */
+uint32_t value_size(struct info* info) {
+    return (info->flags & INFO_COMPRESSED) ? info->original : info->size;
+}
+
+/**
+ * Starts reading the ciphertext, from the stream's own copy of the info when
+ * the value is inline, so the record may move while the stream is open.
+ */
+static void open_stream(struct decrypt_stream* stream, struct info* info) {
+    memset(stream, 0, sizeof(struct decrypt_stream));
+    stream->info = *info;
+
+    if (info->size == 0) {
+        return;
+    } else if (info->flags & INFO_CHAINED) {
+        stream->chunk = info->data;
+        stream->cursor = stream->chunk->data;
+        stream->available = stream->chunk->size / 8;
+    } else {
+        stream->cursor = flat_blocks(&stream->info);
+        stream->available = PADDED(info->size) / 8;
+    }
+}
+
+/**
+ * Decrypts a compressed value whole and decompresses it into output, which
+ * holds its original size. Returns 1 if it does not decompress to that size.
+ */
+static int unpack_value(struct info* info, void* output) {
+    struct decrypt_stream stream;
+    open_stream(&stream, info);
+
+    uint8_t* packed = malloc(PADDED(info->size));
+    decrypt_stream_read(&stream, packed, info->size);
+    int result = lz_decompress(packed, info->size, output, info->original);
+    free(packed);
+    return result;
+}
+
+/**
+ * Prepares a stream over the value. Returns 1, leaving nothing to read, if
+ * the value is compressed but does not decompress.
+ */
+int decrypt_stream_init(struct decrypt_stream* stream, struct info* info) {
+    open_stream(stream, info);
+    if (!(info->flags & INFO_COMPRESSED)) {
+        return 0;
+    }
+
+    stream->unpacked = malloc(info->original);
+    if (unpack_value(info, stream->unpacked)) {
+        decrypt_stream_release(stream);
+        stream->info.size = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Decrypts up to count bytes of the value into output, carrying on from the
+ * previous read, and returns the number of bytes produced.
+ */
+size_t decrypt_stream_read(struct decrypt_stream* stream, void* output, size_t count) {
+    if (stream->unpacked) {
+        size_t done = min_u64(count, stream->info.original - stream->offset);
+        memcpy(output, stream->unpacked + stream->offset, done);
+        stream->offset += done;
+        return done;
+    }
+
+    uint8_t* target = output;
+    size_t total = min_u64(count, stream->info.size - stream->offset);
+    size_t done = 0;
+
+    // drain plaintext left over from a block split by the previous read
+    if (stream->plain_left > 0) {
+        done = min_u64(stream->plain_left, total);
+        memcpy(target, stream->plain + (8 - stream->plain_left), done);
+        stream->plain_left -= done;
+    }
+
+    while (total - done >= 8) {
+        load_block(stream, target + done);
+        done += 8;
+    }
+
+    if (done < total) {
+        load_block(stream, stream->plain);
+        memcpy(target + done, stream->plain, total - done);
+        stream->plain_left = 8 - (total - done);
+        done = total;
+    }
+
+    stream->offset += done;
+    return done;
+}
+
+void decrypt_stream_release(struct decrypt_stream* stream) {
+    free(stream->unpacked);
+    stream->unpacked = NULL;
+}
+
+/**
+ * Decrypts the whole value into output, which holds value_size bytes,
+ * undoing any compression. Returns 1 if it does not decompress.
+ */
+int decrypt_value(struct info* info, void* output) {
+    if (info->flags & INFO_COMPRESSED) {
+        return unpack_value(info, output);
+    }
+
+    struct decrypt_stream stream;
+    open_stream(&stream, info);
+    decrypt_stream_read(&stream, output, info->size);
+    return 0;
+}
+
+// REKEYING
+
+/**
+ * Rewrites count blocks of ciphertext from source into target, which may be
+ * the same, XORed with both the old and the new keystream. The keystreams are
+ * made REKEY_BATCH blocks at a time, and the plaintext is never written out.
+ */
+static void rekey_blocks(uint64_t* source, uint64_t* target, struct info* from, struct info* to, uint64_t counter, uint64_t count) {
+    uint64_t streams[REKEY_BATCH];
+
+    for (uint64_t done = 0; done < count; done += REKEY_BATCH) {
+        uint32_t batch = min_u64(count - done, REKEY_BATCH);
+        memset(streams, 0, batch * 8);
+        encrypt_tea_ctr_from(streams, from->key, from->nonce, counter + done, streams, batch);
+        encrypt_tea_ctr_from(streams, to->key, to->nonce, counter + done, streams, batch);
+
+        for (uint32_t i = 0; i < batch; i++) {
+            target[done + i] = source[done + i] ^ streams[i];
+        }
+    }
+}
+
+/**
+ * Moves the value onto the new key if filter picks it and it is intact. The nonce given is
+ * mixed with the hash of the record's key, so records rekeyed together still
+ * never share a keystream. Without rekey->in_place the ciphertext is rewritten
+ * into new buffers and the old ones are retired for the readers holding them.
+ */
+void rekey_info(struct rekey* rekey, bkey_t key, struct info* info) {
+    if (rekey->filter && !rekey->filter(key, info, rekey->context)) {
+        return;
+    }
+
+    // a value which fails its MAC keeps it, rather than gaining a new one
+    if (!payload_intact(key, info)) {
+        return;
+    }
+
+    // a shared buffer goes on holding the other values, so the value moves
+    // to a buffer of its own
+    int in_place = rekey->in_place && !(info->flags & INFO_SHARED);
+
+    struct info rekeyed = *info;
+    memcpy(rekeyed.key, rekey->key, sizeof(uint32_t) * 4);
+    rekeyed.nonce = rekey->nonce ^ key_hash(key);
+    rekeyed.flags &= ~INFO_SHARED;
+
+    if (info->flags & INFO_CHAINED) {
+        struct chunk* tail = NULL;
+        uint64_t counter = 0;
+
+        for (struct chunk* chunk = info->data; chunk; chunk = chunk->next) {
+            struct chunk* target = chunk;
+            if (!in_place) {
+                target = malloc(sizeof(struct chunk) + chunk->size);
+                target->next = NULL;
+                target->size = chunk->size;
+
+                if (tail) {
+                    tail->next = target;
+                } else {
+                    rekeyed.data = target;
+                }
+
+                tail = target;
+            }
+
+            rekey_blocks(chunk->data, target->data, info, &rekeyed, counter, chunk->size / 8);
+            counter += chunk->size / 8;
+        }
+    } else if (info->flags & INFO_INLINE) {
+        rekey_blocks(info->blocks, rekeyed.blocks, info, &rekeyed, 0, PADDED(info->size) / 8);
+    } else if (info->data) {
+        rekeyed.data = in_place ? info->data : malloc(PADDED(info->size));
+        rekey_blocks(info->data, rekeyed.data, info, &rekeyed, 0, PADDED(info->size) / 8);
+    }
+
+    if (rekeyed.flags & INFO_MAC) {
+        rekeyed.mac = payload_mac(key, &rekeyed);
+    }
+
+    if (!in_place && !(info->flags & INFO_INLINE)) {
+        epoch_retire(rekey->epochs, info);
+    }
+
+    *info = rekeyed;
+    __atomic_add_fetch(&rekey->count, 1, __ATOMIC_RELAXED);
+}
+
+// UPDATING
+
+/**
+ * The new value encrypted into a buffer of its own, which the index takes
+ * by clearing update->encrypted.
+ */
+struct info* update_payload(struct update* update, bkey_t key) {
+    if (!update->encrypted) {
+        encrypt_value(&update->info, key, update->plaintext, update->count, update->key, update->nonce, update->flags);
+        dedup_intern(update->dedup, &update->info);
+        update->encrypted = 1;
+        update->size = update->info.size;
+    }
+
+    return &update->info;
+}
+
+/**
+ * Encrypts the new value straight over a flat old one whose buffer it fits
+ * in, compressed first if it is to be, when no reader can hold the old one.
+ * Values held inline have no buffer to keep, so a new value small enough to
+ * be inline goes there instead, and shared buffers are never written over.
+ */
+static int update_in_place(struct update* update, bkey_t key, struct info* stored) {
+    if (!update->in_place || (stored->flags & (INFO_CHAINED | INFO_INLINE | INFO_SHARED)) || stored->data == NULL) {
+        return 0;
+    }
+
+    uint8_t* packed = NULL;
+    uint32_t size = (update->flags & INFO_COMPRESSED) ? compress_value(update->plaintext, update->count, &packed) : 0;
+    size = packed ? size : update->count;
+
+    uint64_t padded = PADDED((uint64_t) size);
+    int fits_inline = padded <= INFO_INLINE_BYTES && (update->flags & INFO_INLINE);
+    if (padded == 0 || padded > PADDED(stored->size) || fits_inline) {
+        free(packed);
+        return 0;
+    }
+
+    struct insert_stream stream;
+    memset(&stream, 0, sizeof(struct insert_stream));
+    stream.key = key;
+    stream.info = *stored;
+    stream.info.flags = (update->flags & INFO_MAC) | (packed ? INFO_COMPRESSED : 0);
+    stream.info.size = size;
+    stream.info.original = packed ? update->count : 0;
+    stream.info.nonce = update->nonce;
+    memcpy(stream.info.key, update->key, sizeof(uint32_t) * 4);
+    stream.cursor = stored->data;
+    stream.available = padded / 8;
+
+    insert_stream_write(&stream, packed ? packed : update->plaintext, size);
+    insert_stream_finish(&stream);
+    free(packed);
+    *stored = stream.info;
+    update->size = size;
+    return 1;
+}
+
+/**
+ * Replaces the stored value, over its own buffer where it can be, or else
+ * with a new one while the old one is retired for the readers holding it.
+ */
+void update_info(struct update* update, bkey_t key, struct info* stored) {
+    if (update_in_place(update, key, stored)) {
+        return;
+    }
+
+    struct info* payload = update_payload(update, key);
+    epoch_retire(update->epochs, stored);
+    *stored = *payload;
+    update->encrypted = 0;
+}
+
+// OWNERSHIP
+
+void free_info(struct info* info) {
+    if (info->flags & INFO_INLINE) {
+        return;
+    } else if (info->flags & INFO_SHARED) {
+        shared_release(info->data);
+    } else if (info->flags & INFO_CHAINED) {
+        struct chunk* chunk = info->data;
+        while (chunk) {
+            struct chunk* next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+    } else {
+        free(info->data);
+    }
+
+    info->data = NULL;
+}
+
+/**
+ * Number of allocations holding the value, one per chunk of a chained value
+ * and none for an inline one.
+ */
+uint64_t count_allocations(struct info* info) {
+    if (info->flags & INFO_INLINE) {
+        return 0;
+    } else if (!(info->flags & INFO_CHAINED)) {
+        return info->data != NULL;
+    }
+
+    uint64_t count = 0;
+    for (struct chunk* chunk = info->data; chunk; chunk = chunk->next) {
+        count += 1;
+    }
+
+    return count;
+}
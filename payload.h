@@ -0,0 +1,145 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "btreestore.h"
+
+#define PADDED(count) ((count) + ((count) % 8 > 0 ? (8 - ((count) % 8)) : 0))
+
+// blocks of keystream generated at a time while rekeying, small enough that
+// both keystreams and the ciphertext they cover stay in cache
+#define REKEY_BATCH (64)
+
+struct epochs;
+struct dedup;
+
+struct insert_stream {
+    void* helper;
+    bkey_t key;
+    struct info info;
+
+    struct chunk* tail;
+    uint64_t* cursor;
+    uint64_t available;
+    uint64_t counter;
+    uint64_t written;
+
+    uint8_t partial[8];
+    uint32_t partial_size;
+};
+
+struct decrypt_stream {
+    void* helper;
+    struct info info;
+
+    struct chunk* chunk;
+    uint64_t* cursor;
+    uint64_t available;
+    uint64_t counter;
+    uint64_t offset;
+
+    uint8_t plain[8];
+    uint32_t plain_left;
+
+    // a compressed value is decompressed whole when the stream starts
+    uint8_t* unpacked;
+};
+
+// WRITING
+
+void insert_stream_init(struct insert_stream* stream, bkey_t key, size_t count, uint32_t encryption_key[4], uint64_t nonce, uint32_t flags, void* helper);
+
+int insert_stream_write(struct insert_stream* stream, void* plaintext, size_t count);
+
+int insert_stream_finish(struct insert_stream* stream);
+
+void encrypt_value(struct info* info, bkey_t key, void* plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, uint32_t flags);
+
+// INTEGRITY
+
+uint64_t payload_mac(bkey_t key, struct info* info);
+
+int payload_intact(bkey_t key, struct info* info);
+
+// READING
+
+int decrypt_stream_init(struct decrypt_stream* stream, struct info* info);
+
+size_t decrypt_stream_read(struct decrypt_stream* stream, void* output, size_t count);
+
+void decrypt_stream_release(struct decrypt_stream* stream);
+
+int decrypt_value(struct info* info, void* output);
+
+uint32_t value_size(struct info* info);
+
+// REKEYING
+
+/**
+ * A change of encryption key for the records filter picks, or every record
+ * when it is NULL. Indexes walking their subtrees in parallel call filter
+ * from several threads at once.
+ */
+struct rekey {
+    range_visit filter;
+    void* context;
+    uint32_t key[4];
+    uint64_t nonce;
+
+    // whether the caller was already pinned, and so may hold payloads
+    int pinned;
+
+    // set when no pinned reader can hold a payload, so ciphertext is
+    // rewritten where it lies rather than into a copy
+    int in_place;
+    struct epochs* epochs;
+
+    uint64_t count;
+};
+
+void rekey_info(struct rekey* rekey, bkey_t key, struct info* info);
+
+// UPDATING
+
+/**
+ * A new value for a key already present. It is only encrypted into a buffer
+ * of its own when it cannot be written over the old value.
+ */
+struct update {
+    void* plaintext;
+    size_t count;
+    uint32_t key[4];
+    uint64_t nonce;
+
+    // INFO_MAC, INFO_COMPRESSED, INFO_INLINE and INFO_SHARED as the store
+    // asks for them, with the table shared values are interned in
+    uint32_t flags;
+    struct dedup* dedup;
+
+    // as for a rekey
+    int pinned;
+    int in_place;
+    struct epochs* epochs;
+
+    // the new value while it is encrypted but not yet taken by the index
+    struct info info;
+    int encrypted;
+
+    // bytes the new value was stored in, compressed or not, once written
+    uint32_t size;
+};
+
+struct info* update_payload(struct update* update, bkey_t key);
+
+void update_info(struct update* update, bkey_t key, struct info* stored);
+
+// OWNERSHIP
+
+void free_info(struct info* info);
+
+uint64_t count_allocations(struct info* info);
+
+#endif
@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// the worker the calling thread is in the pool it last joined
+static __thread struct {
+    struct pool* pool;
+    uint32_t worker;
+} current;
+
+struct worker_start {
+    struct pool* pool;
+    uint32_t worker;
+};
+
+// HELPER FUNCTIONS
+
+static void push(struct pool_deque* deque, struct pool_task* task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        // reuse the space stolen from the head before growing
+        uint32_t count = deque->tail - deque->head;
+        if (deque->head > count) {
+            memmove(deque->tasks, deque->tasks + deque->head, count * sizeof(struct pool_task));
+        } else {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+            deque->tasks = realloc(deque->tasks, deque->capacity * sizeof(struct pool_task));
+            memmove(deque->tasks, deque->tasks + deque->head, count * sizeof(struct pool_task));
+        }
+
+        deque->head = 0;
+        deque->tail = count;
+    }
+
+    deque->tasks[deque->tail++] = *task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static int pop(struct pool_deque* deque, struct pool_task* task) {
+    pthread_mutex_lock(&deque->lock);
+    int found = deque->head < deque->tail;
+    if (found) {
+        *task = deque->tasks[--deque->tail];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int steal(struct pool_deque* deque, struct pool_task* task) {
+    pthread_mutex_lock(&deque->lock);
+    int found = deque->head < deque->tail;
+    if (found) {
+        *task = deque->tasks[deque->head++];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/**
+ * Runs a task from the worker's own deque, or one stolen from the next
+ * worker which has any. Returns 0 if there was nothing to run.
+ */
+static int run_one(struct pool* pool, uint32_t worker) {
+    struct pool_task task;
+    int found = pop(&pool->deques[worker], &task);
+
+    for (uint32_t i = 1; i < pool->workers && !found; i++) {
+        found = steal(&pool->deques[(worker + i) % pool->workers], &task);
+    }
+
+    if (found) {
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+        task.run(task.argument);
+
+        // the last task wakes whoever waits on them all
+        if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_lock(&pool->idle_lock);
+            pthread_cond_broadcast(&pool->wake);
+            pthread_mutex_unlock(&pool->idle_lock);
+        }
+    }
+
+    return found;
+}
+
+static void* work(void* argument) {
+    struct worker_start* start = argument;
+    struct pool* pool = start->pool;
+    uint32_t worker = start->worker;
+    free(start);
+
+    current.pool = pool;
+    current.worker = worker;
+
+    while (1) {
+        if (run_one(pool, worker)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        while (!pool->closing && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&pool->wake, &pool->idle_lock);
+        }
+
+        int closing = pool->closing;
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (closing) {
+            return NULL;
+        }
+    }
+}
+
+// POOL
+
+struct pool* pool_create(uint32_t workers) {
+    struct pool* pool = calloc(1, sizeof(struct pool));
+    pool->workers = workers ? workers : 1;
+    pool->threads = calloc(pool->workers, sizeof(pthread_t));
+    pool->deques = calloc(pool->workers, sizeof(struct pool_deque));
+
+    for (uint32_t i = 0; i < pool->workers; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (uint32_t i = 1; i < pool->workers; i++) {
+        struct worker_start* start = malloc(sizeof(struct worker_start));
+        start->pool = pool;
+        start->worker = i;
+        pthread_create(&pool->threads[i], NULL, work, start);
+    }
+
+    return pool;
+}
+
+/**
+ * Stops the workers, which must have nothing left to run.
+ */
+void pool_destroy(struct pool* pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    for (uint32_t i = 1; i < pool->workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->idle_lock);
+
+    for (uint32_t i = 0; i < pool->workers; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+/**
+ * Queues run on the calling worker's deque, so tasks spawning tasks keep
+ * their work close until another worker steals it, and wakes a worker to
+ * take it.
+ */
+void pool_spawn(struct pool* pool, void (*run)(void* argument), void* argument) {
+    struct pool_task task = { run, argument };
+    uint32_t worker = (current.pool == pool) ? current.worker : 0;
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    push(&pool->deques[worker], &task);
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/**
+ * Works alongside the other workers until every task spawned so far, and
+ * every task they spawn in turn, has finished.
+ */
+void pool_wait(struct pool* pool) {
+    uint32_t worker = (current.pool == pool) ? current.worker : 0;
+
+    while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0) {
+        if (run_one(pool, worker)) {
+            continue;
+        }
+
+        // the tasks left are running elsewhere
+        pthread_mutex_lock(&pool->idle_lock);
+        while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0
+                && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0) {
+            pthread_cond_wait(&pool->wake, &pool->idle_lock);
+        }
+
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct pool_task {
+    void (*run)(void* argument);
+    void* argument;
+};
+
+/**
+ * Tasks spawned by one worker. The owner pushes and pops at the tail, so it
+ * works depth first on what it spawned last, while idle workers steal from
+ * the head, taking the oldest and usually largest tasks.
+ */
+struct pool_deque {
+    pthread_mutex_t lock;
+    struct pool_task* tasks;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t capacity;
+};
+
+/**
+ * Work stealing threads for walks over a whole tree, kept for the life of a
+ * store. Threads outside the pool which spawn tasks share the first deque,
+ * and work through tasks alongside the workers while they wait on them. Idle
+ * workers sleep until tasks are spawned.
+ */
+struct pool {
+    uint32_t workers;
+    pthread_t* threads;
+    struct pool_deque* deques;
+
+    // tasks spawned and not yet finished, and those not yet started
+    uint64_t pending;
+    uint64_t queued;
+    int closing;
+
+    // idle threads wait on wake for tasks to be queued or all to finish
+    pthread_mutex_t idle_lock;
+    pthread_cond_t wake;
+};
+
+struct pool* pool_create(uint32_t workers);
+
+void pool_destroy(struct pool* pool);
+
+void pool_spawn(struct pool* pool, void (*run)(void* argument), void* argument);
+
+void pool_wait(struct pool* pool);
+
+#endif
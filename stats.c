@@ -0,0 +1,144 @@
+#include <malloc.h>
+
+#include "stats.h"
+#include "payload.h"
+#include "dedup.h"
+#include "arena.h"
+
+// HELPER FUNCTIONS
+
+/**
+ * The smallest latency which falls in a bucket.
+ */
+static uint64_t bucket_floor(int index) {
+    if (index < STATS_SUB_BUCKETS) {
+        return index;
+    }
+
+    int shift = index / STATS_SUB_BUCKETS - 1;
+    return (uint64_t) (STATS_SUB_BUCKETS + index % STATS_SUB_BUCKETS) << shift;
+}
+
+// RECORDING
+
+#ifndef BTREE_NO_STATS
+
+/**
+ * Latencies below STATS_SUB_BUCKETS have a bucket each, above that every
+ * power of two is split into STATS_SUB_BUCKETS equal buckets.
+ */
+static int bucket_index(uint64_t value) {
+    if (value < STATS_SUB_BUCKETS) {
+        return value;
+    }
+
+    int magnitude = 63 - __builtin_clzll(value);
+    int shift = magnitude - __builtin_ctz(STATS_SUB_BUCKETS);
+    return (shift + 1) * STATS_SUB_BUCKETS + ((value >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+void stats_record(struct btree_stats* stats, enum stats_call call, uint64_t elapsed) {
+    if (!stats) {
+        return;
+    }
+
+    struct btree_histogram* histogram = &stats->latency[call];
+
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[bucket_index(elapsed)], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, elapsed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+#endif
+
+// READING
+
+/**
+ * Copies the stats while other threads may still be updating them. Each
+ * field is read atomically, though the copy as a whole is not a consistent
+ * point in time.
+ */
+void stats_snapshot(struct btree_stats* stats, struct btree_stats* copy) {
+    uint64_t* from = (uint64_t*) stats;
+    uint64_t* to = (uint64_t*) copy;
+
+    for (size_t i = 0; i < sizeof(struct btree_stats) / sizeof(uint64_t); i++) {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * The latency below which a fraction q of the recorded calls fell, to within
+ * the width of a histogram bucket.
+ */
+uint64_t btree_stats_percentile(struct btree_histogram* histogram, double q) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = q * (histogram->count - 1);
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > rank) {
+            return bucket_floor(i);
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+// SHAPE
+
+/**
+ * Counts a node towards its level and fill bucket, and decides whether the
+ * walk inspects it.
+ */
+void shape_node(struct shape_walk* walk, int depth, uint32_t num_keys, uint32_t capacity, int holds_records) {
+    struct btree_shape* shape = walk->shape;
+
+    walk->inspect = shape->nodes % walk->stride == 0;
+    shape->inspected += walk->inspect;
+    shape->nodes += 1;
+    shape->height = (depth + 1 > shape->height) ? depth + 1 : shape->height;
+    shape->level_nodes[depth < SHAPE_LEVELS ? depth : SHAPE_LEVELS - 1] += 1;
+    shape->records += holds_records ? num_keys : 0;
+
+    uint64_t bucket = capacity ? (uint64_t) num_keys * SHAPE_FILL_BUCKETS / capacity : 0;
+    shape->fill[bucket < SHAPE_FILL_BUCKETS ? bucket : SHAPE_FILL_BUCKETS - 1] += 1;
+}
+
+void shape_memory(struct shape_walk* walk, uint64_t* field, void* allocation, size_t requested) {
+    shape_arena(walk, field, NULL, allocation, requested);
+}
+
+/**
+ * As shape_memory, for a block which came from arena, whose slack is what
+ * its size was rounded up by.
+ */
+void shape_arena(struct shape_walk* walk, uint64_t* field, struct arena* arena, void* block, size_t requested) {
+    *field += requested;
+    if (walk->inspect && block) {
+        walk->shape->slack_bytes += arena_usable_size(arena, block) - requested;
+    }
+}
+
+void shape_payload(struct shape_walk* walk, struct info* info) {
+    if (!walk->inspect || (info->flags & INFO_INLINE) || info->data == NULL) {
+        return;
+    }
+
+    if (info->flags & INFO_CHAINED) {
+        for (struct chunk* chunk = info->data; chunk; chunk = chunk->next) {
+            shape_memory(walk, &walk->shape->payload_bytes, chunk, sizeof(struct chunk) + chunk->size);
+        }
+    } else if (info->flags & INFO_SHARED) {
+        // each value is counted its part of the buffer
+        shape_memory(walk, &walk->shape->payload_bytes, NULL, PADDED(info->size) / shared_refs(info->data));
+    } else {
+        shape_memory(walk, &walk->shape->payload_bytes, info->data, PADDED(info->size));
+    }
+}
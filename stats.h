@@ -0,0 +1,64 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "btreestore.h"
+
+static inline uint64_t clock_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+/**
+ * Stores opened without stats have a NULL stats pointer, so every counter
+ * costs one predictable branch. Building with -DBTREE_NO_STATS removes the
+ * counters altogether.
+ */
+#ifdef BTREE_NO_STATS
+
+#define STATS_ADD(stats, field, amount) ((void) 0)
+
+static inline void stats_record(struct btree_stats* stats, enum stats_call call, uint64_t elapsed) {
+}
+
+#else
+
+#define STATS_ADD(stats, field, amount) do {                                   \
+    if (stats) {                                                               \
+        __atomic_fetch_add(&(stats)->field, (amount), __ATOMIC_RELAXED);       \
+    }                                                                          \
+} while (0)
+
+void stats_record(struct btree_stats* stats, enum stats_call call, uint64_t elapsed);
+
+#endif
+
+void stats_snapshot(struct btree_stats* stats, struct btree_stats* copy);
+
+// SHAPE
+
+/**
+ * State of a walk over every node of an index filling in a btree_shape. Only
+ * every stride-th node has its allocations and payloads inspected.
+ */
+struct arena;
+
+struct shape_walk {
+    struct btree_shape* shape;
+    uint64_t stride;
+    int inspect;
+};
+
+void shape_node(struct shape_walk* walk, int depth, uint32_t num_keys, uint32_t capacity, int holds_records);
+
+void shape_memory(struct shape_walk* walk, uint64_t* field, void* allocation, size_t requested);
+
+void shape_arena(struct shape_walk* walk, uint64_t* field, struct arena* arena, void* block, size_t requested);
+
+void shape_payload(struct shape_walk* walk, struct info* info);
+
+#endif
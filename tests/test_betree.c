@@ -0,0 +1,144 @@
+#include "../btreestore.h"
+#include "../btree.h"
+#include "../betree.h"
+#include "test.h"
+
+// HELPER FUNCTIONS
+
+/**
+ * Checks keys and buffered messages are sorted and within the bounds set by
+ * the parent, that nodes and buffers are within capacity and that all leaves
+ * are at the same depth. Returns 0 if broken.
+ */
+static int check_benode(struct betree* index, struct benode* node, int64_t low, int64_t high, int depth, int* leaf_depth) {
+    uint32_t capacity = node->leaf ? index->leaf_keys : index->inner_keys;
+    if (node->num_keys > capacity || node->num_messages > index->buffer_size) {
+        return 0;
+    }
+
+    for (int i = 0; i < node->num_keys; i++) {
+        int64_t key = key_to_int(node->keys[i]);
+        if (key < low || key >= high || (i > 0 && !key_less(node->keys[i-1], node->keys[i]))) {
+            return 0;
+        }
+    }
+
+    for (int i = 0; i < node->num_messages; i++) {
+        int64_t key = key_to_int(node->buffer[i].key);
+        if (key < low || key >= high || (i > 0 && !key_less(node->buffer[i-1].key, node->buffer[i].key))) {
+            return 0;
+        }
+    }
+
+    if (node->leaf) {
+        if (*leaf_depth >= 0 && *leaf_depth != depth) {
+            return 0;
+        }
+
+        *leaf_depth = depth;
+        return 1;
+    }
+
+    for (int i = 0; i < node->num_keys + 1; i++) {
+        int64_t l = (i > 0) ? key_to_int(node->keys[i-1]) : low;
+        int64_t h = (i < node->num_keys) ? key_to_int(node->keys[i]) : high;
+        if (!check_benode(index, node->links[i], l, h, depth + 1, leaf_depth)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int check_betree(struct btree* tree) {
+    struct betree* index = tree->index;
+    int leaf_depth = -1;
+    return check_benode(index, index->root, -1, INT64_MAX, 0, &leaf_depth);
+}
+
+static int collect_keys(bkey_t key, struct info* info, void* context) {
+    uint32_t* keys = context;
+    keys[++keys[0]] = key_to_int(key);
+    return keys[0] == 5;
+}
+
+// TESTING
+
+void test_betree_random(int* passed, int* failed) {
+    struct store_options options = { .mode = STORE_BEPSILON };
+    uint32_t encrypt_key[4] = { 3, 1, 4, 1 };
+    int branchings[] = { 3, 4, 8 };
+
+    for (int b = 0; b < sizeof(branchings)/sizeof(branchings[0]); b++) {
+        struct btree* tree = init_store_with(branchings[b], 1, &options);
+        char present[300] = { 0 };
+        int result = 1;
+        srand(b + 1);
+
+        for (int step = 0; step < 3000 && result; step++) {
+            uint32_t key = rand() % 300;
+            char message[16];
+            sprintf(message, "v%u", key);
+
+            if (rand() % 3 < 2) {
+                int expected = present[key] ? 1 : 0;
+                result = btree_insert(key_from_int(key), message, strlen(message), encrypt_key, key, tree) == expected;
+                present[key] = 1;
+            } else {
+                result = btree_delete(key_from_int(key), tree) == present[key];
+                present[key] = 0;
+            }
+
+            result = result && check_betree(tree);
+        }
+
+        // buffered messages answer lookups before they reach the leaves
+        for (uint32_t key = 0; key < 300 && result; key++) {
+            char expected[16], buffer[16] = { 0 };
+            sprintf(expected, "v%u", key);
+            int found = btree_decrypt(key_from_int(key), buffer, tree) == 0;
+            result = (found == present[key]) && (!found || strcmp(buffer, expected) == 0);
+        }
+
+        // an ordered scan drains the buffers and sees the same records
+        uint64_t size = 0;
+        for (int key = 0; key < 300; key++) {
+            size += present[key];
+        }
+
+        uint32_t keys[8] = { 0 };
+        result = result && btree_range(key_from_int(0), key_from_int(299), collect_keys, keys, tree) == (size < 5 ? size : 5);
+        result = result && check_betree(tree);
+
+        close_store(tree);
+        *(result ? passed : failed) += 1;
+    }
+}
+
+void test_betree_range(int* passed, int* failed) {
+    struct store_options options = { .mode = STORE_BEPSILON };
+    uint32_t encrypt_key[4] = { 3, 1, 4, 1 };
+    struct btree* tree = init_store_with(3, 1, &options);
+
+    for (uint32_t key = 0; key < 100; key += 2) {
+        btree_insert(key_from_int(key), "", 0, encrypt_key, 0, tree);
+    }
+
+    // stops after five keys, starting from the first key after 11
+    uint32_t keys[8] = { 0 };
+    uint64_t count = btree_range(key_from_int(11), key_from_int(90), collect_keys, keys, tree);
+    int result = count == 5 && keys[1] == 12 && keys[5] == 20;
+
+    uint32_t none[8] = { 0 };
+    result = result && btree_range(key_from_int(101), key_from_int(200), collect_keys, none, tree) == 0;
+
+    struct node* list = NULL;
+    uint64_t nodes = btree_export(tree, &list);
+    for (uint64_t i = 0; i < nodes; i++) {
+        free(list[i].keys);
+    }
+
+    free(list);
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
@@ -0,0 +1,174 @@
+#include "../btreestore.h"
+#include "test.h"
+
+// HELPER FUNCTIONS
+
+#define KEY_COUNT (300)
+
+// every key the build can hold is the integer masked to its width
+#if BTREE_KEY_WIDTH == 32
+#define KEY_MASK (UINT32_MAX)
+#else
+#define KEY_MASK (UINT64_MAX)
+#endif
+
+static struct store_options KEY_STORES[] = {
+    { .mode = STORE_BTREE },
+    { .mode = STORE_TOP_DOWN },
+    { .mode = STORE_BPLUS },
+    { .mode = STORE_BEPSILON },
+    { .mode = STORE_BWTREE },
+    { .mode = STORE_BTREE, .partitions = 4, .partition_by = PARTITION_HASH },
+    { .mode = STORE_BTREE, .partitions = 4, .partition_by = PARTITION_RANGE },
+};
+
+struct collected {
+    bkey_t keys[KEY_COUNT];
+    int count;
+};
+
+static int collect_key(bkey_t key, struct info* info, void* context) {
+    struct collected* collected = context;
+    if (collected->count < KEY_COUNT) {
+        collected->keys[collected->count] = key;
+    }
+
+    collected->count += 1;
+    return 0;
+}
+
+static int compare_keys(const void* a, const void* b) {
+    bkey_t first = *(const bkey_t*) a, second = *(const bkey_t*) b;
+    return key_less(first, second) ? -1 : key_less(second, first);
+}
+
+/**
+ * Inserts the keys in the given order into a store of each kind, each with
+ * its index as the value, and checks every value comes back under its key
+ * and a range over the whole key space visits the keys in sorted order.
+ */
+static int round_trip(bkey_t* keys, int count, bkey_t low, bkey_t high) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    bkey_t* sorted = malloc(sizeof(bkey_t) * count);
+    memcpy(sorted, keys, sizeof(bkey_t) * count);
+    qsort(sorted, count, sizeof(bkey_t), compare_keys);
+
+    int result = 1;
+    for (int s = 0; s < sizeof(KEY_STORES)/sizeof(KEY_STORES[0]); s++) {
+        struct btree* tree = init_store_with(5, 2, &KEY_STORES[s]);
+
+        for (int i = 0; i < count; i++) {
+            uint64_t value = i;
+            result = result && btree_insert(keys[i], &value, sizeof(value), encrypt_key, i, tree) == 0;
+        }
+
+        for (int i = 0; i < count; i++) {
+            uint64_t value = UINT64_MAX;
+            result = result && btree_decrypt(keys[i], &value, tree) == 0 && value == i;
+        }
+
+        struct collected collected = { .count = 0 };
+        result = result && btree_range(low, high, collect_key, &collected, tree) == count;
+        result = result && collected.count == count;
+        for (int i = 0; result && i < count; i++) {
+            result = key_equal(collected.keys[i], sorted[i]);
+        }
+
+        if (!result) {
+            fprintf(stderr, "key round trip failed in store %d\n", s);
+        }
+
+        close_store(tree);
+    }
+
+    free(sorted);
+    return result;
+}
+
+// KEY TESTS
+
+void test_bkey_integers(int* passed, int* failed) {
+    uint64_t values[] = {
+        0, 1, 255, 256, 65535, 65536, (1ULL << 31), UINT32_MAX - 1, UINT32_MAX,
+        (1ULL << 32), (1ULL << 32) + 1, (1ULL << 40) + 7, (1ULL << 63), UINT64_MAX - 1, UINT64_MAX,
+    };
+
+    int result = 1;
+    int length = sizeof(values)/sizeof(values[0]);
+    for (int i = 0; i < length; i++) {
+        uint64_t value = values[i] & KEY_MASK;
+        result = result && key_to_int(key_from_int(value)) == value;
+        result = result && key_equal(key_from_int(value), key_from_int(value));
+
+        for (int j = 0; j < length; j++) {
+            uint64_t other = values[j] & KEY_MASK;
+            result = result && key_less(key_from_int(value), key_from_int(other)) == (value < other);
+        }
+    }
+
+    // keys spread over the whole width, in an order unrelated to their own
+    bkey_t keys[KEY_COUNT];
+    for (int i = 0; i < KEY_COUNT - 1; i++) {
+        keys[i] = key_from_int((i * 0x9e3779b97f4a7c15ULL) & KEY_MASK);
+    }
+
+    keys[KEY_COUNT - 1] = key_from_int(KEY_MASK);
+    result = result && round_trip(keys, KEY_COUNT, key_from_int(0), key_from_int(KEY_MASK));
+
+    *(result ? passed : failed) += 1;
+}
+
+#if BTREE_KEY_WIDTH == 0
+
+void test_bkey_strings(int* passed, int* failed) {
+    uint8_t bytes[BTREE_KEY_MAX + 1];
+    memset(bytes, 'x', sizeof(bytes));
+
+    bkey_t key;
+    int result = key_from_bytes(&key, bytes, BTREE_KEY_MAX) == 0
+        && key.len == BTREE_KEY_MAX
+        && memcmp(key.bytes, bytes, BTREE_KEY_MAX) == 0;
+
+    // longer keys are refused rather than cut down to a colliding prefix
+    result = result && key_from_bytes(&key, bytes, BTREE_KEY_MAX + 1) == 1 && key.len == 0;
+
+    // ordered lexicographically by unsigned byte, prefixes first
+    char* ordered[] = { "", "\x01", "a", "abc", "abcd", "abd", "b", "\x7f", "\x80", "\xff" };
+    int length = sizeof(ordered)/sizeof(ordered[0]);
+    for (int i = 0; i < length; i++) {
+        for (int j = 0; j < length; j++) {
+            bkey_t a, b;
+            key_from_bytes(&a, ordered[i], strlen(ordered[i]));
+            key_from_bytes(&b, ordered[j], strlen(ordered[j]));
+            result = result && key_less(a, b) == (i < j) && key_equal(a, b) == (i == j);
+        }
+    }
+
+    // keys sharing all but their last few bytes, and the bare prefixes of
+    // those keys, inserted in an order unrelated to their own
+    bkey_t keys[KEY_COUNT];
+    int count = 0;
+    for (int i = 0; i < KEY_COUNT - 20; i++) {
+        uint32_t suffix = (i * 2654435761U) & 0xffffff;
+        bytes[BTREE_KEY_MAX - 3] = suffix >> 16;
+        bytes[BTREE_KEY_MAX - 2] = suffix >> 8;
+        bytes[BTREE_KEY_MAX - 1] = suffix;
+        key_from_bytes(&keys[count++], bytes, BTREE_KEY_MAX);
+    }
+
+    memset(bytes, 'x', sizeof(bytes));
+    for (int i = 1; i <= 20; i++) {
+        key_from_bytes(&keys[count++], bytes, i);
+    }
+
+    bkey_t low, high;
+    uint8_t last[BTREE_KEY_MAX];
+    memset(last, 0xff, sizeof(last));
+    key_from_bytes(&low, "", 0);
+    key_from_bytes(&high, last, sizeof(last));
+    result = result && round_trip(keys, count, low, high);
+
+    *(result ? passed : failed) += 1;
+}
+
+#endif
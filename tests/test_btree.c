@@ -1,13 +1,46 @@
+#include <inttypes.h>
 #include "../btree.h"
 #include "../btreestore.h"
+#include "../pool.h"
 #include "test.h"
 
 // HELPER FUNCTIONS
 
+// prints a tree in the layout of display, keys as the integers they were
+// made from, so the expected trees read the same at every key width
+void show_tree(FILE* file, struct bnode* node, char* prefix, int last) {
+    fprintf(file, "%s%s(", prefix, (last ? " └─ " : " ├─ "));
+    if (node == NULL) {
+        fprintf(file, "NULL)\n");
+        return;
+    }
+
+    for (int i = 0; i < node->num_keys; i++) {
+        char* end = (i < node->num_keys-1) ? ", " : "";
+        fprintf(file, "%" PRIu64 "%s", (uint64_t) key_to_int(node->keys[i].key), end);
+    }
+
+    fprintf(file, ")\n");
+
+    int count = 0;
+    for (int i = 0; i < node->num_keys + 1; i++) {
+        if (node->links[i])
+            count += 1;
+    }
+
+    if (count > 0) {
+        for (int i = 0; i < node->num_keys + 1; i++) {
+            char new_prefix[100];
+            snprintf(new_prefix, sizeof(new_prefix), "%s%s", prefix, (last ? "    " : " |  "));
+            show_tree(file, node->links[i], new_prefix, i == node->num_keys);
+        }
+    }
+}
+
 int assert_tree(struct bnode* node, char* expected) {
-    freopen("bin/output_testing", "w", stdout);
-    display(node, "", 1);
-    freopen("/dev/tty", "w", stdout);
+    FILE* file = fopen("bin/output_testing", "w");
+    show_tree(file, node, "", 1);
+    fclose(file);
     return assert_temp_file(expected);
 }
 
@@ -17,7 +50,7 @@ void test_btree_key_index(int* passed, int* failed) {
     struct bnode* node = new_node(9, 1);
     int keys[] = { 1, 3, 6, 7, 9, 12, 13, 18, 21 };
     for (int i=0; i < 9; i++) {
-        node->keys[i].key = keys[i];
+        node->keys[i].key = key_from_int(keys[i]);
         node->num_keys += 1;
     }
 
@@ -50,7 +83,7 @@ void test_btree_key_index(int* passed, int* failed) {
     };
 
     for (int i=0; i < sizeof(tests)/sizeof(tests[0]); i++) {
-        uint32_t key = tests[i].new_key;
+        bkey_t key = key_from_int(tests[i].new_key);
         int expected = tests[i].expected_index;
 
         int result_index = key_index(node, key, 0, 8);
@@ -92,7 +125,7 @@ void test_btree_insert_key(int* passed, int* failed) {
     };
 
     for (int j=0; j < sizeof(tests)/sizeof(tests[0]); j++) {
-        struct key_value new = { tests[j].new_key };
+        struct key_value new = { .key = key_from_int(tests[j].new_key) };
         int ret = tests[j].ret;
 
         int index = insert_key(node, &new);
@@ -100,7 +133,7 @@ void test_btree_insert_key(int* passed, int* failed) {
 
         if (test_result) {
             for (int i=0; i < node->num_keys; i++) {
-                if (tests[j].keys[i] != node->keys[i].key) {
+                if (tests[j].keys[i] != key_to_int(node->keys[i].key)) {
                     test_result = 0;
                 }
             }
@@ -112,6 +145,133 @@ void test_btree_insert_key(int* passed, int* failed) {
     free_node(&tree, node);
 }
 
+#if BTREE_KEY_WIDTH == 0
+
+static bkey_t string_key(char* bytes) {
+    bkey_t key;
+    key_from_bytes(&key, bytes, strlen(bytes));
+    return key;
+}
+
+// checks that key_index finds each key of a node, and the place of each key
+// missing from the node, as a scan would
+static int check_index(struct bnode* node, bkey_t* probes, int num_probes) {
+    int result = 1;
+    for (int i = 0; i < node->num_keys; i++) {
+        result = result && key_index(node, node->keys[i].key, 0, node->num_keys-1) == i;
+    }
+
+    for (int p = 0; p < num_probes; p++) {
+        int expected = 0;
+        while (expected < node->num_keys && key_less(node->keys[expected].key, probes[p])) {
+            expected += 1;
+        }
+
+        result = result && key_index(node, probes[p], 0, node->num_keys-1) == expected;
+    }
+
+    return result;
+}
+
+void test_btree_string_index(int* passed, int* failed) {
+    struct btree tree = { 16, 1, new_node(16, 1) };
+    struct bnode* node = tree.root;
+
+    // keys differing only after a long shared prefix, some of them prefixes
+    // of the others, inserted out of order
+    char* keys[] = {
+        "shared/prefix/key/0042", "shared/prefix/key/0007", "shared/prefix/key/0100",
+        "shared/prefix/key/", "shared/prefix/key/0042a", "shared/prefix/key/0008",
+        "shared/prefix/key/00", "shared/prefix/key/0099",
+    };
+
+    bkey_t probes[] = {
+        string_key(""), string_key("shared"), string_key("shared/prefix/key/0"),
+        string_key("shared/prefix/key/0041"), string_key("shared/prefix/key/00420"),
+        string_key("shared/prefix/key/1"), string_key("shared/prefix/kez"), string_key("\xff"),
+    };
+    int num_probes = sizeof(probes)/sizeof(probes[0]);
+
+    int result = 1;
+    for (int i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
+        struct key_value item = { .key = string_key(keys[i]) };
+        result = result && insert_key(node, &item) >= 0;
+        result = result && check_index(node, probes, num_probes);
+    }
+
+    struct key_value outside = { .key = string_key("shared/other") };
+    result = result && insert_key(node, &outside) == 0;
+    result = result && check_index(node, probes, num_probes);
+
+    // taking keys from either end or the middle, counting negative indexes
+    // back from the end
+    int takes[] = { 0, 4, -1, 1, -2 };
+    for (int i = 0; i < sizeof(takes)/sizeof(takes[0]); i++) {
+        take_key(node, (takes[i] < 0) ? node->num_keys + takes[i] : takes[i], NULL);
+        result = result && check_index(node, probes, num_probes);
+    }
+
+    *(result ? passed : failed) += 1;
+    free_node(&tree, node);
+}
+
+void test_btree_separators(int* passed, int* failed) {
+    struct btree tree = { 16, 1, new_node(16, 1) };
+    struct bnode* node = tree.root;
+
+    // the shortest key near the median is promoted
+    char* near[] = { "a0000", "a1000", "a2000", "a3", "a4000", "a5000", "a6000", "a7000", "a8000" };
+    for (int i = 0; i < 9; i++) {
+        struct key_value item = { .key = string_key(near[i]) };
+        insert_key(node, &item);
+    }
+
+    int result = separator_index(node) == 3;
+
+    // but not one too far from it to keep the halves even
+    while (node->num_keys > 0) {
+        take_key(node, 0, NULL);
+    }
+
+    char* far[] = { "a", "a1000", "a2000", "a3000", "a4000", "a5000", "a6000", "a7000", "a8000" };
+    for (int i = 0; i < 9; i++) {
+        struct key_value item = { .key = string_key(far[i]) };
+        insert_key(node, &item);
+    }
+
+    result = result && separator_index(node) == 4;
+
+    // separators are cut down to a byte past the prefix the keys share
+    struct {
+        char* a;
+        char* b;
+        char* separator;
+    } tests[] = {
+        { "shared/prefix/aaaa", "shared/prefix/bbbb", "shared/prefix/b" },
+        { "abc",                "abd123",             "abd"             },
+        { "abc",                "abcd",               "abcd"            },
+        { "abc",                "abcdef",             "abcd"            },
+        { "",                   "zzz",                "z"               },
+        { "a\x7f",              "a\x80\x01",          "a\x80"           },
+    };
+
+    for (int i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
+        bkey_t a = string_key(tests[i].a);
+        bkey_t b = string_key(tests[i].b);
+        bkey_t separator = key_separator(a, b);
+
+        result = result
+            && key_equal(separator, string_key(tests[i].separator))
+            && key_less(a, separator)
+            && !key_less(b, separator);
+    }
+
+    *(result ? passed : failed) += 1;
+    free_node(&tree, node);
+}
+
+#endif
+
 struct insert_test {
     int length;
     int branching;
@@ -127,7 +287,7 @@ struct delete_test {
 
 int wrap_tree_insert(struct btree* tree, uint32_t key) {
     uint32_t encryption_key[4] = { 0, 1, 2, 3 };
-    int result = btree_insert(key, "asdf", 0, encryption_key, 123, tree);
+    int result = btree_insert(key_from_int(key), "asdf", 0, encryption_key, 123, tree);
     return result;
 }
 
@@ -155,7 +315,7 @@ int test_delete_sequence(struct insert_test* insert, struct delete_test* test) {
     for (int i = 0; i < test->length; i++) {
         // fprintf(stderr, "\n\ndeleting %d\n", test->sequence[i]);
         // debug(tree->root, "", 1);
-        btree_delete(test->sequence[i], tree);
+        btree_delete(key_from_int(test->sequence[i]), tree);
         // debug(tree->root, "", 1);
         // fprintf(stderr, "\n\n");
     }
@@ -335,6 +495,170 @@ void test_btree_delete_complete(int* passed, int* failed) {
     *(test_delete_sequence(&insert, &test) ? passed : failed) += 1;
 }
 
+// REGRESSIONS
+
+void test_btree_delete_replacement(int* passed, int* failed) {
+    struct insert_test insert = {
+        .length = 4,
+        .branching = 3,
+        .sequence = { 8, 14, 3, 12 },
+    };
+
+    // the key replacing 8 is the largest of its left subtree
+    struct delete_test test = {
+        .sequence = { 8 },
+        .length = 1,
+        .expected = " └─ (12)"          "\n"
+                    "     ├─ (3)"       "\n"
+                    "     └─ (14)"      "\n"
+    };
+
+    *(test_delete_sequence(&insert, &test) ? passed : failed) += 1;
+}
+
+void test_btree_delete_stale(int* passed, int* failed) {
+    struct btree* tree = init_store(3, 1);
+    int keys[] = { 8, 14, 3, 12 };
+    for (int i = 0; i < 4; i++) {
+        wrap_tree_insert(tree, keys[i]);
+    }
+
+    // 8 is left behind past the last key of its node
+    btree_delete(key_from_int(8), tree);
+
+    struct info found;
+    int result = btree_retrieve(key_from_int(8), &found, tree) == 1 && btree_retrieve(key_from_int(12), &found, tree) == 0;
+
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
+
+void test_btree_delete_divided(int* passed, int* failed) {
+    struct insert_test insert = {
+        .length = 5,
+        .branching = 3,
+        .sequence = { 18, 13, 15, 12, 9 },
+    };
+
+    // the split of the left leaf shifts the links to its right
+    struct delete_test test = {
+        .sequence = { 18 },
+        .length = 1,
+        .expected = " └─ (12)"          "\n"
+                    "     ├─ (9)"       "\n"
+                    "     └─ (13, 15)"  "\n"
+    };
+
+    *(test_delete_sequence(&insert, &test) ? passed : failed) += 1;
+}
+
+void test_btree_delete_take_link(int* passed, int* failed) {
+    struct insert_test insert = {
+        .length = 9,
+        .branching = 3,
+        .sequence = { 17, 14, 10, 15, 18, 12, 2, 0, 7 },
+    };
+
+    struct delete_test test = {
+        .sequence = { 15 },
+        .length = 1,
+        .expected = " └─ (10)"              "\n"
+                    "     ├─ (2)"           "\n"
+                    "     |   ├─ (0)"       "\n"
+                    "     |   └─ (7)"       "\n"
+                    "     └─ (14)"          "\n"
+                    "         ├─ (12)"      "\n"
+                    "         └─ (17, 18)"  "\n"
+    };
+
+    *(test_delete_sequence(&insert, &test) ? passed : failed) += 1;
+}
+
+void test_btree_delete_rotate(int* passed, int* failed) {
+    struct insert_test insert = {
+        .length = 6,
+        .branching = 3,
+        .sequence = { 18, 1, 13, 11, 0, 10 },
+    };
+
+    // the leaf of 0 borrows through the key separating it from its sibling,
+    // not the last key of the parent
+    struct delete_test test = {
+        .sequence = { 0 },
+        .length = 1,
+        .expected = " └─ (10, 13)"      "\n"
+                    "     ├─ (1)"       "\n"
+                    "     ├─ (11)"      "\n"
+                    "     └─ (18)"      "\n"
+    };
+
+    *(test_delete_sequence(&insert, &test) ? passed : failed) += 1;
+}
+
+void test_btree_delete_combine(int* passed, int* failed) {
+    struct insert_test insert = {
+        .length = 7,
+        .branching = 3,
+        .sequence = { 0, 4, 6, 15, 9, 18, 20 },
+    };
+
+    // the last delete combines a node which still holds a key
+    struct delete_test test = {
+        .sequence = { 18, 20, 15 },
+        .length = 3,
+        .expected = " └─ (4)"           "\n"
+                    "     ├─ (0)"       "\n"
+                    "     └─ (6, 9)"    "\n"
+    };
+
+    *(test_delete_sequence(&insert, &test) ? passed : failed) += 1;
+}
+
+void test_btree_delete_split_links(int* passed, int* failed) {
+    struct insert_test insert = {
+        .length = 9,
+        .branching = 3,
+        .sequence = { 12, 13, 3, 18, 2, 0, 9, 19, 10 },
+    };
+
+    // links moved to a split node must not linger in the node split
+    struct delete_test test = {
+        .sequence = { 18 },
+        .length = 1,
+        .expected = " └─ (9)"               "\n"
+                    "     ├─ (2)"           "\n"
+                    "     |   ├─ (0)"       "\n"
+                    "     |   └─ (3)"       "\n"
+                    "     └─ (12)"          "\n"
+                    "         ├─ (10)"      "\n"
+                    "         └─ (13, 19)"  "\n"
+    };
+
+    *(test_delete_sequence(&insert, &test) ? passed : failed) += 1;
+}
+
+void test_btree_export_empty(int* passed, int* failed) {
+    struct btree* tree = init_store(3, 1);
+    struct node* list = NULL;
+
+    // an empty store still has its root to list
+    uint64_t count = btree_export(tree, &list);
+    int result = count == 1 && list[0].num_keys == 0;
+    free(list[0].keys);
+    free(list);
+
+    wrap_tree_insert(tree, 5);
+    btree_delete(key_from_int(5), tree);
+
+    count = btree_export(tree, &list);
+    result = result && count == 1 && list[0].num_keys == 0;
+    free(list[0].keys);
+    free(list);
+
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
+
 void test_btree_traversal(int* passed, int* failed) {
     struct insert_test insert = {
         .length = 10,
@@ -373,7 +697,7 @@ void test_btree_traversal(int* passed, int* failed) {
 
     for (int i = 0; i < size; i++) {
         for (int j = 0; j < list[i].num_keys; j++) {
-            result = result && (expected[i][j] == list[i].keys[j]);
+            result = result && (expected[i][j] == key_to_int(list[i].keys[j]));
         }
 
         free(list[i].keys);
@@ -383,3 +707,169 @@ void test_btree_traversal(int* passed, int* failed) {
 
     *(result ? passed : failed) += 1;
 }
+
+/**
+ * Checks keys are sorted and within the bounds set by the parent, and that
+ * all leaves are at the same depth.
+ */
+static int check_bnode(struct bnode* node, int64_t low, int64_t high, int depth, int* leaf_depth) {
+    for (int i = 0; i < node->num_keys; i++) {
+        int64_t key = key_to_int(node->keys[i].key);
+        if (key <= low || key >= high || (i > 0 && !key_less(node->keys[i-1].key, node->keys[i].key))) {
+            return 0;
+        }
+    }
+
+    if (node->leaf) {
+        int same = *leaf_depth < 0 || *leaf_depth == depth;
+        *leaf_depth = depth;
+        return same;
+    }
+
+    for (int i = 0; i < node->num_keys + 1; i++) {
+        int64_t l = (i > 0) ? key_to_int(node->keys[i-1].key) : low;
+        int64_t h = (i < node->num_keys) ? key_to_int(node->keys[i].key) : high;
+        if (!node->links[i] || !check_bnode(node->links[i], l, h, depth + 1, leaf_depth)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Runs random inserts and deletes against a store in the given mode, checking
+ * the structure of the tree after each one and the values held at the end.
+ */
+static void random_operations(enum store_mode mode, int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 3, 1, 4, 1 };
+    int branchings[] = { 3, 4, 8 };
+
+    for (int b = 0; b < sizeof(branchings)/sizeof(branchings[0]); b++) {
+        struct store_options options = { .mode = mode };
+        struct btree* tree = init_store_with(branchings[b], 1, &options);
+        char present[300] = { 0 };
+        int result = 1;
+        srand(b + 1);
+
+        for (int step = 0; step < 3000 && result; step++) {
+            uint32_t key = rand() % 300;
+            char message[16];
+            sprintf(message, "v%u", key);
+
+            if (rand() % 3 < 2) {
+                int expected = present[key] ? 1 : 0;
+                result = btree_insert(key_from_int(key), message, strlen(message), encrypt_key, key, tree) == expected;
+                present[key] = 1;
+            } else {
+                result = btree_delete(key_from_int(key), tree) == present[key];
+                present[key] = 0;
+            }
+
+            int leaf_depth = -1;
+            result = result && check_bnode(tree->root, -1, INT64_MAX, 0, &leaf_depth);
+        }
+
+        for (uint32_t key = 0; key < 300 && result; key++) {
+            char expected[16], buffer[16] = { 0 };
+            sprintf(expected, "v%u", key);
+            int found = btree_decrypt(key_from_int(key), buffer, tree) == 0;
+            result = (found == present[key]) && (!found || strcmp(buffer, expected) == 0);
+        }
+
+        close_store(tree);
+        *(result ? passed : failed) += 1;
+    }
+}
+
+void test_btree_random(int* passed, int* failed) {
+    random_operations(STORE_BTREE, passed, failed);
+}
+
+void test_btree_top_down(int* passed, int* failed) {
+    random_operations(STORE_TOP_DOWN, passed, failed);
+}
+
+static int sum_keys(bkey_t key, struct info* info, void* context) {
+    *((uint64_t*) context) += key_to_int(key);
+    return 0;
+}
+
+void test_btree_range(int* passed, int* failed) {
+    struct btree* tree = init_store(4, 1);
+    for (int i = 0; i < 50; i++) {
+        wrap_tree_insert(tree, (i * 7) % 50);
+    }
+
+    uint64_t sum = 0;
+    uint64_t count = btree_range(key_from_int(10), key_from_int(19), sum_keys, &sum, tree);
+    int result = count == 10 && sum == 145;
+
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
+
+static int count_rekeyed(bkey_t key, struct info* info, void* context) {
+    *(uint32_t*) context += info->key[0] == 5 && info->key[3] == 8;
+    return 0;
+}
+
+void test_btree_parallel(int* passed, int* failed) {
+    int result = 1;
+
+    for (int mode = STORE_BTREE; mode <= STORE_TOP_DOWN; mode += STORE_TOP_DOWN) {
+        struct store_options options = { .mode = mode };
+        struct btree* tree = init_store_with(8, 4, &options);
+        struct pool* pool = tree->pool;
+        uint32_t count = BTREE_PARALLEL_KEYS + 1000;
+        for (uint32_t i = 0; i < count; i++) {
+            wrap_tree_insert(tree, (i * 7919) % count);
+        }
+
+        // the parallel export lists the same nodes as the serial walk
+        struct node* list;
+        uint64_t listed = btree_export(tree, &list);
+        uint64_t expected = listing_nodes(tree->root, NULL);
+        struct node* serial = malloc(expected * sizeof(struct node));
+        listing_nodes(tree->root, serial);
+
+        result = result && listed == expected;
+        for (uint64_t i = 0; i < listed; i++) {
+            result = result && list[i].num_keys == serial[i].num_keys
+                && memcmp(list[i].keys, serial[i].keys, list[i].num_keys * sizeof(bkey_t)) == 0;
+            free(list[i].keys);
+            free(serial[i].keys);
+        }
+
+        free(list);
+        free(serial);
+
+        // and the parallel rekey reaches every record
+        uint32_t encrypt_key[4] = { 5, 6, 7, 8 };
+        uint32_t rekeyed = 0;
+        result = result && btree_rekey(NULL, NULL, encrypt_key, 1, tree) == 0
+            && btree_range(key_from_int(0), key_from_int(UINT32_MAX), count_rekeyed, &rekeyed, tree) == count
+            && rekeyed == count;
+
+        // the parallel check finds the same fault as the serial one would
+        struct btree_fault fault;
+        struct bnode* leaf = tree->root;
+        while (!leaf->leaf) {
+            leaf = leaf->links[leaf->num_keys];
+        }
+
+        result = result && btree_verify(tree, &fault) == 0;
+        bkey_t first = leaf->keys[0].key;
+        leaf->keys[0].key = key_from_int(key_to_int(first) + 1000000);
+        result = result && btree_verify(tree, &fault) == 1 && fault.node == leaf
+            && fault.kind == VERIFY_ORDER && fault.slot == 1;
+        leaf->keys[0].key = first;
+
+        // every walk ran on the store's one pool, which is left idle
+        result = result && pool != NULL && tree->pool == pool
+            && pool->pending == 0 && pool->queued == 0;
+        close_store(tree);
+    }
+
+    *(result ? passed : failed) += 1;
+}
@@ -0,0 +1,229 @@
+#include <pthread.h>
+
+#include "../btreestore.h"
+#include "../btree.h"
+#include "../bwtree.h"
+#include "test.h"
+
+#define WRITERS (8)
+#define WRITER_KEYS (2000)
+
+// HELPER FUNCTIONS
+
+static int count_keys(bkey_t key, struct info* info, void* context) {
+    int64_t* state = context;
+    if ((int64_t) key_to_int(key) <= state[1]) {
+        state[0] = -1;
+        return 1;
+    }
+
+    state[0] += 1;
+    state[1] = key_to_int(key);
+    return 0;
+}
+
+static struct bwpage* page_at(struct bwtree* index, uint64_t pid) {
+    return index->chunks[pid >> BWTREE_CHUNK_BITS][pid & ((1 << BWTREE_CHUNK_BITS) - 1)];
+}
+
+/**
+ * Checks that every page id below num_pages names a page or was handed back,
+ * so none leak when installs fail.
+ */
+static int check_pids(struct bwtree* index) {
+    uint64_t named = 0;
+    for (uint64_t pid = 0; pid < index->num_pages; pid++) {
+        named += page_at(index, pid) != NULL;
+    }
+
+    return named + index->num_free == index->num_pages;
+}
+
+/**
+ * Checks that a range over every key and the leaves of an export, which are
+ * listed last and left to right, both hold every record in order.
+ */
+static int check_bwtree(struct btree* tree, int64_t expected) {
+    int64_t state[2] = { 0, -1 };
+    btree_range(key_from_int(0), key_from_int(UINT32_MAX), count_keys, state, tree);
+    if (state[0] != expected) {
+        return 0;
+    }
+
+    // the leftmost link of a page never changes, so it is found in the base
+    struct bwtree* index = tree->index;
+    struct bwpage* page = page_at(index, index->root);
+    while (page->level > 0) {
+        while (page->kind != BW_BASE) {
+            page = page->next;
+        }
+
+        page = page_at(index, page->base.links[0]);
+    }
+
+    uint64_t leaves = 1;
+    for (; page->bounded; leaves++) {
+        page = page_at(index, page->right);
+    }
+
+    struct node* list;
+    uint64_t count = btree_export(tree, &list);
+    int64_t total = 0, previous = -1;
+    int result = count >= leaves;
+
+    for (uint64_t i = count - leaves; i < count && result; i++) {
+        for (int k = 0; k < list[i].num_keys; k++) {
+            result = result && (int64_t) key_to_int(list[i].keys[k]) > previous;
+            previous = key_to_int(list[i].keys[k]);
+        }
+
+        total += list[i].num_keys;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        free(list[i].keys);
+    }
+
+    free(list);
+    return result && total == expected;
+}
+
+struct writer {
+    struct btree* tree;
+    uint32_t first;
+    int result;
+};
+
+/**
+ * Inserts its own keys, interleaved with every other writer's, then deletes
+ * every other one of them.
+ */
+static void* write_keys(void* argument) {
+    struct writer* writer = argument;
+    uint32_t encrypt_key[4] = { 2, 7, 1, 8 };
+    writer->result = 1;
+
+    for (uint32_t i = 0; i < WRITER_KEYS; i++) {
+        uint32_t key = i * WRITERS + writer->first;
+        writer->result &= btree_insert(key_from_int(key), &key, sizeof(key), encrypt_key, key, writer->tree) == 0;
+    }
+
+    for (uint32_t i = 0; i < WRITER_KEYS; i += 2) {
+        uint32_t key = i * WRITERS + writer->first;
+        writer->result &= btree_delete(key_from_int(key), writer->tree) == 1;
+    }
+
+    return NULL;
+}
+
+// TESTING
+
+void test_bwtree_random(int* passed, int* failed) {
+    struct store_options options = { .mode = STORE_BWTREE };
+    uint32_t encrypt_key[4] = { 3, 1, 4, 1 };
+    int branchings[] = { 3, 4, 8, 32 };
+
+    for (int b = 0; b < sizeof(branchings)/sizeof(branchings[0]); b++) {
+        struct btree* tree = init_store_with(branchings[b], 1, &options);
+        char present[300] = { 0 };
+        int64_t size = 0;
+        int result = 1;
+        srand(b + 1);
+
+        for (int step = 0; step < 3000 && result; step++) {
+            uint32_t key = rand() % 300;
+            char message[16];
+            sprintf(message, "v%u", key);
+
+            if (rand() % 3 < 2) {
+                int expected = present[key] ? 1 : 0;
+                result = btree_insert(key_from_int(key), message, strlen(message), encrypt_key, key, tree) == expected;
+                size += !present[key];
+                present[key] = 1;
+            } else {
+                result = btree_delete(key_from_int(key), tree) == present[key];
+                size -= present[key];
+                present[key] = 0;
+            }
+
+            result = result && check_bwtree(tree, size);
+        }
+
+        for (uint32_t key = 0; key < 300 && result; key++) {
+            char expected[16], buffer[16] = { 0 };
+            sprintf(expected, "v%u", key);
+            int found = btree_decrypt(key_from_int(key), buffer, tree) == 0;
+            result = (found == present[key]) && (!found || strcmp(buffer, expected) == 0);
+        }
+
+        close_store(tree);
+        *(result ? passed : failed) += 1;
+    }
+}
+
+void test_bwtree_concurrent(int* passed, int* failed) {
+    struct store_options options = { .mode = STORE_BWTREE };
+    struct btree* tree = init_store_with(8, WRITERS, &options);
+    struct writer writers[WRITERS];
+    pthread_t threads[WRITERS];
+    int result = 1;
+
+    for (int i = 0; i < WRITERS; i++) {
+        writers[i] = (struct writer) { .tree = tree, .first = i };
+        pthread_create(&threads[i], NULL, write_keys, &writers[i]);
+    }
+
+    for (int i = 0; i < WRITERS; i++) {
+        pthread_join(threads[i], NULL);
+        result = result && writers[i].result;
+    }
+
+    // every odd numbered key of each writer is left
+    for (uint32_t key = 0; key < WRITERS * WRITER_KEYS && result; key++) {
+        uint32_t value = 0;
+        int found = btree_decrypt(key_from_int(key), &value, tree) == 0;
+        result = found == ((key / WRITERS) % 2 == 1) && (!found || value == key);
+    }
+
+    result = result && check_bwtree(tree, WRITERS * WRITER_KEYS / 2);
+    result = result && check_pids(tree->index);
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
+
+void test_bwtree_full_table(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    struct store_options options = { .mode = STORE_BWTREE };
+    struct btree* tree = init_store_with(4, 1, &options);
+
+    // leave room for only a few more pages
+    struct bwtree* index = tree->index;
+    index->num_pages = BWTREE_MAX_PAGES - 4;
+
+    int64_t inserted = 0;
+    int refused = 0, result = 1;
+    for (uint32_t key = 0; key < 200; key++) {
+        if (btree_insert(key_from_int(key), &key, sizeof(key), encrypt_key, key, tree) == 0) {
+            // once refused, every later insert is too
+            result = result && !refused;
+            inserted += 1;
+        } else {
+            refused = 1;
+        }
+    }
+
+    result = result && refused && index->num_pages == BWTREE_MAX_PAGES;
+
+    for (uint32_t key = 0; key < 200 && result; key++) {
+        uint32_t value = 0;
+        int found = btree_decrypt(key_from_int(key), &value, tree) == 0;
+        result = found == (key < inserted) && (!found || value == key);
+    }
+
+    int64_t state[2] = { 0, -1 };
+    btree_range(key_from_int(0), key_from_int(UINT32_MAX), count_keys, state, tree);
+    result = result && state[0] == inserted;
+
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
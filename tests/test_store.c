@@ -1,5 +1,8 @@
 #include "../btreestore.h"
 #include "../btree.h"
+#include "../arena.h"
+#include "../partition.h"
+#include "../epoch.h"
 #include "./test.h"
 
 void test_store_init(int* passed, int* failed) {
@@ -19,20 +22,20 @@ void test_store_freeing(int* passed, int* failed) {
 
     uint32_t encrypt_key[4] = { 1, 2, 3, 4};
     char placeholder[100] = "hello";
-    btree_insert(5, placeholder,  4, encrypt_key, 123, tree);
+    btree_insert(key_from_int(5), placeholder,  4, encrypt_key, 123, tree);
     char buffer[50];
-    btree_decrypt(5, buffer, tree);
+    btree_decrypt(key_from_int(5), buffer, tree);
     printf("buffer '%s'\n", buffer);
 
-    btree_insert(6, "asdfdas",  7, encrypt_key, 123, tree);
-    btree_insert(10, "asdfdas", 8, encrypt_key, 123, tree);
-    btree_insert(25, "asdfdas", 8, encrypt_key, 123, tree);
-    btree_insert(24, "asdfdas", 8, encrypt_key, 123, tree);
-    btree_insert(25, "asdfdas", 6, encrypt_key, 123, tree);
-    btree_insert(26, "asdfdas", 8, encrypt_key, 123, tree);
-    btree_insert(27, "asdfdas", 8, encrypt_key, 123, tree);
-    btree_insert(28, "asdfdas", 8, encrypt_key, 123, tree);
-    btree_insert(29, "asdfdas", 8, encrypt_key, 123, tree);
+    btree_insert(key_from_int(6), "asdfdas",  7, encrypt_key, 123, tree);
+    btree_insert(key_from_int(10), "asdfdas", 8, encrypt_key, 123, tree);
+    btree_insert(key_from_int(25), "asdfdas", 8, encrypt_key, 123, tree);
+    btree_insert(key_from_int(24), "asdfdas", 8, encrypt_key, 123, tree);
+    btree_insert(key_from_int(25), "asdfdas", 6, encrypt_key, 123, tree);
+    btree_insert(key_from_int(26), "asdfdas", 8, encrypt_key, 123, tree);
+    btree_insert(key_from_int(27), "asdfdas", 8, encrypt_key, 123, tree);
+    btree_insert(key_from_int(28), "asdfdas", 8, encrypt_key, 123, tree);
+    btree_insert(key_from_int(29), "asdfdas", 8, encrypt_key, 123, tree);
 
     free_node(tree, tree->root->links[1]);
 
@@ -62,7 +65,7 @@ void test_store_insert_retrieve(int* passed, int* failed) {
 
     for (int i = 0; i < sizeof(tests)/sizeof(tests[0]); i++) {
         btree_insert(
-            tests[i].key,
+            key_from_int(tests[i].key),
             tests[i].message,
             tests[i].size,
             tests[i].encrypt_key,
@@ -71,10 +74,10 @@ void test_store_insert_retrieve(int* passed, int* failed) {
         );
 
         struct info found = { 0, { 0, 0, 0, 0 }, 0, NULL };
-        btree_retrieve(tests[i].key, &found, tree);
+        btree_retrieve(key_from_int(tests[i].key), &found, tree);
 
         void* buffer = malloc(1000);
-        btree_decrypt(tests[i].key, buffer, tree);
+        btree_decrypt(key_from_int(tests[i].key), buffer, tree);
 
         int result = 1;
         for (int j=0; j < found.size; j++) {
@@ -90,3 +93,1168 @@ void test_store_insert_retrieve(int* passed, int* failed) {
 
     close_store(tree);
 }
+
+void test_store_streaming(int* passed, int* failed) {
+    struct btree* tree = init_store(3, 3);
+    uint32_t encrypt_key[4] = { 7, 1, 9, 3 };
+
+    // large enough to be chained across several chunks
+    size_t size = CHUNK_BYTES * 2 + 13;
+    char* message = malloc(size);
+    for (int i = 0; i < size; i++) {
+        message[i] = 'a' + (i * 7) % 26;
+    }
+
+    void* stream = btree_insert_begin(key_from_int(44), size, encrypt_key, 99, tree);
+    size_t written = 0;
+    while (written < size) {
+        size_t count = (size - written < 1001) ? size - written : 1001;
+        btree_insert_write(stream, message + written, count);
+        written += count;
+    }
+
+    int result = btree_insert_commit(stream) == 0
+        && btree_insert_begin(key_from_int(44), 1, encrypt_key, 99, tree) == NULL;
+
+    struct info found = { 0, { 0, 0, 0, 0 }, 0, NULL };
+    btree_retrieve(key_from_int(44), &found, tree);
+    result = result && (found.flags & INFO_CHAINED) && found.size == size;
+
+    // whole value at once
+    char* output = malloc(size);
+    btree_decrypt(key_from_int(44), output, tree);
+    result = result && memcmp(output, message, size) == 0;
+
+    // odd sized reads which split blocks and chunks
+    memset(output, 0, size);
+    stream = btree_decrypt_begin(key_from_int(44), tree);
+    size_t offset = 0, count;
+    while ((count = btree_decrypt_read(stream, output + offset, 13)) > 0) {
+        offset += count;
+    }
+
+    btree_decrypt_end(stream);
+    result = result && offset == size && memcmp(output, message, size) == 0;
+
+    // committing a short write fails and leaves the key absent
+    stream = btree_insert_begin(key_from_int(45), 16, encrypt_key, 99, tree);
+    btree_insert_write(stream, message, 8);
+    result = result && btree_insert_commit(stream) == 1
+        && btree_retrieve(key_from_int(45), &found, tree) == 1;
+
+    // sizes which do not fit the info are refused before any byte is read
+    size_t oversized = (size_t) VALUE_MAX_BYTES + 1;
+    result = result && btree_insert_begin(key_from_int(46), oversized, encrypt_key, 99, tree) == NULL
+        && btree_insert(key_from_int(46), message, oversized, encrypt_key, 99, tree) == 1
+        && btree_upsert(key_from_int(46), message, oversized, encrypt_key, 99, tree) == 1
+        && btree_update(key_from_int(44), message, oversized, encrypt_key, 99, tree) == 1
+        && btree_retrieve(key_from_int(46), &found, tree) == 1;
+
+    free(output);
+    free(message);
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
+
+void test_store_delete_data(int* passed, int* failed) {
+    int sequence[] = { 3, 7, 13, 2, 5, 11, 17, 19, 20, 21 };
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    struct btree* tree = init_store(4, 4);
+
+    for (int i = 0; i < 10; i++) {
+        btree_insert(key_from_int(sequence[i]), "abcdefgh", 8, encrypt_key, 123, tree);
+    }
+
+    // deleting these merges nodes, moving keys down from their parents
+    btree_delete(key_from_int(3), tree);
+    btree_delete(key_from_int(5), tree);
+    btree_delete(key_from_int(2), tree);
+
+    int remaining[] = { 7, 13, 11, 17, 19, 20, 21 };
+    int result = 1;
+    char buffer[9] = { 0 };
+    for (int i = 0; i < 7; i++) {
+        result = result
+            && btree_decrypt(key_from_int(remaining[i]), buffer, tree) == 0
+            && strcmp(buffer, "abcdefgh") == 0;
+    }
+
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
+
+void test_store_stats(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    struct btree_stats stats;
+
+    // stats are off unless asked for
+    struct btree* plain = init_store(4, 1);
+    int result = btree_stats(plain, &stats) == 1 && stats.inserts == 0;
+    close_store(plain);
+
+    struct store_options options = { .stats = 1 };
+    struct btree* tree = init_store_with(4, 1, &options);
+
+    for (uint32_t key = 0; key < 50; key++) {
+        btree_insert(key_from_int(key), "abcdefgh", 8, encrypt_key, key, tree);
+    }
+
+    char buffer[9] = { 0 };
+    btree_decrypt(key_from_int(10), buffer, tree);
+    btree_decrypt(key_from_int(99), buffer, tree);
+
+    for (uint32_t key = 0; key < 40; key++) {
+        btree_delete(key_from_int(key), tree);
+    }
+
+    result = result && btree_stats(tree, &stats) == 0
+        && stats.inserts == 50
+        && stats.lookups == 2 && stats.misses == 1
+        && stats.deletes == 40
+        && stats.splits > 0 && stats.root_grows > 0
+        && stats.merges > 0 && stats.root_shrinks > 0
+        && stats.bytes_encrypted == 400 && stats.bytes_decrypted == 8
+        && stats.allocations >= 50 + stats.splits;
+
+    struct btree_histogram* inserts = &stats.latency[STATS_INSERT];
+    uint64_t p50 = btree_stats_percentile(inserts, 0.5);
+    result = result && inserts->count == 50
+        && stats.latency[STATS_DELETE].count == 40
+        && p50 > 0 && p50 <= btree_stats_percentile(inserts, 0.99)
+        && btree_stats_percentile(inserts, 0.99) <= inserts->max_ns;
+
+    // updates and upserts are timed apart from inserts, even upserts which
+    // insert
+    for (uint32_t key = 40; key < 45; key++) {
+        btree_update(key_from_int(key), "ijklmnop", 8, encrypt_key, key, tree);
+    }
+
+    for (uint32_t key = 45; key < 49; key++) {
+        btree_upsert(key_from_int(key * 2), "ijklmnop", 8, encrypt_key, key, tree);
+    }
+
+    result = result && btree_stats(tree, &stats) == 0
+        && stats.latency[STATS_INSERT].count == 50
+        && stats.latency[STATS_UPDATE].count == 5
+        && stats.latency[STATS_UPSERT].count == 4
+        && stats.bytes_encrypted == 400 + 9 * 8;
+
+    close_store(tree);
+
+    // bytes encrypted are the bytes stored, so compressed values count the
+    // same whether inserted, updated over their buffer or upserted
+    struct store_options packing = { .stats = 1, .compress = 1 };
+    struct btree* packed = init_store_with(4, 1, &packing);
+    char zeroed[4096] = { 0 };
+    struct info found;
+
+    btree_insert(key_from_int(1), zeroed, sizeof(zeroed), encrypt_key, 1, packed);
+    btree_update(key_from_int(1), zeroed, sizeof(zeroed), encrypt_key, 2, packed);
+    btree_upsert(key_from_int(2), zeroed, sizeof(zeroed), encrypt_key, 3, packed);
+
+    result = result && btree_retrieve(key_from_int(1), &found, packed) == 0
+        && found.size < sizeof(zeroed)
+        && btree_stats(packed, &stats) == 0
+        && stats.bytes_encrypted == 3 * found.size;
+
+    close_store(packed);
+    *(result ? passed : failed) += 1;
+}
+
+void test_store_shape(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    int result = 1;
+
+    for (int mode = STORE_BTREE; mode <= STORE_TOP_DOWN; mode++) {
+        struct store_options options = { .mode = mode };
+        struct btree* tree = init_store_with(4, 1, &options);
+
+        for (uint32_t key = 0; key < 200; key++) {
+            btree_insert(key_from_int(key), "abcdefgh", 8, encrypt_key, key, tree);
+        }
+
+        // drain any buffered writes so every record sits in a node
+        uint32_t none[8] = { 0 };
+        btree_range(key_from_int(1000), key_from_int(2000), NULL, none, tree);
+
+        struct btree_shape shape;
+        result = result && btree_shape(tree, &shape, 0) == 0
+            && shape.records == 200
+            && shape.inspected == shape.nodes
+            && shape.payload_bytes == 200 * 8
+            && shape.height >= 3
+            && shape.key_bytes > 0 && shape.link_bytes > 0;
+
+        uint64_t levels = 0, fills = 0;
+        for (int i = 0; i < SHAPE_LEVELS; i++) {
+            levels += shape.level_nodes[i];
+        }
+
+        for (int i = 0; i < SHAPE_FILL_BUCKETS; i++) {
+            fills += shape.fill[i];
+        }
+
+        result = result && levels == shape.nodes && fills == shape.nodes
+            && shape.level_nodes[0] == 1;
+
+        // sampling keeps the exact counts and estimates the rest
+        struct btree_shape sampled;
+        result = result && btree_shape(tree, &sampled, 4) == 0
+            && sampled.nodes == shape.nodes
+            && sampled.records == shape.records
+            && sampled.node_bytes == shape.node_bytes
+            && sampled.inspected <= 4
+            && sampled.payload_bytes > 0;
+
+        close_store(tree);
+    }
+
+    *(result ? passed : failed) += 1;
+}
+
+// how a trace spells an integer key, string keys being written in hex
+static void trace_key(char* out, size_t size, uint64_t value) {
+#if BTREE_KEY_WIDTH == 0
+    snprintf(out, size, "\"key\": \"%016" PRIx64 "\",", value);
+#else
+    snprintf(out, size, "\"key\": %" PRIu64 ",", value);
+#endif
+}
+
+void test_store_trace(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+
+    struct btree* plain = init_store(3, 1);
+    int result = btree_trace_dump(plain, "bin/trace.json") == 1;
+    close_store(plain);
+
+    // each thread keeps only its last 8 calls
+    struct store_options options = { .trace_events = 8 };
+    struct btree* tree = init_store_with(3, 1, &options);
+
+    for (uint32_t key = 0; key < 20; key++) {
+        btree_insert(key_from_int(key), "abcdefgh", 8, encrypt_key, key, tree);
+    }
+
+    btree_delete(key_from_int(19), tree);
+    result = result && btree_trace_dump(tree, "bin/trace.json") == 0;
+    close_store(tree);
+
+    char contents[4096] = { 0 };
+    FILE* file = fopen("bin/trace.json", "r");
+    result = result && file != NULL;
+    if (file) {
+        fread(contents, 1, sizeof(contents) - 1, file);
+        fclose(file);
+    }
+
+    char deleted[64], evicted[64];
+    trace_key(deleted, sizeof(deleted), 19);
+    trace_key(evicted, sizeof(evicted), 11);
+
+    int events = 0;
+    for (char* at = contents; (at = strstr(at, "\"ph\": \"X\"")); at++) {
+        events += 1;
+    }
+
+    result = result && events == 8
+        && strstr(contents, "\"traceEvents\"") != NULL
+        && strstr(contents, "\"name\": \"delete\"") != NULL
+        && strstr(contents, deleted) != NULL
+        && strstr(contents, evicted) == NULL
+        && strstr(contents, "\"depth\": 0,") == NULL
+        && strstr(contents, "\"splits\": 0,") != NULL
+        && strstr(contents, "\"splits\": 1,") != NULL;
+
+    *(result ? passed : failed) += 1;
+}
+
+static int count_keys(bkey_t key, struct info* info, void* context) {
+    *((uint64_t*) context) += 1;
+    return 0;
+}
+
+void test_store_snapshot(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+
+    struct btree* plain = init_store(4, 1);
+    int result = btree_snapshot(plain) == NULL;
+    close_store(plain);
+
+    struct store_options options = { .mode = STORE_TOP_DOWN };
+    struct btree* tree = init_store_with(4, 1, &options);
+    for (uint32_t key = 0; key < 200; key++) {
+        btree_insert(key_from_int(key), "abcdefgh", 8, encrypt_key, key, tree);
+    }
+
+    struct btree* before = btree_snapshot(tree);
+    for (uint32_t key = 0; key < 200; key += 2) {
+        btree_delete(key_from_int(key), tree);
+    }
+
+    struct btree* after = btree_snapshot(tree);
+    for (uint32_t key = 200; key < 300; key++) {
+        btree_insert(key_from_int(key), "ijklmnop", 8, encrypt_key, key, tree);
+    }
+
+    // each view keeps the keys and values it was taken with
+    uint64_t counts[3] = { 0 };
+    btree_range(key_from_int(0), key_from_int(1000), count_keys, &counts[0], before);
+    btree_range(key_from_int(0), key_from_int(1000), count_keys, &counts[1], after);
+    btree_range(key_from_int(0), key_from_int(1000), count_keys, &counts[2], tree);
+    result = result && counts[0] == 200 && counts[1] == 100 && counts[2] == 200;
+
+    char buffer[9] = { 0 };
+    result = result && btree_decrypt(key_from_int(10), buffer, before) == 0 && strcmp(buffer, "abcdefgh") == 0
+        && btree_decrypt(key_from_int(10), buffer, after) == 1
+        && btree_decrypt(key_from_int(250), buffer, after) == 1
+        && btree_delete(key_from_int(11), before) == 0
+        && btree_insert(key_from_int(1000), "abcdefgh", 8, encrypt_key, 0, before) == 1;
+
+    struct node* list = NULL;
+    uint64_t nodes = btree_export(before, &list);
+    uint64_t keys = 0;
+    for (uint64_t i = 0; i < nodes; i++) {
+        keys += list[i].num_keys;
+        free(list[i].keys);
+    }
+
+    free(list);
+    result = result && keys == 200;
+
+    // releasing the older snapshot first leaves the newer one intact
+    btree_snapshot_release(before);
+    memset(counts, 0, sizeof(counts));
+    btree_range(key_from_int(0), key_from_int(1000), count_keys, &counts[1], after);
+    result = result && counts[1] == 100;
+
+    btree_snapshot_release(after);
+    for (uint32_t key = 1; key < 200; key += 2) {
+        btree_delete(key_from_int(key), tree);
+    }
+
+    memset(counts, 0, sizeof(counts));
+    btree_range(key_from_int(0), key_from_int(1000), count_keys, &counts[2], tree);
+    result = result && counts[2] == 100;
+
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
+
+void test_store_pin(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    int result = 1;
+
+    for (int mode = STORE_BTREE; mode <= STORE_TOP_DOWN; mode++) {
+        struct store_options options = { .mode = mode };
+        struct btree* tree = init_store_with(4, 1, &options);
+        for (uint32_t key = 0; key < 100; key++) {
+            btree_insert(key_from_int(key), "abcdefghijklmnop", 16, encrypt_key, key, tree);
+        }
+
+        // a pinned value outlives its key
+        btree_pin(tree);
+        struct info found;
+        result = result && btree_retrieve(key_from_int(7), &found, tree) == 0;
+
+        uint8_t copy[16];
+        memcpy(copy, found.data, sizeof(copy));
+        void* stream = btree_decrypt_begin(key_from_int(8), tree);
+
+        for (uint32_t key = 0; key < 100; key++) {
+            btree_delete(key_from_int(key), tree);
+        }
+
+        // ensure buffered deletes reach the leaves
+        btree_range(key_from_int(0), key_from_int(100), NULL, NULL, tree);
+
+        char buffer[17] = { 0 };
+        result = result && memcmp(copy, found.data, sizeof(copy)) == 0
+            && btree_decrypt_read(stream, buffer, 16) == 16
+            && strcmp(buffer, "abcdefghijklmnop") == 0;
+
+        btree_decrypt_end(stream);
+        btree_unpin(tree);
+
+        // with nothing pinned, retired values are freed by the next delete
+        btree_insert(key_from_int(1), "abcdefgh", 8, encrypt_key, 1, tree);
+        result = result && btree_delete(key_from_int(1), tree) == 1;
+        close_store(tree);
+    }
+
+    *(result ? passed : failed) += 1;
+}
+
+struct pin_worker {
+    struct btree* tree;
+    uint32_t key;
+};
+
+static void* delete_and_exit(void* context) {
+    struct pin_worker* worker = context;
+    btree_delete(key_from_int(worker->key), worker->tree);
+    return NULL;
+}
+
+// each worker gets a larger stack than the last, so it cannot reuse an
+// exited worker's stack and with it that worker's thread id
+static void run_worker(struct btree* tree, uint32_t key) {
+    struct pin_worker worker = { .tree = tree, .key = key };
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, (256 + 16 * key) * 1024);
+
+    pthread_t thread;
+    pthread_create(&thread, &attributes, delete_and_exit, &worker);
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attributes);
+}
+
+void test_store_pin_threads(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    struct btree* tree = init_store(4, 1);
+    for (uint32_t key = 0; key < 64; key++) {
+        btree_insert(key_from_int(key), "abcdefghijklmnop", 16, encrypt_key, key, tree);
+    }
+
+    // threads which retire values under a pin and exit hand their records
+    // on, so the values they could not free are not lost with them
+    btree_pin(tree);
+    for (uint32_t key = 0; key < 32; key++) {
+        run_worker(tree, key);
+    }
+
+    int records = 0;
+    uint64_t retired = 0;
+    for (struct epoch_record* record = tree->epochs->records; record; record = record->next) {
+        records += 1;
+        retired += record->limbo[0].count + record->limbo[1].count + record->limbo[2].count;
+    }
+
+    int result = records == 2 && retired == 32;
+    btree_unpin(tree);
+
+    // the next thread takes over what was left and frees it unpinned
+    run_worker(tree, 32);
+
+    records = 0;
+    retired = 0;
+    for (struct epoch_record* record = tree->epochs->records; record; record = record->next) {
+        records += 1;
+        retired += record->limbo[0].count + record->limbo[1].count + record->limbo[2].count;
+    }
+
+    result = result && records == 2 && retired == 0;
+    close_store(tree);
+
+    *(result ? passed : failed) += 1;
+}
+
+static int check_order(bkey_t key, struct info* info, void* context) {
+    int64_t* state = context;
+    state[0] += (int64_t) key_to_int(key) > state[1];
+    state[1] = key_to_int(key);
+    return 0;
+}
+
+static int take_five(bkey_t key, struct info* info, void* context) {
+    uint32_t* keys = context;
+    keys[++keys[0]] = key_to_int(key);
+    return keys[0] == 5;
+}
+
+void test_store_partitions(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    enum store_mode modes[] = { STORE_BTREE, STORE_BPLUS, STORE_BEPSILON, STORE_BWTREE };
+    int result = 1;
+
+    for (int scheme = PARTITION_HASH; scheme <= PARTITION_RANGE; scheme++) {
+        for (int m = 0; m < sizeof(modes)/sizeof(modes[0]); m++) {
+            struct store_options options = { .mode = modes[m], .partitions = 5, .partition_by = scheme };
+            struct btree* tree = init_store_with(4, 1, &options);
+
+            // spread over the key space, so range partitions all get some
+            for (uint32_t i = 0; i < 500; i++) {
+                uint32_t key = (i * 7919) % 500 * 8589934;
+                result = result && btree_insert(key_from_int(key), &key, sizeof(key), encrypt_key, i, tree) == 0;
+            }
+
+            for (uint32_t i = 0; i < 500; i += 3) {
+                result = result && btree_delete(key_from_int(i * 8589934), tree) == 1;
+            }
+
+            for (uint32_t i = 0; i < 500 && result; i++) {
+                uint32_t key = i * 8589934, value = 0;
+                int found = btree_decrypt(key_from_int(key), &value, tree) == 0;
+                result = found == (i % 3 != 0) && (!found || value == key);
+            }
+
+            // ranges visit keys in order across partitions
+            int64_t state[2] = { 0, -1 };
+            result = result && btree_range(key_from_int(0), key_from_int(UINT32_MAX), check_order, state, tree) == 333 && state[0] == 333;
+
+            uint32_t keys[8] = { 0 };
+            result = result && btree_range(key_from_int(10 * 8589934), key_from_int(UINT32_MAX), take_five, keys, tree) == 5
+                && keys[1] == 10 * 8589934 && keys[5] == 16 * 8589934;
+
+            struct node* list;
+            uint64_t count = btree_export(tree, &list);
+            uint64_t total = 0;
+            for (uint64_t i = 0; i < count; i++) {
+                total += list[i].num_keys;
+                free(list[i].keys);
+            }
+
+            free(list);
+            result = result && count >= 5 && total >= 333 && tree->num_nodes == 333;
+            close_store(tree);
+        }
+    }
+
+    *(result ? passed : failed) += 1;
+}
+
+void test_store_partition_spread(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    int result = 1;
+
+    // dense keys only spread over range partitions told their span
+    for (int spanned = 0; spanned <= 1; spanned++) {
+        struct store_options options = { .partitions = 4, .partition_by = PARTITION_RANGE };
+        if (spanned) {
+            options.partition_low = key_from_int(0);
+            options.partition_high = key_from_int(999);
+        }
+
+        struct btree* tree = init_store_with(4, 1, &options);
+        for (uint32_t key = 0; key < 1000; key++) {
+            btree_insert(key_from_int((key * 7919) % 1000), &key, sizeof(key), encrypt_key, key, tree);
+        }
+
+        // keys past the span go to the last partition
+        btree_insert(key_from_int(5000), "past", 4, encrypt_key, 0, tree);
+
+        struct partitions* partitions = tree->index;
+        for (uint32_t i = 0; i < 4; i++) {
+            uint64_t expected = spanned ? 250 + (i == 3) : (i == 0) ? 1001 : 0;
+            result = result && partitions->trees[i]->num_nodes == expected;
+        }
+
+        int64_t state[2] = { 0, -1 };
+        result = result && btree_range(key_from_int(0), key_from_int(UINT32_MAX), check_order, state, tree) == 1001
+            && state[0] == 1001;
+
+        struct info first, second;
+        result = result && btree_retrieve(key_from_int(10), &first, tree) == 0
+            && btree_retrieve(key_from_int(990), &second, tree) == 0
+            && first.data != second.data;
+
+        close_store(tree);
+    }
+
+    *(result ? passed : failed) += 1;
+}
+
+static int count_rekeyed(bkey_t key, struct info* info, void* context) {
+    *(uint32_t*) context += info->key[0] == 5 && info->key[3] == 8;
+    return 0;
+}
+
+void test_store_partition_parallel(int* passed, int* failed) {
+    struct store_options options = { .partitions = 2 };
+    struct btree* tree = init_store_with(8, 4, &options);
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    uint32_t count = 2 * BTREE_PARALLEL_KEYS + 4000;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t key = (i * 7919) % count;
+        btree_insert(key_from_int(key), &key, sizeof(key), encrypt_key, key, tree);
+    }
+
+    // each partition counts its own keys, so each walks in parallel
+    struct partitions* partitions = tree->index;
+    uint64_t expected = 0, total = 0;
+    int result = 1;
+    for (uint32_t i = 0; i < 2; i++) {
+        struct btree* partition = partitions->trees[i];
+        result = result && partition->num_nodes >= BTREE_PARALLEL_KEYS;
+        expected += listing_nodes(partition->root, NULL);
+        total += partition->num_nodes;
+    }
+
+    result = result && total == count;
+
+    // the parallel export lists every node of each partition
+    struct node* list;
+    uint64_t listed = btree_export(tree, &list);
+    uint64_t keys = 0;
+    for (uint64_t i = 0; i < listed; i++) {
+        keys += list[i].num_keys;
+        free(list[i].keys);
+    }
+
+    free(list);
+    result = result && listed == expected && keys == count;
+
+    // and the parallel rekey and check reach every record
+    uint32_t rekey_key[4] = { 5, 6, 7, 8 };
+    uint32_t rekeyed = 0;
+    struct btree_fault fault;
+    result = result && btree_rekey(NULL, NULL, rekey_key, 1, tree) == 0
+        && btree_range(key_from_int(0), key_from_int(UINT32_MAX), count_rekeyed, &rekeyed, tree) == count
+        && rekeyed == count
+        && btree_verify(tree, &fault) == 0;
+
+    // deletes are taken off the partition counts
+    for (uint32_t key = 0; key < 1000; key++) {
+        btree_delete(key_from_int(key), tree);
+    }
+
+    result = result && partitions->trees[0]->num_nodes + partitions->trees[1]->num_nodes == count - 1000;
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
+
+static int even_keys(bkey_t key, struct info* info, void* context) {
+    return key_to_int(key) % 2 == 0;
+}
+
+/**
+ * Values of every size up to a few chunks, made from their key.
+ */
+static size_t rekey_value(uint32_t key, uint8_t* value) {
+    size_t size = (key % 10 == 0) ? 9000 + key : key % 40;
+    for (size_t i = 0; i < size; i++) {
+        value[i] = key * 31 + i;
+    }
+
+    return size;
+}
+
+void test_store_rekey(int* passed, int* failed) {
+    uint32_t old_key[4] = { 1, 2, 3, 4 }, new_key[4] = { 9, 8, 7, 6 };
+    static uint8_t value[9200], buffer[9200];
+    int result = 1;
+
+    // each mode, then a partitioned store, with the caller pinned for the
+    // second round so values are copied rather than rewritten in place
+    for (int round = 0; round < 10; round++) {
+        int partitioned = round % 5 == 4;
+        struct store_options options = { .mode = partitioned ? STORE_BTREE : round % 5, .partitions = partitioned ? 3 : 0 };
+        struct btree* tree = init_store_with(4, 1, &options);
+        int pinned = round >= 5;
+
+        for (uint32_t key = 0; key < 200; key++) {
+            size_t size = rekey_value(key, value);
+            btree_insert(key_from_int(key), value, size, old_key, key, tree);
+        }
+
+        struct info held;
+        uint8_t copy[16];
+        if (pinned) {
+            btree_pin(tree);
+            result = result && btree_retrieve(key_from_int(12), &held, tree) == 0;
+            memcpy(copy, held.data, sizeof(copy));
+        }
+
+        result = result && btree_rekey(even_keys, NULL, new_key, 77, tree) == 0;
+
+        if (pinned) {
+            result = result && memcmp(copy, held.data, sizeof(copy)) == 0;
+            btree_unpin(tree);
+        }
+
+        for (uint32_t key = 0; key < 200 && result; key++) {
+            struct info found;
+            size_t size = rekey_value(key, value);
+            result = btree_retrieve(key_from_int(key), &found, tree) == 0
+                && memcmp(found.key, (key % 2 == 0) ? new_key : old_key, sizeof(new_key)) == 0
+                && btree_decrypt(key_from_int(key), buffer, tree) == 0
+                && memcmp(buffer, value, size) == 0;
+        }
+
+        close_store(tree);
+    }
+
+    // Bw-tree pages are read without locks, and snapshots share payloads
+    struct store_options bwtree = { .mode = STORE_BWTREE };
+    struct btree* tree = init_store_with(4, 1, &bwtree);
+    result = result && btree_rekey(NULL, NULL, new_key, 77, tree) == 1;
+    close_store(tree);
+
+    struct store_options top_down = { .mode = STORE_TOP_DOWN };
+    tree = init_store_with(4, 1, &top_down);
+    void* snapshot = btree_snapshot(tree);
+    result = result && btree_rekey(NULL, NULL, new_key, 77, tree) == 1;
+    btree_snapshot_release(snapshot);
+    result = result && btree_rekey(NULL, NULL, new_key, 77, tree) == 0;
+    close_store(tree);
+
+    *(result ? passed : failed) += 1;
+}
+
+/**
+ * Fills options with the store a test run over every kind of store takes on
+ * the given round, each mode in turn and then a partitioned B-tree, with no
+ * other option set. Returns 0 once the rounds have run out.
+ */
+static int each_store(int round, struct store_options* options) {
+    if (round > STORE_BWTREE + 1) {
+        return 0;
+    }
+
+    memset(options, 0, sizeof(struct store_options));
+    options->mode = (round <= STORE_BWTREE) ? round : STORE_BTREE;
+    options->partitions = (round <= STORE_BWTREE) ? 0 : 3;
+    return 1;
+}
+
+void test_store_update(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    static uint8_t value[9200], buffer[9200];
+    int result = 1;
+
+    struct store_options options;
+    for (int round = 0; result && each_store(round, &options); round++) {
+        struct btree* tree = init_store_with(4, 1, &options);
+
+        for (uint32_t key = 0; key < 200; key += 2) {
+            size_t size = rekey_value(key, value);
+            btree_insert(key_from_int(key), value, size, encrypt_key, key, tree);
+        }
+
+        // absent keys are left alone by updates and inserted by upserts
+        result = result && btree_update(key_from_int(1), "abc", 3, encrypt_key, 1, tree) == 1
+            && btree_decrypt(key_from_int(1), buffer, tree) == 1;
+
+        for (uint32_t key = 0; key < 200 && result; key++) {
+            size_t size = rekey_value(key + 3, value);
+            int updated = (key % 2 == 0)
+                ? btree_update(key_from_int(key), value, size, encrypt_key, key + 1, tree)
+                : btree_upsert(key_from_int(key), value, size, encrypt_key, key + 1, tree);
+
+            memset(buffer, 0, size);
+            result = updated == 0 && btree_decrypt(key_from_int(key), buffer, tree) == 0
+                && memcmp(buffer, value, size) == 0;
+        }
+
+        result = result && tree->num_nodes == 200;
+        close_store(tree);
+    }
+
+    // a value which fits over the old one reuses its buffer, unless a pinned
+    // reader may still be holding it
+    struct btree* tree = init_store(4, 1);
+    struct info before, after;
+    btree_insert(key_from_int(7), "abcdefghijkl", 12, encrypt_key, 7, tree);
+    btree_retrieve(key_from_int(7), &before, tree);
+    btree_update(key_from_int(7), "mnopqrst", 8, encrypt_key, 8, tree);
+    btree_retrieve(key_from_int(7), &after, tree);
+    result = result && before.data == after.data && after.size == 8;
+
+    btree_pin(tree);
+    btree_upsert(key_from_int(7), "uvwxyz", 6, encrypt_key, 9, tree);
+    btree_retrieve(key_from_int(7), &before, tree);
+    result = result && before.data != after.data;
+    btree_unpin(tree);
+
+    memset(buffer, 0, 8);
+    result = result && btree_decrypt(key_from_int(7), buffer, tree) == 0 && strcmp((char*) buffer, "uvwxyz") == 0;
+    close_store(tree);
+
+    // snapshots keep the value they were taken with
+    struct store_options top_down = { .mode = STORE_TOP_DOWN };
+    tree = init_store_with(4, 1, &top_down);
+    for (uint32_t key = 0; key < 50; key++) {
+        btree_insert(key_from_int(key), "abcdefgh", 8, encrypt_key, key, tree);
+    }
+
+    void* snapshot = btree_snapshot(tree);
+    result = result && btree_update(key_from_int(10), "ijklmnop", 8, encrypt_key, 10, tree) == 0
+        && btree_upsert(key_from_int(11), "ijklmnop", 8, encrypt_key, 11, snapshot) == 1;
+
+    memset(buffer, 0, 9);
+    result = result && btree_decrypt(key_from_int(10), buffer, snapshot) == 0 && strcmp((char*) buffer, "abcdefgh") == 0
+        && btree_decrypt(key_from_int(10), buffer, tree) == 0 && strcmp((char*) buffer, "ijklmnop") == 0;
+
+    btree_snapshot_release(snapshot);
+    close_store(tree);
+    *(result ? passed : failed) += 1;
+}
+
+void test_store_verify(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    char value[64], buffer[64];
+    int result = 1;
+
+    struct store_options options;
+    for (int round = 0; result && each_store(round, &options); round++) {
+        options.macs = 1;
+        struct btree* tree = init_store_with(4, 1, &options);
+        srand(round + 1);
+
+        for (int step = 0; step < 600; step++) {
+            uint32_t key = rand() % 300;
+            sprintf(value, "value of %u", key);
+            if (rand() % 3 < 2) {
+                btree_insert(key_from_int(key), value, strlen(value) + 1, encrypt_key, key, tree);
+            } else {
+                btree_delete(key_from_int(key), tree);
+            }
+        }
+
+        sprintf(value, "value of %u", 42);
+        btree_upsert(key_from_int(42), value, strlen(value) + 1, encrypt_key, 42, tree);
+
+        struct btree_fault fault;
+        result = result && btree_verify(tree, &fault) == 0 && fault.kind == VERIFY_INTACT
+            && btree_decrypt(key_from_int(42), buffer, tree) == 0 && strcmp(buffer, value) == 0;
+
+        // a flipped bit of ciphertext is caught on reading and verifying
+        struct info found;
+        btree_retrieve(key_from_int(42), &found, tree);
+        ((uint8_t*) found.data)[3] ^= 0x10;
+        result = result && btree_decrypt(key_from_int(42), buffer, tree) == 2
+            && btree_decrypt_begin(key_from_int(42), tree) == NULL
+            && btree_verify(tree, &fault) == 1 && fault.kind == VERIFY_MAC && key_to_int(fault.key) == 42;
+
+        ((uint8_t*) found.data)[3] ^= 0x10;
+        result = result && btree_verify(tree, &fault) == 0;
+        close_store(tree);
+    }
+
+    // keys out of order are reported at the node holding them
+    struct btree* tree = init_store(8, 1);
+    for (uint32_t key = 0; key < 100; key++) {
+        btree_insert(key_from_int(key), "abcdefgh", 8, encrypt_key, key, tree);
+    }
+
+    struct bnode* leaf = tree->root;
+    while (!leaf->leaf) {
+        leaf = leaf->links[0];
+    }
+
+    struct btree_fault fault;
+    struct key_value swapped = leaf->keys[0];
+    leaf->keys[0] = leaf->keys[1];
+    leaf->keys[1] = swapped;
+    result = result && btree_verify(tree, &fault) == 1 && fault.kind == VERIFY_ORDER
+        && fault.node == leaf && fault.slot == 1 && fault.depth > 0;
+
+    leaf->keys[1] = leaf->keys[0];
+    leaf->keys[0] = swapped;
+    result = result && btree_verify(tree, &fault) == 0;
+    close_store(tree);
+
+    *(result ? passed : failed) += 1;
+}
+
+/**
+ * A small JSON document for the key, repetitive as real ones are.
+ */
+static size_t json_value(uint32_t key, char* value) {
+    int length = sprintf(value, "{\"id\": %u, \"name\": \"record %u\", \"tags\": [", key, key);
+    for (uint32_t i = 0; i < key % 20 + 4; i++) {
+        length += sprintf(value + length, "{\"tag\": \"tag-%u\", \"enabled\": %s}, ", i, (key + i) % 2 ? "true" : "false");
+    }
+
+    return length + sprintf(value + length, "null]}");
+}
+
+void test_store_compress(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    uint32_t new_key[4] = { 5, 6, 7, 8 };
+    static char value[4096], buffer[4096];
+    int result = 1;
+
+    // with MACs on the partitioned store
+    struct store_options options;
+    for (int round = 0; result && each_store(round, &options); round++) {
+        options.macs = options.partitions > 0;
+        options.compress = 1;
+
+        struct btree* tree = init_store_with(4, 1, &options);
+        uint64_t original = 0;
+
+        for (uint32_t key = 0; key < 150; key++) {
+            size_t size = json_value(key, value);
+            original += size;
+            btree_insert(key_from_int(key), value, size, encrypt_key, key, tree);
+        }
+
+        for (uint32_t key = 0; key < 150 && result; key++) {
+            size_t size = json_value(key, value);
+            struct info found;
+            memset(buffer, 0, size + 1);
+            result = btree_retrieve(key_from_int(key), &found, tree) == 0
+                && (found.flags & INFO_COMPRESSED) && found.original == size && found.size < size
+                && btree_decrypt(key_from_int(key), buffer, tree) == 0 && strcmp(buffer, value) == 0;
+        }
+
+        // the Bw-tree has no shape to report
+        struct btree_shape shape;
+        result = result && (btree_shape(tree, &shape, 0) == 1 || shape.payload_bytes < original / 2);
+
+        // updates compress, over the old buffer or into a new one
+        for (uint32_t key = 0; key < 150 && result; key += 3) {
+            size_t size = json_value(key * 7 % 150, value);
+            memset(buffer, 0, size + 1);
+            result = btree_update(key_from_int(key), value, size, encrypt_key, key + 1, tree) == 0
+                && btree_decrypt(key_from_int(key), buffer, tree) == 0 && strcmp(buffer, value) == 0;
+        }
+
+        // rekeying moves the compressed bytes, which still decompress
+        if (tree->ops->rekey) {
+            result = result && btree_rekey(NULL, NULL, new_key, 99, tree) == 0;
+        }
+
+        size_t size = json_value(149, value);
+        void* stream = btree_decrypt_begin(key_from_int(149), tree);
+        size_t done = 0;
+        while (stream && done < size) {
+            size_t read = btree_decrypt_read(stream, buffer + done, 100);
+            done += read;
+            result = result && read > 0;
+        }
+
+        result = result && stream && done == size && memcmp(buffer, value, size) == 0
+            && btree_decrypt_read(stream, buffer, 100) == 0;
+        btree_decrypt_end(stream);
+        close_store(tree);
+    }
+
+    // values which are short or do not shrink are stored as they are
+    struct store_options compressed = { .compress = 1 };
+    struct btree* tree = init_store_with(4, 1, &compressed);
+    for (int i = 0; i < 512; i++) {
+        value[i] = rand();
+    }
+
+    struct info found;
+    btree_insert(key_from_int(1), "tiny", 4, encrypt_key, 1, tree);
+    btree_insert(key_from_int(2), value, 512, encrypt_key, 2, tree);
+    result = result && btree_retrieve(key_from_int(1), &found, tree) == 0 && !(found.flags & INFO_COMPRESSED) && found.size == 4
+        && btree_retrieve(key_from_int(2), &found, tree) == 0 && !(found.flags & INFO_COMPRESSED) && found.size == 512
+        && btree_decrypt(key_from_int(2), buffer, tree) == 0 && memcmp(buffer, value, 512) == 0;
+
+    // a long run compresses to a few bytes, and decompresses byte for byte
+    memset(value, 'x', 3000);
+    btree_insert(key_from_int(3), value, 3000, encrypt_key, 3, tree);
+    result = result && btree_retrieve(key_from_int(3), &found, tree) == 0 && found.size < 32
+        && btree_decrypt(key_from_int(3), buffer, tree) == 0 && memcmp(buffer, value, 3000) == 0;
+
+    // a compressed value whose bytes are damaged does not decompress
+    ((uint8_t*) found.data)[0] ^= 0xFF;
+    result = result && btree_decrypt(key_from_int(3), buffer, tree) == 2 && btree_decrypt_begin(key_from_int(3), tree) == NULL;
+    close_store(tree);
+
+    *(result ? passed : failed) += 1;
+}
+
+void test_store_inline(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    uint32_t new_key[4] = { 5, 6, 7, 8 };
+    char value[64], buffer[64];
+    int result = 1;
+
+    // with MACs on the partitioned store
+    struct store_options options;
+    for (int round = 0; result && each_store(round, &options); round++) {
+        options.macs = options.partitions > 0;
+        options.stats = 1;
+        options.inline_values = 1;
+
+        struct btree* tree = init_store_with(4, 1, &options);
+        options.inline_values = 0;
+        struct btree* outside = init_store_with(4, 1, &options);
+
+        for (uint32_t key = 0; key < 200; key++) {
+            memset(value, 'a' + key % 26, key % 40);
+            btree_insert(key_from_int(key), value, key % 40, encrypt_key, key, tree);
+            btree_insert(key_from_int(key), value, key % 40, encrypt_key, key, outside);
+        }
+
+        // values of one or two blocks are not given buffers
+        struct btree_stats stats, outside_stats;
+        btree_stats(tree, &stats);
+        btree_stats(outside, &outside_stats);
+        result = outside_stats.allocations - stats.allocations == 5 * 16;
+        close_store(outside);
+
+        for (uint32_t key = 0; key < 200 && result; key++) {
+            struct info found;
+            memset(value, 'a' + key % 26, key % 40);
+            memset(buffer, 0, sizeof(buffer));
+            result = btree_retrieve(key_from_int(key), &found, tree) == 0
+                && !(found.flags & INFO_INLINE) == (key % 40 == 0 || key % 40 > 16)
+                && btree_decrypt(key_from_int(key), buffer, tree) == 0 && memcmp(buffer, value, key % 40) == 0;
+        }
+
+        // updates move values in and out of their records
+        for (uint32_t key = 0; key < 200 && result; key += 3) {
+            uint32_t size = (key * 7 + 11) % 40;
+            memset(value, 'A' + key % 26, size);
+            memset(buffer, 0, sizeof(buffer));
+            result = btree_update(key_from_int(key), value, size, encrypt_key, key + 1, tree) == 0
+                && btree_decrypt(key_from_int(key), buffer, tree) == 0 && memcmp(buffer, value, size) == 0;
+        }
+
+        if (tree->ops->rekey) {
+            result = result && btree_rekey(NULL, NULL, new_key, 99, tree) == 0;
+        }
+
+        struct btree_fault fault;
+        result = result && btree_verify(tree, &fault) == 0;
+
+        // a stream holds its own copy of an inline value
+        void* stream = btree_decrypt_begin(key_from_int(4), tree);
+        btree_delete(key_from_int(4), tree);
+        btree_insert(key_from_int(4), "overwritten", 11, encrypt_key, 4, tree);
+        memset(value, 'a' + 4, 4);
+        result = result && stream && btree_decrypt_read(stream, buffer, 64) == 4 && memcmp(buffer, value, 4) == 0;
+        btree_decrypt_end(stream);
+        close_store(tree);
+    }
+
+    *(result ? passed : failed) += 1;
+}
+
+void test_store_dedup(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    uint32_t new_key[4] = { 5, 6, 7, 8 };
+    char value[128], buffer[128];
+    int result = 1;
+
+    // with MACs on the partitioned store
+    struct store_options options;
+    for (int round = 0; result && each_store(round, &options); round++) {
+        options.macs = options.partitions > 0;
+        options.dedup = 1;
+
+        // ten distinct values, each under its own nonce
+        struct btree* tree = init_store_with(4, 1, &options);
+        for (uint32_t key = 0; key < 300; key++) {
+            memset(value, 'a' + key % 10, 100);
+            btree_insert(key_from_int(key), value, 100, encrypt_key, key % 10, tree);
+        }
+
+        struct info first, found;
+        for (uint32_t key = 0; key < 300 && result; key++) {
+            memset(value, 'a' + key % 10, 100);
+            memset(buffer, 0, 100);
+            result = btree_retrieve(key_from_int(key % 10), &first, tree) == 0 && btree_retrieve(key_from_int(key), &found, tree) == 0
+                && found.data == first.data
+                && btree_decrypt(key_from_int(key), buffer, tree) == 0 && memcmp(buffer, value, 100) == 0;
+        }
+
+        // the same plaintext under another nonce is another ciphertext
+        memset(value, 'a', 100);
+        btree_insert(key_from_int(1000), value, 100, encrypt_key, 1, tree);
+        btree_retrieve(key_from_int(0), &first, tree);
+        btree_retrieve(key_from_int(1000), &found, tree);
+        result = result && found.data != first.data;
+
+        // so is a streamed value, once committed
+        void* stream = btree_insert_begin(key_from_int(1001), 100, encrypt_key, 0, tree);
+        btree_insert_write(stream, value, 60);
+        btree_insert_write(stream, value, 40);
+        result = result && btree_insert_commit(stream) == 0
+            && btree_retrieve(key_from_int(1001), &found, tree) == 0 && found.data == first.data;
+
+        struct btree_shape shape;
+        result = result && (btree_shape(tree, &shape, 0) == 1 || shape.payload_bytes <= 12 * 104);
+
+        // updates and rekeys leave the other values sharing the buffer alone
+        memset(value, 'z', 100);
+        result = result && btree_update(key_from_int(10), value, 100, encrypt_key, 10, tree) == 0;
+        if (tree->ops->rekey) {
+            result = result && btree_rekey(NULL, NULL, new_key, 99, tree) == 0;
+        }
+
+        for (uint32_t key = 0; key < 300 && result; key += 2) {
+            btree_delete(key_from_int(key), tree);
+        }
+
+        for (uint32_t key = 1; key < 300 && result; key += 2) {
+            memset(value, 'a' + key % 10, 100);
+            memset(buffer, 0, 100);
+            result = btree_decrypt(key_from_int(key), buffer, tree) == 0 && memcmp(buffer, value, 100) == 0;
+        }
+
+        struct btree_fault fault;
+        result = result && btree_verify(tree, &fault) == 0;
+        close_store(tree);
+    }
+
+    *(result ? passed : failed) += 1;
+}
+
+void test_store_huge_pages(int* passed, int* failed) {
+    uint32_t encrypt_key[4] = { 1, 2, 3, 4 };
+    char value[32], buffer[32];
+    int result = 1;
+
+    // with the partitions spread over the NUMA nodes
+    struct store_options options;
+    for (int round = 0; result && each_store(round, &options); round++) {
+        options.huge_pages = 1;
+        options.numa = 1;
+
+        struct btree* tree = init_store_with(4, 1, &options);
+        char present[400] = { 0 };
+        srand(round + 1);
+
+        for (int step = 0; step < 3000; step++) {
+            uint32_t key = rand() % 400;
+            sprintf(value, "value of %u", key);
+            if (rand() % 3 < 2) {
+                btree_insert(key_from_int(key), value, strlen(value) + 1, encrypt_key, key, tree);
+                present[key] = 1;
+            } else {
+                btree_delete(key_from_int(key), tree);
+                present[key] = 0;
+            }
+        }
+
+        for (uint32_t key = 0; key < 400 && result; key++) {
+            sprintf(value, "value of %u", key);
+            int found = btree_decrypt(key_from_int(key), buffer, tree) == 0;
+            result = found == present[key] && (!found || strcmp(buffer, value) == 0);
+        }
+
+        struct btree_fault fault;
+        struct btree_shape shape;
+        result = result && btree_verify(tree, &fault) == 0
+            && (btree_shape(tree, &shape, 0) == 1 || shape.nodes > 0);
+
+        // B-trees and B+ trees take their nodes from arenas, one per partition
+        if (options.partitions == 0 && (options.mode == STORE_BTREE || options.mode == STORE_TOP_DOWN)) {
+            result = result && tree->arena && tree->arena->num_regions > 0 && tree->root->arena == tree->arena;
+        } else if (options.partitions > 0) {
+            struct partitions* partitions = tree->index;
+            for (uint32_t i = 0; i < partitions->count; i++) {
+                struct arena* arena = partitions->trees[i]->arena;
+                result = result && arena && arena->num_regions > 0 && arena->node == i % arena_nodes();
+            }
+        }
+
+        close_store(tree);
+    }
+
+    // blocks freed to an arena are handed out again, and large ones come from
+    // malloc
+    struct arena* arena = arena_create(-1);
+    void* block = arena_alloc(arena, 100);
+    memset(block, 1, 100);
+    arena_free(arena, block);
+    void* large = arena_alloc(arena, ARENA_LARGE_BYTES + 1);
+    memset(large, 1, ARENA_LARGE_BYTES + 1);
+    result = result && arena_alloc(arena, 112) == block && arena_usable_size(arena, block) == 112
+        && arena_usable_size(arena, large) == ARENA_LARGE_BYTES + 1;
+
+    arena_free(arena, block);
+    arena_free(arena, large);
+    arena_destroy(arena);
+
+    *(result ? passed : failed) += 1;
+}
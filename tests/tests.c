@@ -1,9 +1,14 @@
+#include "../bkey.h"
 #include "test.h"
 
 void test_encryption_simple(int* passed, int* failed);
 void test_encryption_ctr(int* passed, int* failed);
+void test_bkey_integers(int* passed, int* failed);
+void test_bkey_strings(int* passed, int* failed);
 void test_btree_key_index(int* passed, int* failed);
 void test_btree_insert_key(int* passed, int* failed);
+void test_btree_string_index(int* passed, int* failed);
+void test_btree_separators(int* passed, int* failed);
 void test_store_init(int* passed, int* failed);
 void test_store_freeing(int* passed, int* failed);
 void test_btree_basic_insert(int* passed, int* failed);
@@ -16,7 +21,44 @@ void test_btree_insert_massive(int* passed, int* failed);
 void test_btree_delete_simple(int* passed, int* failed);
 void test_btree_delete_collapse(int* passed, int* failed);
 void test_btree_delete_complete(int* passed, int* failed);
+void test_btree_delete_replacement(int* passed, int* failed);
+void test_btree_delete_stale(int* passed, int* failed);
+void test_btree_delete_divided(int* passed, int* failed);
+void test_btree_delete_take_link(int* passed, int* failed);
+void test_btree_delete_rotate(int* passed, int* failed);
+void test_btree_delete_combine(int* passed, int* failed);
+void test_btree_delete_split_links(int* passed, int* failed);
+void test_btree_export_empty(int* passed, int* failed);
 void test_store_insert_retrieve(int* passed, int* failed);
+void test_store_streaming(int* passed, int* failed);
+void test_store_delete_data(int* passed, int* failed);
+void test_store_stats(int* passed, int* failed);
+void test_store_shape(int* passed, int* failed);
+void test_store_trace(int* passed, int* failed);
+void test_store_snapshot(int* passed, int* failed);
+void test_store_pin(int* passed, int* failed);
+void test_store_pin_threads(int* passed, int* failed);
+void test_store_partitions(int* passed, int* failed);
+void test_store_partition_spread(int* passed, int* failed);
+void test_store_partition_parallel(int* passed, int* failed);
+void test_store_rekey(int* passed, int* failed);
+void test_store_update(int* passed, int* failed);
+void test_store_verify(int* passed, int* failed);
+void test_store_compress(int* passed, int* failed);
+void test_store_inline(int* passed, int* failed);
+void test_store_dedup(int* passed, int* failed);
+void test_store_huge_pages(int* passed, int* failed);
+void test_btree_random(int* passed, int* failed);
+void test_btree_top_down(int* passed, int* failed);
+void test_btree_range(int* passed, int* failed);
+void test_btree_parallel(int* passed, int* failed);
+void test_bplus_random(int* passed, int* failed);
+void test_bplus_range(int* passed, int* failed);
+void test_betree_random(int* passed, int* failed);
+void test_betree_range(int* passed, int* failed);
+void test_bwtree_random(int* passed, int* failed);
+void test_bwtree_concurrent(int* passed, int* failed);
+void test_bwtree_full_table(int* passed, int* failed);
 
 static struct {
     char message[50];
@@ -24,8 +66,16 @@ static struct {
 } TESTS[] = {
     { "ENCRYPTION: simple encryption",    &test_encryption_simple      },
     { "ENCRYPTION: counter encryption",   &test_encryption_ctr         },
+    { "KEYS: integer keys",               &test_bkey_integers          },
+#if BTREE_KEY_WIDTH == 0
+    { "KEYS: string keys",                &test_bkey_strings           },
+#endif
     { "INTERNAL BTREE: key index",        &test_btree_key_index        },
     { "INTERNAL BTREE: insert key",       &test_btree_insert_key       },
+#if BTREE_KEY_WIDTH == 0
+    { "INTERNAL BTREE: string index",     &test_btree_string_index     },
+    { "INTERNAL BTREE: separators",       &test_btree_separators       },
+#endif
     { "INTERNAL BTREE: traversal",        &test_btree_traversal        },
     { "STORE BTREE: initialise",          &test_store_init             },
     { "STORE BTREE: freeing",             &test_store_freeing          },
@@ -37,7 +87,44 @@ static struct {
     { "STORE BTREE: delete simple",       &test_btree_delete_simple    },
     { "STORE BTREE: delete collapse",     &test_btree_delete_collapse  },
     { "STORE BTREE: delete complete",     &test_btree_delete_complete  },
+    { "STORE BTREE: delete replacement",  &test_btree_delete_replacement },
+    { "STORE BTREE: delete stale key",    &test_btree_delete_stale     },
+    { "STORE BTREE: delete after divide", &test_btree_delete_divided   },
+    { "STORE BTREE: delete taking link",  &test_btree_delete_take_link },
+    { "STORE BTREE: delete rotation",     &test_btree_delete_rotate    },
+    { "STORE BTREE: delete combine",      &test_btree_delete_combine   },
+    { "STORE BTREE: delete split links",  &test_btree_delete_split_links },
+    { "STORE BTREE: export empty",        &test_btree_export_empty     },
     { "STORE BTREE: insert and retrive",  &test_store_insert_retrieve  },
+    { "STORE BTREE: streaming",           &test_store_streaming        },
+    { "STORE BTREE: delete with data",    &test_store_delete_data      },
+    { "STORE BTREE: stats",               &test_store_stats            },
+    { "STORE BTREE: shape",               &test_store_shape            },
+    { "STORE BTREE: trace",               &test_store_trace            },
+    { "STORE TOP DOWN: snapshots",        &test_store_snapshot         },
+    { "STORE: pinned readers",            &test_store_pin              },
+    { "STORE: pinned exiting threads",    &test_store_pin_threads      },
+    { "STORE: partitions",                &test_store_partitions       },
+    { "STORE: range partition spread",    &test_store_partition_spread },
+    { "STORE: parallel partitions",       &test_store_partition_parallel },
+    { "STORE: rekey",                     &test_store_rekey            },
+    { "STORE: update and upsert",         &test_store_update           },
+    { "STORE: verify and MACs",           &test_store_verify           },
+    { "STORE: compression",               &test_store_compress         },
+    { "STORE: inline values",             &test_store_inline           },
+    { "STORE: deduplication",             &test_store_dedup            },
+    { "STORE: huge pages",                &test_store_huge_pages       },
+    { "STORE BTREE: random operations",   &test_btree_random           },
+    { "STORE TOP DOWN: random operations", &test_btree_top_down        },
+    { "STORE BTREE: range",               &test_btree_range            },
+    { "STORE BTREE: parallel walks",      &test_btree_parallel         },
+    { "STORE BPLUS: random operations",   &test_bplus_random           },
+    { "STORE BPLUS: range",               &test_bplus_range            },
+    { "STORE BEPSILON: random operations", &test_betree_random         },
+    { "STORE BEPSILON: range",            &test_betree_range           },
+    { "STORE BWTREE: random operations",  &test_bwtree_random          },
+    { "STORE BWTREE: concurrent writers", &test_bwtree_concurrent      },
+    { "STORE BWTREE: full mapping table", &test_bwtree_full_table      },
 };
 
 int main() {
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+#include "stats.h"
+
+static const char* CALL_NAMES[] = { "insert", "retrieve", "decrypt", "delete", "range", "export", "update", "upsert" };
+
+// identifies traces in the thread cache, so a cached ring is never taken for
+// one belonging to a later trace allocated at the same address
+static uint64_t next_trace_id = 1;
+
+__thread struct trace_scratch trace_scratch;
+
+static __thread struct {
+    uint64_t id;
+    struct trace_ring* ring;
+} cached_ring;
+
+// HELPER FUNCTIONS
+
+/**
+ * The calling thread's ring, which is created the first time the thread
+ * records an event.
+ */
+static struct trace_ring* thread_ring(struct trace* trace) {
+    if (cached_ring.id == trace->id) {
+        return cached_ring.ring;
+    }
+
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&trace->lock);
+
+    struct trace_ring* ring = trace->rings;
+    while (ring && !pthread_equal(ring->thread, self)) {
+        ring = ring->next;
+    }
+
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct trace_ring) + trace->capacity * sizeof(struct trace_event));
+        ring->thread = self;
+        ring->tid = ++trace->num_rings;
+        ring->next = trace->rings;
+        trace->rings = ring;
+    }
+
+    pthread_mutex_unlock(&trace->lock);
+
+    cached_ring.id = trace->id;
+    cached_ring.ring = ring;
+    return ring;
+}
+
+static void write_key(FILE* file, bkey_t key) {
+#if BTREE_KEY_WIDTH == 0
+    fprintf(file, "\"");
+    for (int i = 0; i < key.len; i++) {
+        fprintf(file, "%02x", key.bytes[i]);
+    }
+
+    fprintf(file, "\"");
+#else
+    fprintf(file, "%" PRIu64, (uint64_t) key);
+#endif
+}
+
+// RECORDING
+
+struct trace* trace_create(uint32_t capacity) {
+    struct trace* trace = calloc(1, sizeof(struct trace));
+    trace->id = __atomic_fetch_add(&next_trace_id, 1, __ATOMIC_RELAXED);
+    trace->capacity = 1;
+    while (trace->capacity < capacity) {
+        trace->capacity <<= 1;
+    }
+
+    trace->origin_ns = clock_ns();
+    pthread_mutex_init(&trace->lock, NULL);
+    return trace;
+}
+
+void trace_destroy(struct trace* trace) {
+    struct trace_ring* ring = trace->rings;
+    while (ring) {
+        struct trace_ring* next = ring->next;
+        free(ring);
+        ring = next;
+    }
+
+    pthread_mutex_destroy(&trace->lock);
+    free(trace);
+}
+
+/**
+ * Appends an event for a finished call to the thread's ring, along with what
+ * the index noted down in the scratch space while serving the call.
+ */
+void trace_record(struct trace* trace, enum stats_call call, bkey_t key, uint64_t start, uint64_t end) {
+    struct trace_ring* ring = thread_ring(trace);
+    struct trace_event* event = &ring->events[ring->head & (trace->capacity - 1)];
+
+    event->start_ns = start;
+    event->duration_ns = end - start;
+    event->key = key;
+    event->call = call;
+    event->depth = trace_scratch.depth;
+    event->splits = trace_scratch.splits;
+    event->merges = trace_scratch.merges;
+
+    // publish the event before a dump can see it counted
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// DUMPING
+
+/**
+ * Writes the events held in every ring as complete events in the Chrome
+ * trace format, which Perfetto and chrome://tracing both open. Rings keep
+ * being written while dumping, so events from busy threads may be torn;
+ * dump while the store is idle for an exact record.
+ */
+int trace_dump(struct trace* trace, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&trace->lock);
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+    int first = 1;
+    for (struct trace_ring* ring = trace->rings; ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t oldest = (head > trace->capacity) ? head - trace->capacity : 0;
+
+        for (uint64_t i = oldest; i < head; i++) {
+            struct trace_event* event = &ring->events[i & (trace->capacity - 1)];
+
+            fprintf(file, "%s\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, ",
+                first ? "" : ",", CALL_NAMES[event->call], ring->tid);
+            fprintf(file, "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"key\": ",
+                (event->start_ns - trace->origin_ns) / 1000.0, event->duration_ns / 1000.0);
+            write_key(file, event->key);
+            fprintf(file, ", \"depth\": %u, \"splits\": %u, \"merges\": %u}}",
+                event->depth, event->splits, event->merges);
+            first = 0;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    pthread_mutex_unlock(&trace->lock);
+
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "btreestore.h"
+
+struct trace_event {
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    bkey_t key;
+    uint8_t call;
+    uint8_t depth;
+    uint16_t splits;
+    uint16_t merges;
+};
+
+/**
+ * Events recorded by one thread. Only the owning thread writes to a ring, so
+ * recording needs no lock, the newest events overwrite the oldest.
+ */
+struct trace_ring {
+    struct trace_ring* next;
+    pthread_t thread;
+    uint32_t tid;
+    uint64_t head;
+    struct trace_event events[];
+};
+
+struct trace {
+    uint64_t id;
+    uint32_t capacity;
+    uint64_t origin_ns;
+
+    // held while a thread adds its ring, and while dumping
+    pthread_mutex_t lock;
+    struct trace_ring* rings;
+    uint32_t num_rings;
+};
+
+/**
+ * What the current call did inside the index, filled in by the index as it
+ * goes and picked up when the call's event is recorded.
+ */
+struct trace_scratch {
+    uint32_t depth;
+    uint32_t splits;
+    uint32_t merges;
+};
+
+extern __thread struct trace_scratch trace_scratch;
+
+static inline void trace_begin() {
+    trace_scratch = (struct trace_scratch) { 0 };
+}
+
+// searches may run several times in a call, the deepest one is kept
+static inline void trace_reached(uint32_t depth) {
+    trace_scratch.depth = depth > trace_scratch.depth ? depth : trace_scratch.depth;
+}
+
+#define TRACE_COUNT(field) (trace_scratch.field += 1)
+
+struct trace* trace_create(uint32_t capacity);
+
+void trace_destroy(struct trace* trace);
+
+void trace_record(struct trace* trace, enum stats_call call, bkey_t key, uint64_t start, uint64_t end);
+
+int trace_dump(struct trace* trace, const char* path);
+
+#endif